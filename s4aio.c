@@ -0,0 +1,435 @@
+/*
+ * s4aio.c -- queue-depth I/O for libs4, see s4d.h
+ *
+ * Requests are vectored reads and writes at an offset.  They go
+ * through io_uring when the kernel has it, using the raw system
+ * calls so there's no liburing dependency, and otherwise through a
+ * few threads doing preadv/pwritev.  Either way the caller submits
+ * up to depth requests and collects completions in any order.
+ */
+
+#include <s4d.h>
+
+#include <pthread.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define S4_HAVE_URING
+#endif
+
+/* threads in the fallback pool */
+#define S4_AIO_NTHREADS  4
+
+struct s4_aio
+{
+  s4_aiotype      type;
+  int             depth;
+  int             inflight;     /* submitted, not yet returned by wait */
+  s4_aioreq      *done;         /* completed, not yet returned */
+  s4_aioreq      *donetail;
+  int             ndone;
+
+  /* thread pool */
+  pthread_mutex_t lock;
+  pthread_cond_t  work;         /* todo went non-empty, or quitting */
+  pthread_cond_t  fin;          /* done went non-empty */
+  s4_aioreq      *todo;
+  s4_aioreq      *todotail;
+  int             quit;
+  int             nthreads;
+  pthread_t       threads[ S4_AIO_NTHREADS ];
+
+#ifdef S4_HAVE_URING
+  int             ringfd;
+  int             unsubmitted;  /* sqes queued since last enter */
+  void           *sqmap;
+  size_t          sqmaplen;
+  void           *cqmap;
+  size_t          cqmaplen;
+  struct io_uring_sqe *sqes;
+  size_t          sqeslen;
+
+  unsigned       *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned       *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+#endif
+};
+
+
+static void s4_aio_append( s4_aioreq **headp, s4_aioreq **tailp,
+                           s4_aioreq *req )
+{
+  req->next = NULL;
+  if( *headp )
+    (*tailp)->next = req;
+  else
+    *headp = req;
+  *tailp = req;
+}
+
+static s4_aioreq *s4_aio_pop( s4_aioreq **headp )
+{
+  s4_aioreq *req = *headp;
+
+  if( req )
+    *headp = req->next;
+  return req;
+}
+
+static void s4_aio_doio( s4_aioreq *req )
+{
+  if( req->wr )
+    req->res = pwritev( req->fd, req->iov, req->niov, req->offset );
+  else
+    req->res = preadv( req->fd, req->iov, req->niov, req->offset );
+
+  if( req->res < 0 )
+    req->res = -errno;
+}
+
+
+/* ------------------ */
+/* thread pool backend */
+
+static void *s4_aio_worker( void *arg )
+{
+  s4_aio    *aio = arg;
+  s4_aioreq *req;
+
+  pthread_mutex_lock( &aio->lock );
+  for(;;)
+    {
+      while( !aio->todo && !aio->quit )
+        pthread_cond_wait( &aio->work, &aio->lock );
+      if( !aio->todo )
+        break;
+
+      req = s4_aio_pop( &aio->todo );
+      pthread_mutex_unlock( &aio->lock );
+
+      s4_aio_doio( req );
+
+      pthread_mutex_lock( &aio->lock );
+      s4_aio_append( &aio->done, &aio->donetail, req );
+      aio->ndone++;
+      pthread_cond_signal( &aio->fin );
+    }
+  pthread_mutex_unlock( &aio->lock );
+
+  return NULL;
+}
+
+static s4err s4_aio_threads_open( s4_aio *aio )
+{
+  int i;
+
+  for( i = 0; i < S4_AIO_NTHREADS; i++ )
+    {
+      if( pthread_create( &aio->threads[i], NULL, s4_aio_worker, aio ) )
+        break;
+      aio->nthreads++;
+    }
+
+  return aio->nthreads ? s4_ok : s4_error;
+}
+
+
+/* --------------- */
+/* io_uring backend */
+
+#ifdef S4_HAVE_URING
+
+static int s4_uring_enter( s4_aio *aio, unsigned submit, unsigned wait )
+{
+  int rv;
+
+  do
+    rv = syscall( __NR_io_uring_enter, aio->ringfd, submit, wait,
+                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+  while( rv < 0 && EINTR == errno );
+
+  return rv;
+}
+
+static s4err s4_aio_uring_open( s4_aio *aio )
+{
+  struct io_uring_params p;
+  char   *sq, *cq;
+
+  memset( &p, 0, sizeof(p) );
+  aio->ringfd = syscall( __NR_io_uring_setup, aio->depth, &p );
+  if( aio->ringfd < 0 )
+    return s4_open;
+
+  aio->sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  aio->cqmaplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if( p.features & IORING_FEAT_SINGLE_MMAP && aio->cqmaplen > aio->sqmaplen )
+    aio->sqmaplen = aio->cqmaplen;
+
+  aio->sqmap = mmap( NULL, aio->sqmaplen, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, aio->ringfd,
+                     IORING_OFF_SQ_RING );
+  if( MAP_FAILED == aio->sqmap )
+    goto fail;
+
+  if( p.features & IORING_FEAT_SINGLE_MMAP )
+    {
+      aio->cqmap    = aio->sqmap;
+      aio->cqmaplen = 0;
+    }
+  else
+    {
+      aio->cqmap = mmap( NULL, aio->cqmaplen, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, aio->ringfd,
+                         IORING_OFF_CQ_RING );
+      if( MAP_FAILED == aio->cqmap )
+        {
+          aio->cqmaplen = 0;
+          goto fail;
+        }
+    }
+
+  aio->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+  aio->sqes = mmap( NULL, aio->sqeslen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, aio->ringfd,
+                    IORING_OFF_SQES );
+  if( MAP_FAILED == aio->sqes )
+    {
+      aio->sqes = NULL;
+      goto fail;
+    }
+
+  sq = aio->sqmap;
+  cq = aio->cqmap;
+  aio->sqhead  = (unsigned*)(sq + p.sq_off.head);
+  aio->sqtail  = (unsigned*)(sq + p.sq_off.tail);
+  aio->sqmask  = (unsigned*)(sq + p.sq_off.ring_mask);
+  aio->sqarray = (unsigned*)(sq + p.sq_off.array);
+  aio->cqhead  = (unsigned*)(cq + p.cq_off.head);
+  aio->cqtail  = (unsigned*)(cq + p.cq_off.tail);
+  aio->cqmask  = (unsigned*)(cq + p.cq_off.ring_mask);
+  aio->cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  /* never more in flight than the sq holds, so the cq can't overflow */
+  if( aio->depth > (int)p.sq_entries )
+    aio->depth = p.sq_entries;
+
+  return s4_ok;
+
+ fail:
+  if( aio->sqes )
+    munmap( aio->sqes, aio->sqeslen );
+  if( aio->cqmaplen )
+    munmap( aio->cqmap, aio->cqmaplen );
+  if( MAP_FAILED != aio->sqmap )
+    munmap( aio->sqmap, aio->sqmaplen );
+  close( aio->ringfd );
+  aio->ringfd = -1;
+  return s4_open;
+}
+
+static void s4_aio_uring_close( s4_aio *aio )
+{
+  munmap( aio->sqes, aio->sqeslen );
+  if( aio->cqmap != aio->sqmap )
+    munmap( aio->cqmap, aio->cqmaplen );
+  munmap( aio->sqmap, aio->sqmaplen );
+  close( aio->ringfd );
+}
+
+static void s4_aio_uring_queue( s4_aio *aio, s4_aioreq *req )
+{
+  struct io_uring_sqe *sqe;
+  unsigned             tail, idx;
+
+  tail = *aio->sqtail;
+  idx  = tail & *aio->sqmask;
+  sqe  = &aio->sqes[ idx ];
+
+  memset( sqe, 0, sizeof(*sqe) );
+  sqe->opcode    = req->wr ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd        = req->fd;
+  sqe->off       = req->offset;
+  sqe->addr      = (unsigned long)req->iov;
+  sqe->len       = req->niov;
+  sqe->user_data = (unsigned long)req;
+
+  aio->sqarray[ idx ] = idx;
+  __atomic_store_n( aio->sqtail, tail + 1, __ATOMIC_RELEASE );
+  aio->unsubmitted++;
+}
+
+/* move completions to the done list, waiting for at least one */
+static s4err s4_aio_uring_reap( s4_aio *aio )
+{
+  struct io_uring_cqe *cqe;
+  s4_aioreq           *req;
+  unsigned             head;
+  int                  rv;
+
+  head = *aio->cqhead;
+  while( head == __atomic_load_n( aio->cqtail, __ATOMIC_ACQUIRE ) )
+    {
+      rv = s4_uring_enter( aio, aio->unsubmitted, 1 );
+      if( rv < 0 )
+        {
+          printf("%s waiting on io_uring\n", strerror( errno ) );
+          return s4_read;
+        }
+      aio->unsubmitted -= rv;
+    }
+
+  do
+    {
+      cqe = &aio->cqes[ head & *aio->cqmask ];
+      req = (s4_aioreq*)(unsigned long)cqe->user_data;
+      req->res = cqe->res;
+      s4_aio_append( &aio->done, &aio->donetail, req );
+      aio->ndone++;
+      head++;
+    }
+  while( head != __atomic_load_n( aio->cqtail, __ATOMIC_ACQUIRE ) );
+
+  __atomic_store_n( aio->cqhead, head, __ATOMIC_RELEASE );
+  return s4_ok;
+}
+
+#endif /* S4_HAVE_URING */
+
+
+/* ---------- */
+/* public API */
+
+s4_aio *s4_aio_open( int depth, s4_aiotype type )
+{
+  s4_aio *aio;
+  s4err   rv = s4_error;
+
+  if( !(aio = calloc( 1, sizeof(*aio) )) )
+    return NULL;
+
+  aio->depth = depth > 0 ? depth : S4_AIO_DEPTH;
+  pthread_mutex_init( &aio->lock, NULL );
+  pthread_cond_init( &aio->work, NULL );
+  pthread_cond_init( &aio->fin, NULL );
+
+#ifdef S4_HAVE_URING
+  aio->ringfd = -1;
+  if( s4_aio_threads != type && s4_ok == (rv = s4_aio_uring_open( aio )) )
+    aio->type = s4_aio_uring;
+#endif
+
+  if( s4_ok != rv && s4_aio_uring != type &&
+      s4_ok == (rv = s4_aio_threads_open( aio )) )
+    aio->type = s4_aio_threads;
+
+  if( s4_ok != rv )
+    {
+      s4_aio_close( aio );
+      return NULL;
+    }
+
+  s4_log( S4_LOG_INFO, S4_LOG_IO, "Async I/O with %s, depth %d\n",
+          s4_aio_name( aio ), aio->depth );
+  return aio;
+}
+
+
+const char *s4_aio_name( s4_aio *aio )
+{
+  return s4_aio_uring == aio->type ? "io_uring" : "threads";
+}
+
+
+s4err s4_aio_submit( s4_aio *aio, s4_aioreq *req )
+{
+  s4err rv = s4_ok;
+
+#ifdef S4_HAVE_URING
+  if( s4_aio_uring == aio->type )
+    {
+      /* full: collect some, they wait on the done list */
+      if( aio->inflight - aio->ndone >= aio->depth )
+        if( s4_ok != (rv = s4_aio_uring_reap( aio )) )
+          return rv;
+
+      s4_aio_uring_queue( aio, req );
+      aio->inflight++;
+      return s4_ok;
+    }
+#endif
+
+  pthread_mutex_lock( &aio->lock );
+  s4_aio_append( &aio->todo, &aio->todotail, req );
+  aio->inflight++;
+  pthread_cond_signal( &aio->work );
+  pthread_mutex_unlock( &aio->lock );
+
+  return rv;
+}
+
+
+s4_aioreq *s4_aio_wait( s4_aio *aio )
+{
+  s4_aioreq *req;
+
+  if( !aio->inflight )
+    return NULL;
+
+#ifdef S4_HAVE_URING
+  if( s4_aio_uring == aio->type )
+    {
+      if( !aio->done && s4_ok != s4_aio_uring_reap( aio ) )
+        return NULL;
+      req = s4_aio_pop( &aio->done );
+      aio->ndone--;
+      aio->inflight--;
+      return req;
+    }
+#endif
+
+  pthread_mutex_lock( &aio->lock );
+  while( !aio->done )
+    pthread_cond_wait( &aio->fin, &aio->lock );
+  req = s4_aio_pop( &aio->done );
+  aio->ndone--;
+  aio->inflight--;
+  pthread_mutex_unlock( &aio->lock );
+
+  return req;
+}
+
+
+void s4_aio_close( s4_aio *aio )
+{
+  int i;
+
+  if( !aio )
+    return;
+
+  /* drain whatever the caller abandoned */
+  while( s4_aio_wait( aio ) )
+    continue;
+
+  pthread_mutex_lock( &aio->lock );
+  aio->quit = 1;
+  pthread_cond_broadcast( &aio->work );
+  pthread_mutex_unlock( &aio->lock );
+  for( i = 0; i < aio->nthreads; i++ )
+    pthread_join( aio->threads[i], NULL );
+
+#ifdef S4_HAVE_URING
+  if( s4_aio_uring == aio->type )
+    s4_aio_uring_close( aio );
+#endif
+
+  pthread_cond_destroy( &aio->fin );
+  pthread_cond_destroy( &aio->work );
+  pthread_mutex_destroy( &aio->lock );
+  free( aio );
+}
@@ -0,0 +1,282 @@
+/*
+ * s4cache.c -- LRU cache of filesystem blocks, see s4d.h
+ *
+ * Blocks are kept in disk byte order, keyed by FS block number,
+ * hashed for lookup and on a doubly linked list for LRU.  Dirty
+ * blocks are written back when evicted or flushed.
+ */
+
+#include <s4d.h>
+
+
+static void s4_cache_unlink( s4_cblk *bp )
+{
+  bp->prev->next = bp->next;
+  bp->next->prev = bp->prev;
+}
+
+/* make bp most recently used */
+static void s4_cache_front( s4_cache *c, s4_cblk *bp )
+{
+  bp->next = c->lru.next;
+  bp->prev = &c->lru;
+  c->lru.next->prev = bp;
+  c->lru.next = bp;
+}
+
+static void s4_cache_unhash( s4_cache *c, s4_cblk *bp )
+{
+  s4_cblk **hp;
+
+  for( hp = &c->hash[ bp->fblk & c->hmask ]; *hp ; hp = &(*hp)->hnext )
+    {
+      if( *hp == bp )
+        {
+          *hp = bp->hnext;
+          break;
+        }
+    }
+}
+
+static s4err s4_cache_write( s4_filsys *fs, s4_cblk *bp )
+{
+  s4err rv;
+
+  rv = s4_filsys_write_fblk( fs, bp->fblk, bp->fsu.buf );
+  if( s4_ok == rv )
+    {
+      bp->dirty = 0;
+      fs->cache->writes++;
+    }
+  else
+    {
+      printf("cache write back of FBLK %d failed: %s\n",
+             bp->fblk, s4errstr( rv ) );
+    }
+  return rv;
+}
+
+static s4_cblk *s4_cache_find( s4_cache *c, s4_daddr fblk )
+{
+  s4_cblk *bp;
+
+  for( bp = c->hash[ fblk & c->hmask ]; bp ; bp = bp->hnext )
+    if( bp->fblk == fblk )
+      return bp;
+  return NULL;
+}
+
+
+s4err s4_filsys_cache_init( s4_filsys *fs, int nblks )
+{
+  s4_cache *c;
+  s4err     rv;
+  int       i, nhash;
+
+  if( s4_ok != (rv = s4_filsys_cache_free( fs )) )
+    return rv;
+
+  if( nblks <= 0 )
+    return s4_ok;
+
+  for( nhash = 1; nhash < nblks; nhash <<= 1 )
+    continue;
+
+  c = calloc( 1, sizeof(*c) );
+  if( c )
+    {
+      c->hash = calloc( nhash, sizeof(*c->hash) );
+      c->blks = calloc( nblks, sizeof(*c->blks) );
+    }
+  if( !c || !c->hash || !c->blks )
+    {
+      printf("no memory for %d block cache\n", nblks );
+      if( c )
+        {
+          free( c->hash );
+          free( c->blks );
+          free( c );
+        }
+      return s4_error;
+    }
+
+  pthread_mutex_init( &c->lock, NULL );
+  c->nblks = nblks;
+  c->hmask = nhash - 1;
+  c->lru.next = c->lru.prev = &c->lru;
+  for( i = 0; i < nblks; i++ )
+    {
+      c->blks[i].fblk = -1;
+      s4_cache_front( c, &c->blks[i] );
+    }
+
+  fs->cache = c;
+  return s4_ok;
+}
+
+
+/* find or load fblk; called locked */
+static s4_fsu *s4_cache_get( s4_filsys *fs, s4_daddr fblk )
+{
+  s4_cache *c = fs->cache;
+  s4_cblk  *bp;
+  char     *p;
+
+  if( (bp = s4_cache_find( c, fblk )) )
+    {
+      c->hits++;
+      s4_cache_unlink( bp );
+      s4_cache_front( c, bp );
+      return &bp->fsu;
+    }
+
+  c->misses++;
+
+  /* recycle the least recently used */
+  bp = c->lru.prev;
+  if( bp->dirty && s4_ok != s4_cache_write( fs, bp ) )
+    return NULL;
+
+  if( bp->fblk >= 0 )
+    s4_cache_unhash( c, bp );
+  bp->fblk = -1;
+
+  p = s4_filsys_blk( fs, fblk, bp->fsu.buf );
+  if( !p )
+    return NULL;
+  if( p != bp->fsu.buf )
+    memcpy( bp->fsu.buf, p, fs->bksz );
+
+  bp->fblk  = fblk;
+  bp->hnext = c->hash[ fblk & c->hmask ];
+  c->hash[ fblk & c->hmask ] = bp;
+
+  s4_cache_unlink( bp );
+  s4_cache_front( c, bp );
+
+  return &bp->fsu;
+}
+
+
+s4_fsu *s4_filsys_cache_get( s4_filsys *fs, s4_daddr fblk )
+{
+  s4_fsu   *fsu;
+
+  if( !fs->cache )
+    return NULL;
+
+  pthread_mutex_lock( &fs->cache->lock );
+  fsu = s4_cache_get( fs, fblk );
+  pthread_mutex_unlock( &fs->cache->lock );
+
+  return fsu;
+}
+
+
+s4err s4_filsys_cache_read( s4_filsys *fs, s4_daddr fblk,
+                            char *buf, int blen )
+{
+  s4_fsu   *fsu;
+
+  if( !fs->cache )
+    return s4_error;
+
+  pthread_mutex_lock( &fs->cache->lock );
+  if( (fsu = s4_cache_get( fs, fblk )) )
+    memcpy( buf, fsu->buf, blen );
+  pthread_mutex_unlock( &fs->cache->lock );
+
+  return fsu ? s4_ok : s4_read;
+}
+
+
+s4err s4_filsys_cache_write( s4_filsys *fs, s4_daddr fblk, char *buf )
+{
+  s4_cblk  *bp;
+
+  if( fs->cache )
+    {
+      pthread_mutex_lock( &fs->cache->lock );
+      if( (bp = s4_cache_find( fs->cache, fblk )) )
+        {
+          memcpy( bp->fsu.buf, buf, fs->bksz );
+          bp->dirty = 0;
+        }
+      pthread_mutex_unlock( &fs->cache->lock );
+    }
+
+  return s4_filsys_write_fblk( fs, fblk, buf );
+}
+
+
+s4err s4_filsys_cache_dirty( s4_filsys *fs, s4_daddr fblk )
+{
+  s4_cblk  *bp;
+
+  if( !fs->cache )
+    return s4_range;
+
+  pthread_mutex_lock( &fs->cache->lock );
+  if( (bp = s4_cache_find( fs->cache, fblk )) )
+    bp->dirty = 1;
+  pthread_mutex_unlock( &fs->cache->lock );
+
+  return bp ? s4_ok : s4_range;
+}
+
+
+s4err s4_filsys_cache_flush( s4_filsys *fs )
+{
+  s4_cache *c = fs->cache;
+  s4err     rv = s4_ok;
+  int       i;
+
+  if( !c )
+    return s4_ok;
+
+  pthread_mutex_lock( &c->lock );
+  for( i = 0; i < c->nblks; i++ )
+    if( c->blks[i].dirty && s4_ok != s4_cache_write( fs, &c->blks[i] ) )
+      rv = s4_write;
+  pthread_mutex_unlock( &c->lock );
+
+  return rv;
+}
+
+
+s4err s4_filsys_cache_free( s4_filsys *fs )
+{
+  s4_cache *c = fs->cache;
+  s4err     rv;
+
+  if( !c )
+    return s4_ok;
+
+  rv = s4_filsys_cache_flush( fs );
+
+  pthread_mutex_destroy( &c->lock );
+  free( c->hash );
+  free( c->blks );
+  free( c );
+  fs->cache = NULL;
+
+  return rv;
+}
+
+
+void s4_filsys_cache_show( s4_filsys *fs )
+{
+  s4_cache *c = fs->cache;
+  long      n;
+
+  if( !c )
+    {
+      printf("No block cache\n");
+      return;
+    }
+
+  n = c->hits + c->misses;
+  printf("Block cache: %d blocks, %ld hits %ld misses (%ld%%), %ld written\n",
+         c->nblks, c->hits, c->misses,
+         n ? c->hits * 100 / n : 0, c->writes );
+}
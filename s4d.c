@@ -74,12 +74,22 @@
    when going to/from native to emulated?
 */
 
+#define _GNU_SOURCE             /* fallocate, SEEK_DATA */
+
 #include <s4d.h>
 
 #include <time.h>
 #include <errno.h>
 #include <string.h>             /* strerror */
+#include <sys/uio.h>            /* preadv, pwritev */
+#include <sys/mman.h>
+#include <limits.h>
 #include <ctype.h>
+#include <fcntl.h>              /* fallocate */
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>           /* FICLONERANGE */
+#endif
 
 /* ------------------------------------------- */
 /* Types used here, but not visible to callers */
@@ -93,6 +103,22 @@ typedef struct   {
 } s4_maskname;
 
 
+/* shortest stretch of zeroes worth leaving as a hole */
+#define S4_HOLE_MIN 4096
+
+/* smallest contiguous piece worth a kernel copy over buffered I/O */
+#define S4_CLONE_MIN 65536
+
+/* the most a read will step over between runs: a track's spare */
+#define S4_SPARESZ  512
+
+/* iovecs per vectored I/O call */
+#if defined(IOV_MAX) && IOV_MAX < 256
+#define S4_IOVMAX   IOV_MAX
+#else
+#define S4_IOVMAX   256
+#endif
+
 /* --------------------- */
 /* Private constant data */
 
@@ -141,6 +167,10 @@ static void s4_vol_decode_partitions( s4_vol *vinfo,
                                        struct s4_vhbd *vhbd );
 
 static void s4_vol_get_bbt( s4_vol *vinfo );
+static void s4_vol_build_trkmap( s4_vol *vinfo );
+static void s4_vol_map( s4_vol *vinfo, int mode );
+static long s4_zero_span( const char *buf, long len, int unit, int zero );
+static s4err s4_write_sparse( int fd, char *buf, long len );
 static void s4_vol_bbt_show( s4_vol *vinfo );
 
 static int s4_checksum32( signed char *p, int len, int expect );
@@ -389,8 +419,8 @@ int s4_lba2pba( int lba, s4_bbt *bbt, int nbb, int lstrk, int heads )
                  track is alternate */
               npba = bbt[i].altblk * (lstrk + 1) + lstrk;
 
-              printf("Mapping lba %d from pba %d to %d.\n",
-                     lba, pba, npba );
+              s4_log( S4_LOG_DEBUG, S4_LOG_REMAP,
+                      "Mapping lba %d from pba %d to %d.\n", lba, pba, npba );
 
               pba = npba;
               break;
@@ -432,7 +462,8 @@ int s4_pba2lba( int pba, struct s4_bbe *bbt, int nbb, int strk, int heads )
         }
       else
         {
-          printf("Remapped PBA %d, but no bad block table!?\n", pba );
+          s4_log( S4_LOG_WARN, S4_LOG_REMAP,
+                  "Remapped PBA %d, but no bad block table!?\n", pba );
         }
     }
   
@@ -441,6 +472,73 @@ int s4_pba2lba( int pba, struct s4_bbe *bbt, int nbb, int strk, int heads )
 
 
 
+/* LBA to PBA through the track index.  Tracks with nothing bad on
+   them take the arithmetic path; the rest walk a chain that is
+   almost always one entry long. */
+int s4_vol_lba2pba( s4_vol *d, int lba )
+{
+  int track, hdsec, i;
+  int pba, npba;
+
+  if( !d->trkmap )
+    return s4_lba2pba( lba, d->bbt, d->nbb, d->lstrk, d->heads );
+
+  track = lba / d->lstrk;
+  pba   = lba + track;          /* one spare sector per track */
+
+  if( track < 0 || track >= d->ntrks || !d->trkmap[ track ].bad )
+    return pba;
+
+  hdsec = lba - track * d->lstrk;
+  for( i = d->trkmap[ track ].bad; i ; i = d->bbnext[ i ] )
+    {
+      if( hdsec == (d->bbt[i].badblk % d->pstrk) )
+        {
+          /* alternate is the last sector on the alt track */
+          npba = d->bbt[i].altblk * d->pstrk + d->lstrk;
+
+          s4_vlog( d, S4_LOG_DEBUG, S4_LOG_REMAP,
+                   "Mapping lba %d from pba %d to %d.\n", lba, pba, npba );
+
+          s4_stats_remap( &d->stats );
+          pba = npba;
+          break;
+        }
+    }
+
+  return pba;
+}
+
+
+/* PBA to LBA through the track index; only the spare sector
+   of a track can be holding somebody else's data. */
+int s4_vol_pba2lba( s4_vol *d, int pba )
+{
+  int track, i;
+
+  if( !d->trkmap )
+    {
+      /* warned here, where the handle's logging applies */
+      if( !d->nbb && pba % d->pstrk == d->pstrk - 1 )
+        {
+          s4_vlog( d, S4_LOG_WARN, S4_LOG_REMAP,
+                   "Remapped PBA %d, but no bad block table!?\n", pba );
+          return pba - (pba / d->pstrk);
+        }
+      return s4_pba2lba( pba, d->bbt, d->nbb, d->pstrk, d->heads );
+    }
+
+  track = pba / d->pstrk;
+  if( pba - track * d->pstrk != d->lstrk ||
+      track < 0 || track >= d->ntrks || !(i = d->trkmap[ track ].alt) )
+    return pba - track;
+
+  /* Convert remapped sector to pba then lba */
+  pba = d->bbt[i].cyl * d->pscyl + d->bbt[i].badblk;
+  return pba - (pba / d->pstrk);
+}
+
+
 /* initialize everything to "s4_vol_show"-able state.  
    Do not clear, because fd may be open, vhbd may already be read */
 
@@ -449,9 +547,14 @@ void  s4_init_vol( const char *name, int fd,
                    struct s4_vhbd *opt_vhbd,
                    s4_vol *v )
 {
+  s4_log_init();
+
   v->fname  = strdup( name );
   v->fd     = fd;
   v->nbb    = 0;
+
+  v->loglevel = -1;
+  v->logmask  = 0;
   v->bbt    = &v->bbt_fsu.bbt[0];
 
   v->cyls   = cyls;
@@ -487,6 +590,14 @@ void  s4_init_vol( const char *name, int fd,
   v->bbt = &v->bbt_fsu.bbt[0];
   v->nbb = 0;
 
+  v->ntrks  = v->cyls * v->heads;
+  v->trkmap = NULL;
+
+  s4_stats_init( &v->stats );
+
+  v->map    = NULL;
+  v->maplen = 0;
+
   /* setup fake partition at the start */
   v->nparts = 1;
   v->parts[0].strk     = 0;
@@ -516,9 +627,10 @@ s4err s4_open_vol( const char *vfile, int mode, s4_vol *vinfo )
   s4err	 rv = s4_ok;
   int    fd;
 
+  s4_log_init();
   memset( vinfo, 0, sizeof(*vinfo) );
 
-  fd = open( vfile, mode, 0 );
+  fd = open( vfile, mode & ~S4_O_MMAP, 0 );
   if( fd < 0 )
     {
       printf("Unable to open '%s': %s\n", vfile, strerror( errno ));
@@ -526,7 +638,7 @@ s4err s4_open_vol( const char *vfile, int mode, s4_vol *vinfo )
       goto done;
     }
 
-  rv =  s4_seek_read( fd, 0, (char*)&vinfo->vhbd, sizeof(vinfo->vhbd) );
+  rv =  s4_pread( fd, 0, (char*)&vinfo->vhbd, sizeof(vinfo->vhbd) );
   if( s4_ok != rv )
     goto done;
 
@@ -538,6 +650,7 @@ s4err s4_open_vol( const char *vfile, int mode, s4_vol *vinfo )
     {
       vinfo->doswap = 1;
       s4_fsu_swap( (s4_fsu*)&vinfo->vhbd, s4b_vhbd );
+      s4_log( S4_LOG_INFO, S4_LOG_SWAP, "'%s' is byte swapped\n", vfile );
     }
   else
     {
@@ -558,6 +671,9 @@ s4err s4_open_vol( const char *vfile, int mode, s4_vol *vinfo )
                &vinfo->vhbd,
                vinfo );
 
+  if( mode & S4_O_MMAP )
+    s4_vol_map( vinfo, mode );
+
   if( vinfo->pscyl != vinfo->vhbd.dsk.pseccyl )
     {
       printf("WARNING: computed sectors/cyl %d not reported %d\n",
@@ -585,16 +701,637 @@ s4err s4_open_vol( const char *vfile, int mode, s4_vol *vinfo )
 }
 
 
+/* absolute block address, LBA or PBA per the volume, to byte offset */
+static off_t s4_vol_ba2off( s4_vol *d, int baa )
+{
+  if( s4a_lba == d->lba_or_pba )
+    return LBA_TO_VOL_OFFSET( d, baa );
+  return PBA_TO_OFFSET( d, baa );
+}
+
+/* add cnt blocks at offset, merging with the previous run if adjacent */
+static int s4_run_add( s4_run *runs, int nruns, int secsz,
+                       off_t offset, int bar, int cnt )
+{
+  s4_run  *rp = &runs[ nruns ];
+
+  if( nruns && rp[-1].offset + (off_t)rp[-1].nblks * secsz == offset &&
+      rp[-1].bar + rp[-1].nblks == bar )
+    {
+      rp[-1].nblks += cnt;
+      return nruns;
+    }
+
+  rp->offset = offset;
+  rp->bar    = bar;
+  rp->nblks  = cnt;
+  return nruns + 1;
+}
+
+int s4_vol_runs( s4_vol *d, int baa, int cnt, s4_run *runs )
+{
+  int     nruns = 0;
+  int     bar, n, i, trk;
+
+  /* PBA is the disk as-is */
+  if( s4a_pba == d->lba_or_pba )
+    return s4_run_add( runs, 0, d->secsz,
+                       PBA_TO_OFFSET( d, baa ), 0, cnt );
+
+  for( bar = 0; bar < cnt; bar += n )
+    {
+      /* rest of this logical track */
+      trk = (baa + bar) / d->lstrk;
+      n   = d->lstrk - (baa + bar) % d->lstrk;
+      if( n > cnt - bar )
+        n = cnt - bar;
+
+      if( d->nbb > 1 &&
+          (!d->trkmap || (trk < d->ntrks && d->trkmap[ trk ].bad)) )
+        {
+          /* something on this track lives elsewhere */
+          for( i = 0; i < n; i++ )
+            nruns = s4_run_add( runs, nruns, d->secsz,
+                                s4_vol_ba2off( d, baa + bar + i ),
+                                bar + i, 1 );
+        }
+      else
+        {
+          nruns = s4_run_add( runs, nruns, d->secsz,
+                              (off_t)(baa + bar + trk) * d->secsz,
+                              bar, n );
+        }
+    }
+
+  return nruns;
+}
+
+static int s4_run_cmp( const void *a, const void *b )
+{
+  const s4_run *ra = a;
+  const s4_run *rb = b;
+
+  return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+/* Group runs, in disk order, into as few vectored requests on d->fd
+   as possible.  Reads step over spare sectors between runs into
+   spare; writes can't, so they break there.  iov needs room for
+   2 * nruns, reqs for nruns.  Returns the number of requests. */
+static int s4_vol_group( s4_vol *d, s4_run *runs, int nruns,
+                         char *buf, long blen, int wr, char *spare,
+                         struct iovec *iov, s4_aioreq *reqs )
+{
+  s4_aioreq    *rq;
+  int           i, j, niov;
+  int           nreqs = 0;
+  off_t         end;
+  long          boff, len;
+
+  qsort( runs, nruns, sizeof(*runs), s4_run_cmp );
+
+  for( i = 0; i < nruns; i = j )
+    {
+      rq = &reqs[ nreqs++ ];
+      memset( rq, 0, sizeof(*rq) );
+      rq->wr     = wr;
+      rq->fd     = d->fd;
+      rq->offset = end = runs[i].offset;
+      rq->iov    = iov;
+
+      niov = 0;
+      for( j = i; j < nruns && niov < S4_IOVMAX - 1; j++ )
+        {
+          if( runs[j].offset != end )
+            {
+              if( wr || runs[j].offset < end ||
+                  runs[j].offset - end > S4_SPARESZ )
+                break;
+
+              iov[ niov ].iov_base  = spare;
+              iov[ niov++ ].iov_len = runs[j].offset - end;
+            }
+
+          boff = (long)runs[j].bar * d->secsz;
+          len  = (long)runs[j].nblks * d->secsz;
+          if( len > blen - boff )
+            len = blen - boff;
+
+          iov[ niov ].iov_base  = buf + boff;
+          iov[ niov++ ].iov_len = len;
+          end = runs[j].offset + len;
+
+          /* a short block ends the image */
+          if( len < (long)runs[j].nblks * d->secsz )
+            {
+              j++;
+              break;
+            }
+        }
+
+      rq->niov = niov;
+      iov     += niov;
+    }
+
+  return nreqs;
+}
+
+/* bytes req should move */
+static ssize_t s4_aioreq_len( s4_aioreq *rq )
+{
+  ssize_t len = 0;
+  int     i;
+
+  for( i = 0; i < rq->niov; i++ )
+    len += rq->iov[i].iov_len;
+  return len;
+}
+
+/* check a finished request, issuing errors */
+static s4err s4_aioreq_check( s4_aioreq *rq, ssize_t rv )
+{
+  if( rv >= 0 && (!rq->wr || rv == s4_aioreq_len( rq )) )
+    return s4_ok;
+
+  printf("%s %s %ld bytes at offset %lld\n",
+         rv < 0 ? strerror( -rv ) : "short write",
+         rq->wr ? "writing" : "reading",
+         (long)s4_aioreq_len( rq ), (long long)rq->offset );
+
+  return rq->wr ? s4_write : s4_read;
+}
+
+/* Do the runs, synchronously, with preadv/pwritev */
+static s4err s4_vol_rw_runs( s4_vol *d, s4_run *runs, int nruns,
+                             char *buf, long blen, int wr )
+{
+  struct iovec  *iov;
+  s4_aioreq     *reqs;
+  char           spare[ S4_SPARESZ ];
+  s4err          err = s4_ok;
+  int            i, nreqs;
+  ssize_t        rv;
+
+  iov  = malloc( 2 * nruns * sizeof(*iov) );
+  reqs = malloc( nruns * sizeof(*reqs) );
+  if( !iov || !reqs )
+    {
+      free( iov );
+      free( reqs );
+      return s4_error;
+    }
+
+  nreqs = s4_vol_group( d, runs, nruns, buf, blen, wr, spare, iov, reqs );
+  for( i = 0; i < nreqs && s4_ok == err; i++ )
+    {
+      if( wr )
+        rv = pwritev( d->fd, reqs[i].iov, reqs[i].niov, reqs[i].offset );
+      else
+        rv = preadv( d->fd, reqs[i].iov, reqs[i].niov, reqs[i].offset );
+
+      err = s4_aioreq_check( &reqs[i], rv < 0 ? -errno : rv );
+      s4_stats_io( &d->stats, wr, rv < 0 ? 0 : rv );
+    }
+
+  free( iov );
+  free( reqs );
+  return err;
+}
+
+/* Runs for writing blen bytes of buf at baa, leaving out stretches
+   of S4_HOLE_MIN or more zeroes, which are made holes instead.
+   -1 if a hole couldn't be made. */
+static int s4_vol_write_runs( s4_vol *d, int baa, char *buf, long blen,
+                              s4_run *runs )
+{
+  int     nruns = 0;
+  int     bar, cnt, n, nz, i, zero;
+  long    boff, span, len;
+
+  cnt = (blen + d->secsz - 1) / d->secsz;
+  for( bar = 0; bar < cnt; bar += n )
+    {
+      boff = (long)bar * d->secsz;
+      zero = s4_iszero( buf + boff,
+                        blen - boff < d->secsz ? blen - boff : d->secsz );
+      span = s4_zero_span( buf + boff, blen - boff, d->secsz, zero );
+      n    = (span + d->secsz - 1) / d->secsz;
+
+      nz = s4_vol_runs( d, baa + bar, n, runs + nruns );
+      if( zero && span >= S4_HOLE_MIN )
+        {
+          /* runs were scratch, punch them instead */
+          for( i = 0; i < nz; i++ )
+            {
+              len = (long)runs[ nruns + i ].nblks * d->secsz;
+              if( len > blen - boff - (long)runs[ nruns + i ].bar * d->secsz )
+                len = blen - boff - (long)runs[ nruns + i ].bar * d->secsz;
+              if( s4_ok != s4_zero_range( d->fd, runs[ nruns + i ].offset, len ) )
+                return -1;
+            }
+          continue;
+        }
+
+      for( i = 0; i < nz; i++ )
+        runs[ nruns + i ].bar += bar;
+      nruns += nz;
+    }
+
+  return nruns;
+}
+
+/* are all the runs holes in the image? */
+static int s4_vol_runs_hole( s4_vol *d, s4_run *runs, int nruns )
+{
+  off_t   lo, hi, end;
+  int     i;
+
+  if( !nruns )
+    return 0;
+
+  lo = runs[0].offset;
+  hi = lo;
+  for( i = 0; i < nruns; i++ )
+    {
+      end = runs[i].offset + (off_t)runs[i].nblks * d->secsz;
+      if( runs[i].offset < lo )
+        lo = runs[i].offset;
+      if( end > hi )
+        hi = end;
+    }
+
+  /* spans the alternates too, so only skips when it's all empty */
+  return s4_is_hole( d->fd, lo, hi - lo );
+}
+
+s4err s4_vol_read_blks( s4_vol *vinfo, int baa, int cnt, char *buf )
+{
+  s4err     err;
+  s4_run   *runs;
+  int       nruns;
+
+  if( !(runs = malloc( cnt * sizeof(*runs) )) )
+    return s4_error;
+
+  /* past EOF stays zero */
+  memset( buf, 0, (size_t)cnt * vinfo->secsz );
+
+  nruns = s4_vol_runs( vinfo, baa, cnt, runs );
+  err   = s4_ok;
+  if( !s4_vol_runs_hole( vinfo, runs, nruns ) )
+    err = s4_vol_rw_runs( vinfo, runs, nruns, buf,
+                          (long)cnt * vinfo->secsz, 0 );
+  free( runs );
+  return err;
+}
+
+s4err s4_vol_write_blks( s4_vol *vinfo, int baa, char *buf, int blen )
+{
+  s4err     err;
+  s4_run   *runs;
+  int       cnt, nruns;
+
+  cnt = (blen + vinfo->secsz - 1) / vinfo->secsz;
+  if( !(runs = malloc( cnt * sizeof(*runs) )) )
+    return s4_error;
+
+  nruns = s4_vol_write_runs( vinfo, baa, buf, blen, runs );
+  err   = s4_write;
+  if( nruns >= 0 )
+    err = s4_vol_rw_runs( vinfo, runs, nruns, buf, blen, 1 );
+  free( runs );
+  return err;
+}
+
+
+/* A block range in flight through an s4_aio; runs, iov and reqs
+   are allocated with it. */
+typedef struct
+{
+  int            nreqs;
+  int            ndone;
+  s4err          err;
+  void          *udata;
+  s4_aioreq     *reqs;
+  struct iovec  *iov;
+  char           spare[ S4_SPARESZ ];
+
+} s4_vol_aiorange;
+
+static s4err s4_vol_aio_submit( s4_vol *d, s4_aio *aio, int baa, int cnt,
+                                char *buf, long blen, int wr, void *udata )
+{
+  s4_vol_aiorange *r;
+  s4_run          *runs;
+  s4err            err = s4_ok;
+  int              i, nruns;
+
+  r = malloc( sizeof(*r) + cnt * (sizeof(s4_aioreq) +
+                                  2 * sizeof(struct iovec) +
+                                  sizeof(s4_run)) );
+  if( !r )
+    return s4_error;
+
+  r->reqs = (s4_aioreq*)(r + 1);
+  r->iov  = (struct iovec*)(r->reqs + cnt);
+  runs    = (s4_run*)(r->iov + 2 * cnt);
+
+  r->ndone = 0;
+  r->err   = s4_ok;
+  r->udata = udata;
+
+  if( !wr )
+    memset( buf, 0, blen );     /* past EOF stays zero */
+
+  if( wr )
+    nruns = s4_vol_write_runs( d, baa, buf, blen, runs );
+  else
+    {
+      nruns = s4_vol_runs( d, baa, cnt, runs );
+      if( s4_vol_runs_hole( d, runs, nruns ) )
+        nruns = 0;
+    }
+
+  if( nruns < 0 )
+    {
+      free( r );
+      return s4_write;
+    }
+
+  r->nreqs = s4_vol_group( d, runs, nruns, buf, blen, wr, r->spare,
+                           r->iov, r->reqs );
+  if( !r->nreqs )
+    {
+      /* nothing to move; an empty request still reports it */
+      memset( &r->reqs[0], 0, sizeof(r->reqs[0]) );
+      r->reqs[0].wr = wr;
+      r->reqs[0].fd = d->fd;
+      r->reqs[0].iov = r->iov;
+      r->nreqs = 1;
+    }
+
+  for( i = 0; i < r->nreqs; i++ )
+    {
+      r->reqs[i].udata = r;
+      if( s4_ok != (err = s4_aio_submit( aio, &r->reqs[i] )) )
+        break;
+      s4_stats_io( &d->stats, wr, s4_aioreq_len( &r->reqs[i] ) );
+    }
+
+  if( i < r->nreqs )
+    {
+      /* what made it in finishes with the error */
+      if( !i )
+        {
+          free( r );
+          return err;
+        }
+      r->nreqs = i;
+      r->err   = err;
+    }
+
+  return s4_ok;
+}
+
+s4err s4_vol_aio_read( s4_vol *vinfo, s4_aio *aio, int baa, int cnt,
+                       char *buf, void *udata )
+{
+  return s4_vol_aio_submit( vinfo, aio, baa, cnt, buf,
+                            (long)cnt * vinfo->secsz, 0, udata );
+}
+
+s4err s4_vol_aio_write( s4_vol *vinfo, s4_aio *aio, int baa,
+                        char *buf, int blen, void *udata )
+{
+  return s4_vol_aio_submit( vinfo, aio, baa,
+                            (blen + vinfo->secsz - 1) / vinfo->secsz,
+                            buf, blen, 1, udata );
+}
+
+s4err s4_vol_aio_wait( s4_aio *aio, void **udatap )
+{
+  s4_aioreq       *rq;
+  s4_vol_aiorange *r;
+  s4err            err;
+
+  for(;;)
+    {
+      if( !(rq = s4_aio_wait( aio )) )
+        return s4_range;
+
+      r   = rq->udata;
+      err = s4_aioreq_check( rq, rq->res );
+      if( s4_ok == r->err )
+        r->err = err;
+
+      if( ++r->ndone == r->nreqs )
+        {
+          *udatap = r->udata;
+          err     = r->err;
+          free( r );
+          return err;
+        }
+    }
+}
+
+/* reap everything left after an error */
+static void s4_vol_aio_drain( s4_aio *aio )
+{
+  void *udata;
+
+  while( s4_range != s4_vol_aio_wait( aio, &udata ) )
+    continue;
+}
+
+
+/* copy len bytes between fds in the kernel: a reflink where the
+   filesystem shares extents, else copy_file_range.  s4_range if
+   neither works here, with nothing promised about the output. */
+static s4err s4_copy_range( int ofd, off_t ooff, int ifd, off_t ioff,
+                            off_t len )
+{
+  loff_t   ipos = ioff;
+  loff_t   opos = ooff;
+  ssize_t  n;
+
+#ifdef FICLONERANGE
+  struct file_clone_range fcr;
+
+  fcr.src_fd      = ifd;
+  fcr.src_offset  = ioff;
+  fcr.src_length  = len;
+  fcr.dest_offset = ooff;
+  if( !ioctl( ofd, FICLONERANGE, &fcr ) )
+    return s4_ok;
+#endif
+
+  while( len > 0 )
+    {
+      n = copy_file_range( ifd, &ipos, ofd, &opos, len, 0 );
+      if( n < 0 )
+        {
+          if( EXDEV == errno || ENOSYS == errno || EINVAL == errno ||
+              EOPNOTSUPP == errno || EBADF == errno )
+            return s4_range;
+          printf("%s copying %lld bytes at offset %lld\n",
+                 strerror( errno ), (long long)len, (long long)opos );
+          return s4_write;
+        }
+      if( !n )                  /* input EOF, the rest reads as zeroes */
+        return s4_zero_range( ofd, opos, len );
+      len -= n;
+    }
+  return s4_ok;
+}
+
+/* Copy cnt blocks without bringing them into user space, when both
+   sides are contiguous in pieces of S4_CLONE_MIN or more.  A side
+   with a NULL vol is the plain file fd from offset on.  s4_range
+   means do it the buffered way; *clonep is cleared if the kernel
+   can't do it at all, so the caller stops asking. */
+static s4err s4_vol_clone( s4_vol *od, int obaa, int ofd, off_t ooff,
+                           s4_vol *id, int ibaa, int ifd, off_t ioff,
+                           int cnt, int secsz, int *clonep )
+{
+  s4_run  *runs, *ir, *or;
+  s4err    err = s4_range;
+  int      i, j, bar, n;
+  off_t    ip, op;
+  long     iremaps, oremaps;
+
+  if( !(runs = malloc( 2 * cnt * sizeof(*runs) )) )
+    return s4_range;
+
+  /* the buffered retry will count remaps again */
+  iremaps = id ? id->stats.remaps : 0;
+  oremaps = od ? od->stats.remaps : 0;
+
+  ir = runs;
+  or = runs + cnt;
+  ir[0].offset = ioff;
+  or[0].offset = ooff;
+  ir[0].bar    = or[0].bar   = 0;
+  ir[0].nblks  = or[0].nblks = cnt;
+  if( id )
+    {
+      ifd = id->fd;
+      s4_vol_runs( id, ibaa, cnt, ir );
+    }
+  if( od )
+    {
+      ofd = od->fd;
+      s4_vol_runs( od, obaa, cnt, or );
+    }
+
+  /* every piece has to be worth it, or none are done */
+  for( i = j = bar = 0; bar < cnt; bar += n )
+    {
+      n = ir[i].bar + ir[i].nblks - bar;
+      if( or[j].bar + or[j].nblks - bar < n )
+        n = or[j].bar + or[j].nblks - bar;
+      if( (long)n * secsz < S4_CLONE_MIN && bar + n < cnt )
+        goto done;
+      if( bar + n == ir[i].bar + ir[i].nblks )
+        i++;
+      if( bar + n == or[j].bar + or[j].nblks )
+        j++;
+    }
+
+  for( i = j = bar = 0; bar < cnt; bar += n )
+    {
+      n = ir[i].bar + ir[i].nblks - bar;
+      if( or[j].bar + or[j].nblks - bar < n )
+        n = or[j].bar + or[j].nblks - bar;
+      ip = ir[i].offset + (off_t)(bar - ir[i].bar) * secsz;
+      op = or[j].offset + (off_t)(bar - or[j].bar) * secsz;
+
+      /* a splice copy would fill in holes */
+      if( s4_is_hole( ifd, ip, (off_t)n * secsz ) )
+        err = s4_zero_range( ofd, op, (off_t)n * secsz );
+      else
+        {
+          err = s4_copy_range( ofd, op, ifd, ip, (off_t)n * secsz );
+          /* a plain file side counts with the volume */
+          s4_stats_io( &(id ? id : od)->stats, 0, (long long)n * secsz );
+          s4_stats_io( &(od ? od : id)->stats, 1, (long long)n * secsz );
+        }
+      if( s4_ok != err )
+        break;
+
+      if( bar + n == ir[i].bar + ir[i].nblks )
+        i++;
+      if( bar + n == or[j].bar + or[j].nblks )
+        j++;
+    }
+
+  if( s4_range == err )
+    *clonep = 0;
+
+ done:
+  if( s4_range == err )
+    {
+      if( id )
+        id->stats.remaps = iremaps;
+      if( od )
+        od->stats.remaps = oremaps;
+    }
+  free( runs );
+  return err;
+}
+
+
+/* read up to len from fd, stopping only at EOF or error */
+static int s4_read_full( int fd, char *buf, int len )
+{
+  int   got, rv;
+
+  for( got = 0; got < len; got += rv )
+    {
+      rv = read( fd, buf + got, len - got );
+      if( rv < 0 )
+        return rv;
+      if( rv == 0 )
+        break;
+    }
+  return got;
+}
+
+/* s4_read_full, but a hole in a regular file is skipped over and
+   handed back as zeroes without reading it */
+static int s4_read_sparse( int fd, char *buf, int len )
+{
+  struct stat sb;
+  off_t       pos;
+
+  pos = lseek( fd, 0, SEEK_CUR );
+  if( pos < 0 || fstat( fd, &sb ) || !S_ISREG( sb.st_mode ) ||
+      pos + len > sb.st_size )
+    return s4_read_full( fd, buf, len );
+
+  /* s4_is_hole moves the position; put it where it belongs */
+  if( s4_is_hole( fd, pos, len ) )
+    {
+      memset( buf, 0, len );
+      return lseek( fd, pos + len, SEEK_SET ) < 0 ? -1 : len;
+    }
+  if( lseek( fd, pos, SEEK_SET ) < 0 )
+    return -1;
+  return s4_read_full( fd, buf, len );
+}
+
+
 s4err s4_vol_import( s4_vol *ovinfo, int opnum, int ooffblks, int ifd )
 {
   s4err      err = s4_ok;
   s4_vol    *d = ovinfo;
-  long       offset;
-  int        bar, baa;      /* relative and absolute blocks */
+  int        bar, n;    /* relative blocks, this chunk */
   int        partba;
   int        blks;
   int        len;
-  char       buf[ 512 ];
+  int        clone = 1;
+  char      *buf;
+  struct stat sb;
+  off_t      pos;
 
   if( s4a_lba == ovinfo->lba_or_pba )
     {
@@ -607,17 +1344,43 @@ s4err s4_vol_import( s4_vol *ovinfo, int opnum, int ooffblks, int ifd )
       blks   = d->parts[opnum].pblks;
     }
 
+  if( !(buf = malloc( S4_XFER_BLKS * d->secsz )) )
+    return s4_error;
+
   /* copy everything from the input fd to successive LBA's */
   printf("Importing...\n");
-  for( bar = 0; bar < blks && s4_ok == err; bar++ )
+  for( bar = 0; bar < blks && s4_ok == err; bar += n )
     {
-      if( bar && !(bar % 100) )
+      if( bar )
         printf("BLK %d\r", bar );
 
-      len = read( ifd, buf, sizeof(buf));
-      if( len == 0 )
-        break;
+      n = blks - bar;
+      if( n > S4_XFER_BLKS )
+        n = S4_XFER_BLKS;
 
+      /* whole chunks of a regular file can go kernel side */
+      if( clone && (pos = lseek( ifd, 0, SEEK_CUR )) >= 0 &&
+          !fstat( ifd, &sb ) && S_ISREG( sb.st_mode ) &&
+          pos + (off_t)n * d->secsz <= sb.st_size )
+        {
+          err = s4_vol_clone( d, partba + ooffblks + bar, -1, 0,
+                              NULL, 0, ifd, pos, n, d->secsz, &clone );
+          if( s4_ok == err &&
+              lseek( ifd, pos + (off_t)n * d->secsz, SEEK_SET ) < 0 )
+            err = s4_seek;
+          if( s4_range != err )
+            continue;
+          err = s4_ok;
+          if( lseek( ifd, pos, SEEK_SET ) < 0 )
+            {
+              err = s4_seek;
+              break;
+            }
+        }
+
+      len = s4_read_sparse( ifd, buf, n * d->secsz );
+      if( len > 0 )
+        s4_stats_io( &d->stats, 0, len );   /* the source counts here too */
       if( len <= 0 )
         {
           if( len < 0 )
@@ -628,69 +1391,161 @@ s4err s4_vol_import( s4_vol *ovinfo, int opnum, int ooffblks, int ifd )
           break;
         }
 
-      baa = partba + ooffblks + bar;
-      if( s4a_lba == ovinfo->lba_or_pba )
-        offset = LBA_TO_VOL_OFFSET(d, baa);
-      else
-        offset = PBA_TO_OFFSET(d, baa);
-
-      err = s4_seek_write( ovinfo->fd, offset, buf, len );
-      if( s4_ok != err )
+      err = s4_vol_write_blks( d, partba + ooffblks + bar, buf, len );
+      if( len < n * d->secsz )
         {
-          printf("seek write error, offset %ld\n", offset );
+          bar += (len + d->secsz - 1) / d->secsz;
           break;
         }
     }
  
+  free( buf );
   printf("Imported %d %s blocks into partition %d\n", 
          bar, s4atypestr( ovinfo->lba_or_pba ), opnum );
          
   return err;
 }
 
-/* export cnt lba's from pnum starting at ioffblks to fd. */
+/* a chunk of a bulk copy in flight */
+typedef struct
+{
+  char    *buf;
+  int      bar;                 /* first block, relative */
+  int      n;                   /* blocks */
+  int      state;               /* 0 free, else S4_XF_* */
+  int      cloned;              /* done kernel side, nothing in buf */
+
+} s4_xfslot;
+
+#define S4_XF_READ   1
+#define S4_XF_WRITE  2
+#define S4_XF_DONE   3
+
+static s4_aio *s4_xfer_open( s4_xfslot *slots, int secsz, char **bufp )
+{
+  s4_aio  *aio;
+  int      i;
+
+  if( !(*bufp = malloc( (size_t)S4_AIO_NBUF * S4_XFER_BLKS * secsz )) )
+    return NULL;
+
+  if( !(aio = s4_aio_open( S4_AIO_DEPTH, s4_aio_any )) )
+    {
+      printf("can't start async I/O\n");
+      free( *bufp );
+      return NULL;
+    }
+
+  for( i = 0; i < S4_AIO_NBUF; i++ )
+    {
+      slots[i].buf   = *bufp + (size_t)i * S4_XFER_BLKS * secsz;
+      slots[i].state = 0;
+    }
+  return aio;
+}
+
+/* export cnt lba's from pnum starting at ioffblks to fd.  Keeps
+   S4_AIO_NBUF chunks reading, writing them out in order. */
 s4err s4_vol_export( s4_vol *ivinfo, int ipnum, int ioffblks,
                      int icnt, int ofd )
 {
-  s4_vol   *d   = ivinfo;
-  s4err     err = s4_ok;
-  long      offset;
-  int       bar, baa, rv;
-  long      partba;
-  char      buf[ 512 ];
+  s4_vol    *d   = ivinfo;
+  s4err      err = s4_ok;
+  s4_xfslot  slots[ S4_AIO_NBUF ];
+  s4_xfslot *sp;
+  s4_aio    *aio;
+  int        nxt, bar;
+  int        s, w;          /* chunks submitted, written */
+  int        clone;
+  off_t      pos, base;
+  long       partba;
+  char      *bufs;
+  void      *udata;
   
   if( s4a_lba == ivinfo->lba_or_pba )
     partba = d->parts[ipnum].partlba;
   else
     partba = TRK_TO_PBA(d, d->parts[ipnum].strk);
 
-  for( bar = 0; bar < icnt && s4_ok == err; bar++ )
-   {
-     if( bar && !(bar % 100) )
-       printf("BLK %d\r", bar );
-
-     baa = partba + ioffblks + bar;
+  if( !(aio = s4_xfer_open( slots, d->secsz, &bufs )) )
+    return s4_error;
 
-     if( s4a_lba == ivinfo->lba_or_pba )
-       offset = LBA_TO_VOL_OFFSET(d, baa);
-     else
-       offset = PBA_TO_OFFSET(d, baa);
+  /* kernel copies need somewhere to put them */
+  base  = lseek( ofd, 0, SEEK_CUR );
+  clone = base >= 0;
 
-     err = s4_seek_read( d->fd, offset, buf, sizeof(buf) );
+  nxt = bar = s = w = 0;
+  while( s4_ok == err && (w < s || nxt < icnt) )
+   {
+     /* keep the ring reading */
+     while( s - w < S4_AIO_NBUF && nxt < icnt && s4_ok == err )
+       {
+         sp        = &slots[ s % S4_AIO_NBUF ];
+         sp->bar   = nxt;
+         sp->n     = icnt - nxt > S4_XFER_BLKS ? S4_XFER_BLKS : icnt - nxt;
+         sp->state = S4_XF_READ;
+         sp->cloned = 0;
+
+         /* written in place, leaving the output position for the
+            chunks ahead of it to catch up to */
+         if( clone )
+           {
+             err = s4_vol_clone( NULL, 0, ofd,
+                                 base + (off_t)nxt * d->secsz,
+                                 d, partba + ioffblks + nxt, -1, 0,
+                                 sp->n, d->secsz, &clone );
+             sp->cloned = s4_ok == err;
+             if( s4_range == err )
+               err = s4_ok;
+           }
+         if( sp->cloned )
+           sp->state = S4_XF_DONE;
+         else if( s4_ok == err )
+           err = s4_vol_aio_read( d, aio, partba + ioffblks + nxt, sp->n,
+                                  sp->buf, sp );
+         nxt += sp->n;
+         s++;
+       }
      if( s4_ok != err )
+       break;
+
+     if( S4_XF_DONE != slots[ w % S4_AIO_NBUF ].state )
        {
-         printf("seek read error, offset %ld\n", offset );
-         break;
+         if( s4_ok != (err = s4_vol_aio_wait( aio, &udata )) )
+           break;
+         ((s4_xfslot*)udata)->state = S4_XF_DONE;
        }
 
-     rv = write( ofd, buf, sizeof(buf) );
-     if( rv != sizeof(buf) )
+     /* write out whatever is next in order */
+     for( ; s4_ok == err && w < s &&
+            S4_XF_DONE == (sp = &slots[ w % S4_AIO_NBUF ])->state; w++ )
        {
-         printf("%s writing output\n", strerror(errno));
-         err = s4_write;
+         if( sp->cloned )
+           {
+             if( lseek( ofd, (off_t)sp->n * d->secsz, SEEK_CUR ) < 0 )
+               err = s4_seek;
+           }
+         else
+           {
+             err = s4_write_sparse( ofd, sp->buf, sp->n * d->secsz );
+             s4_stats_io( &d->stats, 1, (long long)sp->n * d->secsz );
+           }
+         if( s4_ok != err )
+           break;
+         sp->state = 0;
+         bar += sp->n;
+         printf("BLK %d\r", bar );
        }
    }
 
+  s4_vol_aio_drain( aio );
+  s4_aio_close( aio );
+  free( bufs );
+
+  /* a trailing hole still needs the file to reach it */
+  if( s4_ok == err && (pos = lseek( ofd, 0, SEEK_CUR )) >= 0 )
+    err = s4_set_size( ofd, pos );
+
   if( s4_ok == err )
     printf("Exported %d %s blocks from partition %d\n", 
            bar, s4atypestr( ivinfo->lba_or_pba ), ipnum );
@@ -699,61 +1554,99 @@ s4err s4_vol_export( s4_vol *ivinfo, int ipnum, int ioffblks,
 }
 
 /* export icnt lba's from ivinfo partion at ioffblks
-   to ovinfo partition at ooffblks */
+   to ovinfo partition at ooffblks.  Each chunk is written as soon
+   as it's read, with S4_AIO_NBUF of them in flight. */
 s4err s4_vol_transfer( s4_vol *ovinfo, int opnum, int ooffblks,
                        s4_vol *ivinfo, int ipnum, int ioffblks,
                        int icnt )
 {
-  s4err   err = s4_ok;
-
-  int     bar;
-  int     ibaa, ipartba;
-  int     obaa, opartba;
-  long    ioffset, ooffset;
-  
-  char    buf[ 512 ];
+  s4err      err = s4_ok;
+  s4_xfslot  slots[ S4_AIO_NBUF ];
+  s4_xfslot *sp;
+  s4_aio    *aio;
+  int        i, nxt, bar, busy;
+  int        clone = 1;
+  int        ipartba;
+  int        opartba;
+  char      *bufs;
+  void      *udata;
   
   if( s4a_lba == ivinfo->lba_or_pba )
     ipartba = ivinfo->parts[ipnum].partlba;
   else
-    ipartba = TRK_TO_PBA( ivinfo, ivinfo->parts[opnum].strk);
+    ipartba = TRK_TO_PBA( ivinfo, ivinfo->parts[ipnum].strk);
 
   if( s4a_lba == ovinfo->lba_or_pba )
     opartba = ovinfo->parts[opnum].partlba;
   else
     opartba = TRK_TO_PBA( ovinfo, ovinfo->parts[opnum].strk);
 
-  for( bar = 0; bar < icnt && s4_ok == err; bar++ )  
+  if( !(aio = s4_xfer_open( slots, ivinfo->secsz, &bufs )) )
+    return s4_error;
+
+  nxt = bar = busy = 0;
+  while( s4_ok == err && (busy || nxt < icnt) )  
     {
-      if( bar && !(bar % 100) )
-        printf("BLK %d\r", bar );
+      for( i = 0; i < S4_AIO_NBUF && nxt < icnt && s4_ok == err; i++ )
+        {
+          sp = &slots[i];
+          if( sp->state )
+            continue;
 
-      ibaa = ipartba + ioffblks + bar;
-      if( s4a_lba == ivinfo->lba_or_pba )
-        ioffset = LBA_TO_VOL_OFFSET(ivinfo, ibaa);
-      else
-        ioffset = PBA_TO_OFFSET( ivinfo, ibaa );
+          sp->bar   = nxt;
+          sp->n     = icnt - nxt > S4_XFER_BLKS ? S4_XFER_BLKS : icnt - nxt;
 
-      err = s4_seek_read( ivinfo->fd, ioffset, buf, sizeof(buf) );
+          if( clone )
+            {
+              err = s4_vol_clone( ovinfo, opartba + ooffblks + nxt, -1, 0,
+                                  ivinfo, ipartba + ioffblks + nxt, -1, 0,
+                                  sp->n, ivinfo->secsz, &clone );
+              if( s4_ok == err )
+                {
+                  nxt += sp->n;
+                  bar += sp->n;
+                  printf("BLK %d\r", bar );
+                  continue;
+                }
+              if( s4_range != err )
+                break;
+              err = s4_ok;
+            }
+
+          sp->state = S4_XF_READ;
+          err = s4_vol_aio_read( ivinfo, aio, ipartba + ioffblks + nxt,
+                                 sp->n, sp->buf, sp );
+          nxt += sp->n;
+          busy++;
+        }
       if( s4_ok != err )
+        break;
+      if( !busy )               /* all went kernel side */
+        continue;
+
+      if( s4_ok != (err = s4_vol_aio_wait( aio, &udata )) )
+        break;
+
+      sp = udata;
+      if( S4_XF_READ == sp->state )
         {
-          printf("seek read error, offset %ld\n", ioffset );
-          break;
+          sp->state = S4_XF_WRITE;
+          err = s4_vol_aio_write( ovinfo, aio, opartba + ooffblks + sp->bar,
+                                  sp->buf, sp->n * ivinfo->secsz, sp );
         }
-
-      obaa = opartba + ooffblks + bar;
-      if(  s4a_lba == ovinfo->lba_or_pba )
-        ooffset = LBA_TO_VOL_OFFSET(ovinfo, obaa);
       else
-        ooffset = PBA_TO_OFFSET( ovinfo, obaa );
-
-      err = s4_seek_write( ovinfo->fd, ooffset, buf, sizeof(buf) );
-      if( s4_ok != err )
         {
-          printf("seek write error, offset %ld\n", ooffset );
-          break;
+          sp->state = 0;
+          busy--;
+          bar += sp->n;
+          printf("BLK %d\r", bar );
         }
     }
+
+  s4_vol_aio_drain( aio );
+  s4_aio_close( aio );
+  free( bufs );
+
   if( s4_ok == err )
     printf("Transferred %d %s blocks\n", 
            bar, s4atypestr( ovinfo->lba_or_pba ));
@@ -824,7 +1717,7 @@ static void s4_vol_get_bbt( s4_vol *vinfo )
   if( vinfo->bbt_ba == 0 )
     return;
 
-  rv =  s4_seek_read( vinfo->fd,
+  rv =  s4_pread( vinfo->fd,
                       LBA_TO_VOL_OFFSET(vinfo, vinfo->bbt_ba ),
                       vinfo->bbt_fsu.buf,
                       sizeof(vinfo->bbt_fsu.buf));
@@ -832,25 +1725,74 @@ static void s4_vol_get_bbt( s4_vol *vinfo )
     {
       /* if bb turned off, go physical. Don't do this for real disks with
          17 sectors per track */
-      printf("BBT CHKSUM %x\n", vinfo->bbt[0].cyl );
+      s4_vlog( vinfo, S4_LOG_INFO, S4_LOG_IO,
+               "BBT CHKSUM %x\n", vinfo->bbt[0].cyl );
       if( vinfo->bbt[0].cyl == S4_NO_BB_CHECKSUM &&
           vinfo->bbt[0].badblk == S4_NO_BB_CHECKSUM &&
           vinfo->pstrk != 17)
         {
-          printf("PHYSICAL!\n");
+          s4_vlog( vinfo, S4_LOG_INFO, S4_LOG_REMAP,
+                   "Bad block mapping off, using PBA\n" );
           vinfo->lba_or_pba = s4a_pba;
         }
 
       if( vinfo->doswap )
-        s4_fsu_swap( &vinfo->bbt_fsu, s4b_bbt );
+        s4_stats_swap( &vinfo->stats, &vinfo->bbt_fsu, s4b_bbt );
 
       for( i = 0; i < S4_NBB && vinfo->bbt[i].cyl; i++ )
         vinfo->nbb++;
+
+      if( s4a_lba == vinfo->lba_or_pba )
+        s4_vol_build_trkmap( vinfo );
     }
 
 }
 
 
+/* Index the bad block table by track, so LBA<->PBA don't have to scan
+   it per sector.  Forward chains are kept in table order, so the first
+   match wins as it does in s4_lba2pba; the reverse entry keeps the last,
+   as in s4_pba2lba.  Left NULL if nothing needs remapping. */
+static void s4_vol_build_trkmap( s4_vol *vinfo )
+{
+  int        i, pba, track, alt;
+  uint16_t  *tail;
+
+  if( vinfo->trkmap )
+    free( vinfo->trkmap );
+  vinfo->trkmap = NULL;
+  memset( vinfo->bbnext, 0, sizeof(vinfo->bbnext) );
+
+  if( vinfo->nbb < 2 || vinfo->ntrks <= 0 )
+    return;
+
+  vinfo->trkmap = calloc( vinfo->ntrks, sizeof(*vinfo->trkmap) );
+  if( !vinfo->trkmap )
+    return;                     /* lookups fall back to the linear scan */
+
+  /* First entry is checksum so start at 1 */
+  for( i = 1; i < vinfo->nbb ; i++ )
+    {
+      pba = vinfo->bbt[i].cyl * vinfo->pscyl + vinfo->bbt[i].badblk;
+      if( !pba )
+        break;
+
+      track = pba / vinfo->pstrk;
+      if( track < vinfo->ntrks )
+        {
+          for( tail = &vinfo->trkmap[ track ].bad; *tail;
+               tail = &vinfo->bbnext[ *tail ] )
+            continue;
+          *tail = i;
+        }
+
+      alt = vinfo->bbt[i].altblk;
+      if( alt < vinfo->ntrks )
+        vinfo->trkmap[ alt ].alt = i;
+    }
+}
+
+
 void s4_vhbd_show( struct s4_vhbd *vhbd )
 {
   int i;
@@ -927,14 +1869,14 @@ void s4_vol_show( s4_vol *vinfo )
     {
       part = &vinfo->parts[i];
 
-      printf("%3d %5d %5u %5u %5u %4u %10u %8d %6uk %6.2fM %8d %6uk %6.2fM\n",
+      printf("%3d %5d %5u %5u %5u %4u %10lld %8d %6uk %6.2fM %8d %6uk %6.2fM\n",
 	     i, 
 	     part->strk,
              part->ntrk,
 	     TRK_TO_PBA( vinfo, part->strk ),
 	     TRK_TO_LBA( vinfo, part->strk ),
 	     TRK_TO_CYL( vinfo, part->strk ),
-	     PNUM_TO_OFFSET( vinfo, i ),
+	     (long long)PNUM_TO_OFFSET( vinfo, i ),
 	     part->pblks,
 	     part->pblks * vinfo->secsz / 1024,
 	     ((double)part->pblks) * vinfo->secsz / 1024 / 1024,
@@ -967,6 +1909,51 @@ static void s4_resdes_show( struct s4_resdes *map )
 }
 
 
+/* Map the whole image, shared-writable if opened for write.
+   Failure isn't fatal; everything falls back to reads. */
+static void s4_vol_map( s4_vol *vinfo, int mode )
+{
+  struct stat   sb;
+  int           prot = PROT_READ;
+  void         *p;
+
+  if( fstat( vinfo->fd, &sb ) < 0 || sb.st_size <= 0 )
+    return;
+
+  if( mode & 003 )
+    prot |= PROT_WRITE;
+
+  p = mmap( NULL, sb.st_size, prot, MAP_SHARED, vinfo->fd, 0 );
+  if( MAP_FAILED == p )
+    {
+      printf("%s mapping '%s', using reads\n",
+             strerror( errno ), vinfo->fname );
+      return;
+    }
+
+  vinfo->map    = p;
+  vinfo->maplen = sb.st_size;
+}
+
+
+char *s4_vol_ptr( s4_vol *vinfo, off_t offset, int len, char *buf )
+{
+  if( vinfo->map && offset >= 0 && offset + len <= (off_t)vinfo->maplen )
+    return vinfo->map + offset;
+
+  s4_stats_io( &vinfo->stats, 0, len );
+  if( s4_ok != s4_pread( vinfo->fd, offset, buf, len ) )
+    return NULL;
+  return buf;
+}
+
+
+char *s4_vol_sector( s4_vol *vinfo, int pba, char *buf )
+{
+  return s4_vol_ptr( vinfo, PBA_TO_OFFSET( vinfo, pba ), vinfo->secsz, buf );
+}
+
+
 s4err s4_vol_close( s4_vol *vinfo )
 {
   s4err rv = s4_ok;
@@ -974,6 +1961,12 @@ s4err s4_vol_close( s4_vol *vinfo )
   if( vinfo->fname )
     free( vinfo->fname );
 
+  if( vinfo->trkmap )
+    free( vinfo->trkmap );
+
+  if( vinfo->map )
+    munmap( vinfo->map, vinfo->maplen );
+
   if( vinfo->fd > 0 )
     {
       if( close( vinfo->fd ) < 0 )
@@ -990,65 +1983,148 @@ s4err s4_vol_close( s4_vol *vinfo )
 }
 
 
-s4err s4_seek_read( int fd, int offset, char *buf, int blen )
+s4err s4_pread( int fd, off_t offset, char *buf, size_t blen )
 {
-  s4err rv  = s4_ok;
-  long  off = lseek( fd, (long)offset, 0 );
-  if( off < 0 )
+  ssize_t got = pread( fd, buf, blen, offset );
+
+  if( got < 0 )
     {
-      printf("%s seeking to offset %u in fs %d\n",
-             strerror( errno ), offset, fd );
-      rv = s4_seek;
+      printf("%s reading %ld bytes at offset %lld from fd %d\n",
+             strerror( errno ), (long)blen, (long long)offset, fd );
+      return s4_read;
     }
-  else
+
+  if( (size_t)got < blen )
+    memset( buf + got, 0, blen - got );
+
+  return s4_ok;
+}
+
+s4err s4_pwrite( int fd, off_t offset, char *buf, size_t blen )
+{
+  ssize_t put = pwrite( fd, buf, blen, offset );
+
+  if( put < 0 || (size_t)put != blen )
     {
-      off = read( fd, buf, blen );
-      if( off < 0 )
-        {
-          printf("%s at offset %ld wanted %ld got %ld\n",
-                 strerror( errno ), (long)offset, (long)blen, off );
-          rv = s4_read;
-        }
+      printf("%s writing at offset %lld wanted %ld got %ld\n",
+             put < 0 ? strerror( errno ) : "short write",
+             (long long)offset, (long)blen, (long)put );
+      return s4_write;
+    }
+
+  return s4_ok;
+}
+
+int s4_iszero( const char *buf, size_t len )
+{
+  return !len || (!buf[0] && !memcmp( buf, buf + 1, len - 1 ));
+}
+
+/* length of the leading stretch of buf, in unit steps, where every
+   unit is all zero (zero set) or every unit has data (zero clear) */
+static long s4_zero_span( const char *buf, long len, int unit, int zero )
+{
+  long  off, n;
+
+  for( off = 0; off < len; off += n )
+    {
+      n = len - off < unit ? len - off : unit;
+      if( s4_iszero( buf + off, n ) != zero )
+        break;
     }
+  return off;
+}
 
+s4err s4_zero_range( int fd, off_t offset, off_t len )
+{
+  static const char zeroes[ 8192 ];
+  struct stat       sb;
+  size_t            n;
 
-#if 0
-  printf("seek_read LBA %d offset %d for %d returns %d %s\n",
-         offset / 512,
-         offset, 
-	 blen, rv, s4errstr(rv) );
+  if( !fstat( fd, &sb ) && S_ISREG( sb.st_mode ) )
+    {
+      if( offset >= sb.st_size )
+        return s4_ok;
+      if( offset + len > sb.st_size )
+        len = sb.st_size - offset;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+      if( !fallocate( fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      offset, len ) )
+        return s4_ok;
 #endif
-  return rv;
+    }
+
+  /* devices, or no hole punching here */
+  for( ; len > 0; offset += n, len -= n )
+    {
+      n = len < (off_t)sizeof(zeroes) ? len : sizeof(zeroes);
+      if( s4_ok != s4_pwrite( fd, offset, (char*)zeroes, n ) )
+        return s4_write;
+    }
+  return s4_ok;
 }
 
-s4err s4_seek_write( int fd, int offset, char *buf, int blen )
+s4err s4_set_size( int fd, off_t size )
 {
-  s4err rv  = s4_ok;
-  long  off = lseek( fd, (long)offset, 0 );
-  if( off < 0 || off != offset )
+  struct stat sb;
+
+  if( fstat( fd, &sb ) < 0 || !S_ISREG( sb.st_mode ) || sb.st_size >= size )
+    return s4_ok;
+
+  if( ftruncate( fd, size ) < 0 )
     {
-      printf("%s seeking to offset %u in fs %d\n",
-             strerror( errno ), offset, fd );
-      rv = s4_seek;
+      printf("%s extending fd %d to %lld\n",
+             strerror( errno ), fd, (long long)size );
+      return s4_write;
     }
-  else
+  return s4_ok;
+}
+
+int s4_is_hole( int fd, off_t offset, off_t len )
+{
+#ifdef SEEK_DATA
+  off_t data = lseek( fd, offset, SEEK_DATA );
+
+  /* ENXIO: no data from offset to EOF */
+  if( data < 0 )
+    return ENXIO == errno;
+  return data >= offset + len;
+#else
+  return 0;
+#endif
+}
+
+/* write(2) len bytes at fd's position, seeking over zero stretches
+   of S4_HOLE_MIN or more (after zeroing them in case the file had
+   something there).  Anything unseekable gets it all written. */
+static s4err s4_write_sparse( int fd, char *buf, long len )
+{
+  off_t   pos;
+  long    off, span;
+  int     zero;
+
+  for( off = 0; off < len; off += span )
     {
-      off = write( fd, buf, blen );
-      if( off < 0 || off != blen )
+      zero = s4_iszero( buf + off, len - off < 512 ? len - off : 512 );
+      span = s4_zero_span( buf + off, len - off, 512, zero );
+
+      if( zero && span >= S4_HOLE_MIN &&
+          (pos = lseek( fd, 0, SEEK_CUR )) >= 0 )
         {
-          printf("%s writing at offset %d wanted %d got %ld\n",
-                 strerror( errno ), offset, blen, off );
-          rv = s4_read;
+          if( s4_ok != s4_zero_range( fd, pos, span ) ||
+              lseek( fd, span, SEEK_CUR ) < 0 )
+            return s4_write;
+          continue;
         }
-    }
 
-#if 0
-  printf("seek_write LBA %d offset %d for %d returns %d %s\n",
-         offset / 512,
-         offset, 
-	 blen, rv, s4errstr(rv) );
-#endif
-  return rv;
+      if( write( fd, buf + off, span ) != span )
+        {
+          printf("%s writing output\n", strerror(errno));
+          return s4_write;
+        }
+    }
+  return s4_ok;
 }
 
 
@@ -1056,16 +2132,19 @@ s4err s4_vol_open_filsys( s4_vol *vinfo, int volnum, s4_filsys *fs )
 {
   s4err rv;
   int   fd;
-  long  offset;
+  off_t offset;
 
   fs->vinfo   = vinfo;
   fs->part    = &vinfo->parts[ volnum ];
+  fs->cache   = NULL;
+  fs->ncache  = NULL;
+  fs->sdirty  = 0;
   fd          = vinfo->fd;
 
   /* FS should be at block 1,  512 bytes from 0 */
   offset = fs->part->partoff + PBA_TO_OFFSET( vinfo, 1 );
 
-  rv = s4_seek_read( fd, offset, fs->super.buf, 512 );
+  rv = s4_pread( fd, offset, fs->super.buf, 512 );
   if( s4_ok != rv )
     goto done;
   
@@ -1074,6 +2153,13 @@ s4err s4_vol_open_filsys( s4_vol *vinfo, int volnum, s4_filsys *fs )
   if( s4_ok == rv )
     {
       fs->bksz = fs->super.super.s_type == 2 ? 1024 : 512;
+      s4_vlog( fs->vinfo, S4_LOG_INFO, S4_LOG_FS,
+               "Filesystem of %d %d byte blocks, %d inode blocks\n",
+               fs->super.super.s_fsize, fs->bksz, fs->super.super.s_isize );
+
+      /* no cache is slower, not fatal */
+      s4_filsys_cache_init( fs, S4_CACHE_NBLKS );
+      s4_filsys_ncache_init( fs );
     }
   else
     {
@@ -1085,6 +2171,12 @@ s4err s4_vol_open_filsys( s4_vol *vinfo, int volnum, s4_filsys *fs )
 
 
 s4err s4_open_filsys( const char *path, s4_filsys *fs )
+{
+  return s4_open_filsys_mode( path, 002, fs );
+}
+
+
+s4err s4_open_filsys_mode( const char *path, int mode, s4_filsys *fs )
 {
   s4err          rv;
   s4_vol   *d = &fs->fakevol;
@@ -1092,7 +2184,7 @@ s4err s4_open_filsys( const char *path, s4_filsys *fs )
 
   /* open the file and get it's size  */
   d->fname = strdup( path );
-  d->fd    = open( path, 002, 0 );
+  d->fd    = open( path, mode & ~S4_O_MMAP, 0 );
   if( d->fd < 0 )
     {
       printf("%s opening file '%s'\n", strerror(errno), path );
@@ -1115,6 +2207,9 @@ s4err s4_open_filsys( const char *path, s4_filsys *fs )
   s4_vol_set_part( d, 2, 0, 1 );
   d->nparts = 3;
 
+  if( mode & S4_O_MMAP )
+    s4_vol_map( d, mode );
+
   /* open FS on normal partition 2 of fake disk */
   rv = s4_vol_open_filsys( d, 2, fs );
 
@@ -1151,25 +2246,110 @@ s4err s4_filsys_show( s4_filsys *xfs )
 }
 
 
+/* map partition LBA to PBA handling bad blocks */
+int s4_filsys_lba2pba( s4_filsys *xfs, int lba )
+{
+  return s4_vol_lba2pba( xfs->vinfo, lba );
+}
+
+
+/* absolute LBA or PBA of the first sector of FS block fblk */
+static int s4_filsys_baa( s4_filsys *xfs, s4_daddr fblk )
+{
+  s4_vol   *d = xfs->vinfo;
+
+  return (s4a_lba == d->lba_or_pba ? xfs->part->partlba : xfs->part->partpba)
+    + fblk * (xfs->bksz / d->secsz);
+}
+
+
+char *s4_filsys_blk( s4_filsys *xfs, s4_daddr fblk, char *buf )
+{
+  s4_vol   *d = xfs->vinfo;
+  s4_run    runs[ 2 ];
+  int       n, baa;
+
+  n   = xfs->bksz / d->secsz;
+  baa = s4_filsys_baa( xfs, fblk );
+
+  if( d->map && n <= 2 && 1 == s4_vol_runs( d, baa, n, runs ) )
+    return s4_vol_ptr( d, runs[0].offset, xfs->bksz, buf );
+
+  if( s4_ok != s4_vol_read_blks( d, baa, n, buf ) )
+    return NULL;
+  return buf;
+}
+
+
+s4err s4_filsys_read_fblks( s4_filsys *xfs, s4_daddr fblk, int n,
+                            char *buf )
+{
+  s4_vol   *d = xfs->vinfo;
+
+  /* what we'd read around */
+  if( s4_ok != s4_filsys_cache_flush( xfs ) )
+    return s4_write;
+
+  return s4_vol_read_blks( d, s4_filsys_baa( xfs, fblk ),
+                           n * (xfs->bksz / d->secsz), buf );
+}
+
+
+void s4_filsys_willneed( s4_filsys *xfs, s4_daddr fblk, int n )
+{
+  s4_vol   *d = xfs->vinfo;
+  s4_run   *runs;
+  off_t     off, pg = sysconf( _SC_PAGESIZE );
+  size_t    len;
+  int       i, nruns, cnt;
+
+  cnt = n * (xfs->bksz / d->secsz);
+  if( cnt <= 0 || !(runs = malloc( cnt * sizeof(*runs) )) )
+    return;
+
+  nruns = s4_vol_runs( d, s4_filsys_baa( xfs, fblk ), cnt, runs );
+  for( i = 0; i < nruns; i++ )
+    {
+      off = runs[i].offset;
+      len = (size_t)runs[i].nblks * d->secsz;
+      if( d->map && off + len <= d->maplen )
+        madvise( d->map + off / pg * pg, len + off % pg, MADV_WILLNEED );
+      else
+        posix_fadvise( d->fd, off, len, POSIX_FADV_WILLNEED );
+    }
+  free( runs );
+}
+
+
+s4err s4_filsys_write_fblk( s4_filsys *xfs, s4_daddr fblk, char *buf )
+{
+  return s4_vol_write_blks( xfs->vinfo, s4_filsys_baa( xfs, fblk ),
+                            buf, xfs->bksz );
+}
+
+
 /* is fblk an LBA relative to part start, or a filesystem block? */
 
 s4err s4_filsys_read_blk( s4_filsys *xfs, s4_daddr blk, int bmul,
                           char *buf, int blen  )
 {
-  int rv     = s4_ok;
-  int offset;
-  int lbaa   = xfs->part->partlba + (blk * bmul);
+  int   rv     = s4_ok;
+  off_t offset;
+  int   lbaa   = xfs->part->partlba + (blk * bmul);
 
-  offset = LBA_TO_FS_OFFSET( xfs, lbaa );
+  /* whole FS blocks come from the cache */
+  if( xfs->cache && bmul * 512 == xfs->bksz && blen <= xfs->bksz )
+    return s4_filsys_cache_read( xfs, blk, buf, blen );
 
-  printf("read_blk: lbaa %d\n", lbaa );
+  offset = LBA_TO_FS_OFFSET( xfs, lbaa );
 
-  rv     = s4_seek_read( xfs->vinfo->fd, offset, buf, blen );
+  rv     = s4_pread( xfs->vinfo->fd, offset, buf, blen );
 
-  printf("read %s %d, LBAA %d, offset %u for %d returns %d %s\n",
-         bmul == 1 ? "LBAR" : "FS BLK",
-	 blk, lbaa, offset, 
-	 blen, rv, s4errstr(rv) );
+  s4_vlog( xfs->vinfo, S4_LOG_DEBUG, S4_LOG_IO,
+           "read %s %d, LBAA %d, offset %lld for %d returns %d %s\n",
+           bmul == 1 ? "LBAR" : "FS BLK",
+           blk, lbaa, (long long)offset, 
+           blen, rv, s4errstr(rv) );
 
   return rv;
 }
@@ -1180,9 +2360,15 @@ s4err s4_filsys_close( s4_filsys *fs )
 {
   s4err rv = s4_ok;
 
+  if( fs->sdirty )
+    rv = s4_filsys_sync( fs );
+  if( s4_ok != s4_filsys_cache_free( fs ) )
+    rv = s4_write;
+  s4_filsys_ncache_free( fs );
+
   /* if we opened it, we close it */
-  if( fs->vinfo == &fs->fakevol )
-    rv = s4_vol_close( fs->vinfo );
+  if( fs->vinfo == &fs->fakevol && s4_ok != s4_vol_close( fs->vinfo ) )
+    rv = s4_close;
 
   memset( fs, 0, sizeof(*fs) );
 
@@ -1229,12 +2415,10 @@ void s4_fsu_swap( s4_fsu *fsu, int btype )
         fs->s_fsize = s4swapi( fs->s_fsize );
 
         fs->s_nfree = s4swaph( fs->s_nfree );
-        for( i = 0; i < S4_NICFREE; i++ )
-          fs->s_free[i] = s4swapi( fs->s_free[i] );
+        s4_swap32( fs->s_free, S4_NICFREE );
 
         fs->s_ninode = s4swaph( fs->s_ninode );
-        for( i = 0; i < S4_NICINOD; i++ )
-          fs->s_inode[i] = s4swaph( fs->s_inode[i] );
+        s4_swap16( fs->s_inode, S4_NICINOD );
 
         for( i = 0; i < 4; i++ )
           fs->s_vinfo[i] = s4swaph( fs->s_vinfo[i] );
@@ -1247,56 +2431,26 @@ void s4_fsu_swap( s4_fsu *fsu, int btype )
       break;
 
     case s4b_ino:
-      {
-        struct s4_dinode *inop;
-
-        for( i = 0; i < S4_INOPB ; i++ )
-          {
-            inop = &fsu->dino[i];
-            inop->di_mode  = s4swaph( inop->di_mode );
-            inop->di_nlink = s4swaph( inop->di_nlink );
-            inop->di_uid   = s4swaph( inop->di_uid );
-            inop->di_gid   = s4swaph( inop->di_gid );
-            inop->di_size  = s4swapi( inop->di_size );
-
-            /* block list entries are handled when pulled
-               out as expanded from 3 to 4 bytes */
-
-            inop->di_atime = s4swapi( inop->di_atime );
-            inop->di_mtime = s4swapi( inop->di_mtime );
-            inop->di_ctime = s4swapi( inop->di_ctime);
-          }
-      }
+      /* block list entries are handled when pulled
+         out as expanded from 3 to 4 bytes */
+      s4_swap_inodes( fsu->dino, S4_INOPB );
       break;
 
     case s4b_idx:
-      {
-        for( i = 0; i < S4_NINDIR; i++ )
-          fsu->indir[ i ] = s4swapi( fsu->indir[ i ] );
-      }
+      s4_swap32( fsu->indir, S4_NINDIR );
       break;
 
     case s4b_dir:
-      {
-        for( i = 0; i < S4_NDIRECT ; i++ )
-          fsu->dir[i].d_ino = s4swaph( fsu->dir[i].d_ino );
-      }
+      s4_swap_dirs( fsu->dir, S4_NDIRECT );
       break;
 
     case s4b_linkcnt:
-      {
-        for( i = 0; i < S4_SPERB; i++ )
-          fsu->links[ i ] = s4swaph( fsu->links[ i ] );
-      }
+      s4_swap16( fsu->links, S4_SPERB );
       break;
 
     case s4b_free:
-      {
-        fsu->free.df_nfree = s4swapi( fsu->free.df_nfree );
-
-        for( i = 0; i < S4_NICFREE; i++ )
-            fsu->free.df_free[ i ] = s4swapi( fsu->free.df_free[ i ] );        
-      }
+      /* df_nfree and df_free[] are one run of int32s */
+      s4_swap32( &fsu->free, 1 + S4_NICFREE );
       break;
 
     case s4b_bbt:
@@ -1650,8 +2804,10 @@ static s4err s4_filsys_good_super( s4_filsys *xfs )
   /* swap contents if needed */
   if( S4_FsMAGIC != fs->s_magic && S4_FsMAGIC == s4swapi( fs->s_magic ) )
     {
-      s4_fsu_swap( &xfs->super, s4b_super );
+      s4_stats_swap( &xfs->vinfo->stats, &xfs->super, s4b_super );
       xfs->doswap = 1;
+      s4_vlog( xfs->vinfo, S4_LOG_INFO, S4_LOG_SWAP,
+               "Filesystem is byte swapped\n" );
     }
   else if( S4_FsMAGIC != fs->s_magic )
     {
@@ -1715,16 +2871,11 @@ static int s4_checksum32( signed char *p, int len, int expect )
   int   ssum = 0;
   int   i;
 
-  printf("Checksumming %d\n", len );
-
   for( i = 0; i < len ; i++ )
       ssum += p[i];
 
-#if 0
-  printf("sum 0%08x, expect 0%08x\n", ssum, expect );
-  printf("sum + expect = 0%08x\n", ssum + expect);
-  printf("sum + expect = 0%08x\n", ssum + expect);
-#endif
+  s4_log( S4_LOG_DEBUG, S4_LOG_IO,
+          "Checksummed %d: sum 0%08x, expect 0%08x\n", len, ssum, expect );
 
   return ssum;
 }
@@ -1753,38 +2904,12 @@ int s4_dab2int_be( unsigned char *dab )
  */
 void s4ltol3(char *cp, int *lp, int n)
 {
-  unsigned char *dst = (unsigned char *)cp;
-  int            val;
-
-  for( ; n-- ; lp++, dst += 3 )
-    {
-      val = *lp;
-#ifdef S4_BIG_ENDIAN
-      dst[0] = (val >> 16) & 0xff;
-      dst[1] = (val >> 8) & 0xff;
-      dst[2] = val & 0xff;
-#endif
-#ifdef S4_LITTLE_ENDIAN
-      dst[0] = val & 0xff;
-      dst[1] = (val >> 8) & 0xff;
-      dst[2] = (val >> 16) & 0xff;
-#endif
-    }
+  s4_dab_encode( cp, lp, n, S4_ENDIAN == S4_BE );
 }
 
 void s4l3tol(int *lp, char *cp, int n)
 {
-  unsigned char *src = (unsigned char *)cp;
-        
-  for( ; n-- ; src += 3 )
-    {
-#ifdef S4_BIG_ENDIAN
-      *lp++ = ((src[0] << 16) + (src[1] << 8) + src[2]); 
-#endif
-#ifdef S4_LITTLE_ENDIAN
-      *lp++ = ((src[2] << 16) + (src[1] << 8) + src[0]);
-#endif
-    }
+  s4_dab_decode( lp, cp, n, S4_ENDIAN == S4_BE );
 }
 
 /* ================================================================ */
@@ -1792,37 +2917,12 @@ void s4l3tol(int *lp, char *cp, int n)
 
 void s4ltol3r(char *cp, int *lp, int n)
 {
-  unsigned char *dst = (unsigned char *)cp;
-  int            val;
-
-  for( ; n-- ; dst += 3 )
-    {
-      val = *lp++;
-#if S4_ENDIAN == S4_BE
-      dst[0] = val & 0xff;
-      dst[1] = (val >> 8) & 0xff;
-      dst[2] = (val >> 16) & 0xff;
-#else
-      dst[0] = (val >> 16) & 0xff;
-      dst[1] = (val >> 8) & 0xff;
-      dst[2] = val & 0xff;
-#endif
-    }
+  s4_dab_encode( cp, lp, n, S4_ENDIAN != S4_BE );
 }
 
 void s4l3tolr(int *lp, char *cp, int n)
 {
-  unsigned char *src = (unsigned char *)cp;
-        
-  for( ; n-- ; src += 3 )
-    {
-#if S4_ENDIAN == S4_BE
-      *lp++ = ((src[2] << 16) + (src[1] << 8) + src[0]);
-#else
-      getpid();
-      *lp++ = ((src[0] << 16) + (src[1] << 8) + src[2]); 
-#endif
-    }
+  s4_dab_decode( lp, cp, n, S4_ENDIAN != S4_BE );
 }
 
 
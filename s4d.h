@@ -59,6 +59,8 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>            /* struct iovec */
 
 /* ---------------------------------------------------------------- */
 
@@ -375,8 +377,8 @@ struct	s4_direct
 #ifdef S4_SHORTNAMES
 
 /* incomplete right now */
-#define s4_seek_read        s4skrd
-#define s4_seek_write       s4skwr
+#define s4_pread            s4prd
+#define s4_pwrite           s4pwr
 
 #define s4_open_vol         s4opv
 #define s4_vol_show         s4vsho
@@ -423,6 +425,23 @@ typedef enum
 
 } s4atype;
 
+/* Diagnostic categories, or'd into a mask, and levels.  A message
+   shows when its level is at or under the one in force and its
+   category is in the mask; see s4_log. */
+#define S4_LOG_IO       0x01    /* reads, writes, tables at open */
+#define S4_LOG_REMAP    0x02    /* bad block remapping */
+#define S4_LOG_SWAP     0x04    /* byte order */
+#define S4_LOG_FS       0x08    /* filesystem */
+#define S4_LOG_ALL      0x0f
+
+#define S4_LOG_QUIET    0
+#define S4_LOG_WARN     0       /* shown unless the category is off */
+#define S4_LOG_INFO     1       /* once per open or operation */
+#define S4_LOG_DEBUG    2       /* per block */
+
+/* or'd into the open mode: map the whole image, see s4_vol_ptr */
+#define S4_O_MMAP  010000000000
+
 
 /* raw filesystem block sizing */
 
@@ -481,7 +500,7 @@ typedef struct
   unsigned int      ntrk;       /* number of tracks */
   unsigned int	    pblks;      /* physical blocks */
   unsigned int	    lblks;      /* logical blocks  */
-  unsigned int	    partoff;    /* physical offset */
+  off_t             partoff;    /* physical offset */
   unsigned int      partlba;    /* Absolute LBA of start */
   unsigned int      partpba;    /* pba of strk */
 
@@ -489,6 +508,69 @@ typedef struct
 
 typedef struct s4_bbe s4_bbt;
 
+/* per-track bad block remap index, built from the BBT at open.
+   Values are indexes into the bbt, 0 means none. */
+typedef struct
+{
+  uint16_t  bad;        /* first bad sector on this track, chained by bbnext */
+  uint16_t  alt;        /* sector living in this track's spare */
+
+} s4_trkmap;
+
+/* A physically contiguous piece of a block range; see s4_vol_runs */
+typedef struct
+{
+  off_t     offset;     /* byte offset in the volume */
+  int       bar;        /* first block, relative to the range */
+  int       nblks;      /* contiguous blocks at offset */
+
+} s4_run;
+
+/* blocks moved per bulk transfer, 1MB */
+#define S4_XFER_BLKS    2048
+
+/* queue-depth I/O backends, see s4aio.c */
+typedef enum
+{
+  s4_aio_any,                   /* io_uring if possible, else threads */
+  s4_aio_uring,
+  s4_aio_threads
+
+} s4_aiotype;
+
+/* one vectored read or write for s4_aio */
+typedef struct s4_aioreq
+{
+  struct s4_aioreq *next;       /* private to s4_aio */
+  int            wr;            /* write if set */
+  int            fd;
+  off_t          offset;
+  struct iovec  *iov;
+  int            niov;
+  ssize_t        res;           /* bytes, or -errno, when complete */
+  void          *udata;
+
+} s4_aioreq;
+
+typedef struct s4_aio s4_aio;
+
+#define S4_AIO_DEPTH    64      /* default requests in flight */
+#define S4_AIO_NBUF     8       /* S4_XFER_BLKS chunks in flight */
+
+/* I/O counters, kept per volume or by a tool, see s4_stats_show */
+typedef struct
+{
+  long       calls;             /* reads, writes, async requests */
+  long long  rbytes;
+  long long  wbytes;
+  long       remaps;            /* sectors sent elsewhere by the BBT */
+  long       hits;              /* block cache, for filesystems */
+  long       misses;
+  double     swaptime;          /* seconds in s4_fsu_swap */
+  double     start;             /* s4_now() when counting began */
+
+} s4_stats;
+
 /* Drive & partition information */
 typedef struct
 {
@@ -496,6 +578,14 @@ typedef struct
   int	    fd;                 
   int       doswap;             /* byte swapping needed */
 
+  char     *map;                /* whole image if opened S4_O_MMAP */
+  size_t    maplen;
+
+  s4_stats  stats;
+
+  int       loglevel;           /* -1 is the global level */
+  int       logmask;            /* 0 is the global categories */
+
   struct    s4_vhbd vhbd;        /* From disk, swapped */
   
   /* simpler local access */
@@ -503,6 +593,10 @@ typedef struct
   int       nbb;                /* number of actual entries */
   s4_bbt   *bbt;                /* pointer into bbt_fsu */
 
+  int        ntrks;             /* tracks covered by trkmap */
+  s4_trkmap *trkmap;            /* remap index, NULL if nothing remapped */
+  uint16_t   bbnext[ S4_NBB ];  /* next bad entry on the same track */
+
   int	    cyls;
   int	    heads;
   int	    secsz;
@@ -539,6 +633,62 @@ typedef struct
 } s4_vol;
 
 
+/* One cached FS block, kept as it is on disk (not swapped) */
+typedef struct s4_cblk
+{
+  struct s4_cblk  *next;        /* LRU, most recent after the head */
+  struct s4_cblk  *prev;
+  struct s4_cblk  *hnext;       /* hash chain */
+  s4_daddr         fblk;        /* -1 if unused */
+  int              dirty;
+  s4_fsu           fsu;
+
+} s4_cblk;
+
+/* LRU cache of FS blocks, keyed by FS block number */
+typedef struct
+{
+  int        nblks;
+  int        hmask;             /* hash buckets - 1 */
+  s4_cblk  **hash;
+  s4_cblk   *blks;
+  s4_cblk    lru;               /* list head */
+
+  long       hits;
+  long       misses;
+  long       writes;            /* dirty blocks written back */
+
+  pthread_mutex_t lock;
+
+} s4_cache;
+
+/* default blocks in a filesystem's cache, 256K */
+#define S4_CACHE_NBLKS  256
+
+/* A name cache entry; a NUL name marks dir as complete */
+typedef struct s4_nent
+{
+  struct s4_nent  *next;        /* hash chain */
+  int              dir;
+  int              ino;
+  char             name[ S4_DIRSIZ ];     /* NUL padded */
+
+} s4_nent;
+
+/* (directory inode, name) -> inode, filled as directories are read */
+typedef struct
+{
+  int        hmask;             /* hash buckets - 1 */
+  int        nents;
+  s4_nent  **hash;
+
+  long       hits;
+  long       misses;
+
+  pthread_mutex_t lock;
+
+} s4_ncache;
+
 /* Our idea of a file system.  If not in a vol image,
    then "fakevol" is used to set one up. */
 typedef struct
@@ -552,11 +702,154 @@ typedef struct
   s4_fsu     bbt_fsu;   /* bad block for FS     */
   s4_bbt    *bbt;       /* pointer into bbt_fsu */
   s4_fsu     super;     /* usable superblock    */
+  int        sdirty;    /* super changed, see s4_filsys_sync */
+
+  s4_cache  *cache;     /* NULL if not caching  */
+  s4_ncache *ncache;    /* NULL if not caching names */
 
   s4_vol   fakevol;     /* if opened from file/partition */
 
 } s4_filsys;
 
+/* An open directory, see s4_filsys_readdir */
+typedef struct
+{
+  s4_filsys *fs;
+  int        ino;
+  long       size;
+  long       off;               /* of the next block to read */
+  int        n;                 /* entries in dir */
+  int        i;                 /* next one */
+  struct s4_direct dir[ S4_NDIRECT ];
+
+} s4_dir;
+
+/* The i-list decoded into columns, indexed by inode number; 0 is
+   unused.  Filled by s4_filsys_ilist. */
+typedef struct
+{
+  int        ninode;    /* last inode number */
+  uint16_t  *mode;
+  int16_t   *nlink;
+  uint16_t  *uid;
+  uint16_t  *gid;
+  s4_off    *size;
+  s4_time   *mtime;
+  s4_daddr  *addr;      /* S4_NADDR per inode, see s4_ilist_addr */
+
+} s4_ilist;
+
+/* The .s4idx sidecar index of an image; see s4idx.c for the layout */
+#define S4_IDX_SUFFIX   ".s4idx"
+#define S4_IDX_MAGIC    0x58444934      /* "4IDX" */
+#define S4_IDX_VERSION  1
+
+typedef struct
+{
+  uint32_t   magic;
+  uint32_t   version;
+  uint32_t   hdrsize;
+  uint32_t   bksz;
+  int64_t    imgsize;           /* the image when indexed */
+  int64_t    imgmtime;
+  int64_t    imgmtimens;
+  int64_t    partoff;           /* of the filesystem in it */
+  int32_t    fsize;
+  int32_t    ninode;
+  int32_t    npath;
+  int32_t    pad;
+
+  int64_t    inooff;            /* s4_idxino[ ninode + 1 ] */
+  int64_t    pathoff;           /* s4_idxpath[ npath ], by path */
+  int64_t    ownoff;            /* int32_t[ fsize ], owning inode */
+  int64_t    hashoff;           /* uint64_t[ fsize ], FNV-1a */
+  int64_t    stroff;            /* NUL terminated paths */
+  int64_t    strlen;
+
+} s4_idxhdr;
+
+typedef struct
+{
+  uint16_t   mode;
+  int16_t    nlink;
+  uint16_t   uid;
+  uint16_t   gid;
+  int32_t    size;
+  int32_t    mtime;
+  int32_t    nblks;             /* data and indirect blocks */
+  int32_t    path;              /* first name, -1 if none */
+
+} s4_idxino;
+
+typedef struct
+{
+  int32_t    ino;
+  uint32_t   name;              /* offset in the strings */
+
+} s4_idxpath;
+
+/* an open index, pointers into the mapping */
+typedef struct
+{
+  char              *map;
+  size_t             len;
+  const s4_idxhdr   *hdr;
+  const s4_idxino   *ino;
+  const s4_idxpath  *path;
+  const int32_t     *owner;
+  const uint64_t    *hash;
+  const char        *str;
+
+} s4_idx;
+
+/* a run of blocks */
+typedef struct
+{
+  s4_daddr   start;
+  int        len;
+
+} s4_extent;
+
+/* The free list as a bitmap and extents, and what's wrong with it.
+   Filled by s4_filsys_freemap. */
+typedef struct
+{
+  s4_daddr   isize;     /* first data block */
+  s4_daddr   fsize;
+  uint32_t  *bits;      /* set if on the free list */
+  long       nfree;     /* distinct blocks on it */
+  long       tfree;     /* what the superblock says */
+
+  int        nchain;    /* s4_fblk blocks in the chain */
+  int        ndup;      /* entries listed before */
+  int        nbad;      /* entries out of range */
+  int        cycle;     /* chain comes back on itself */
+  int        broken;    /* bad count or unreadable; rest is missing */
+
+  s4_extent *ext;       /* free runs, ascending */
+  int        next;
+
+} s4_freemap;
+
+/* the owner of each FS block, indexed by block */
+typedef struct
+{
+  s4_daddr   isize;     /* first data block */
+  s4_daddr   fsize;
+  int32_t   *owner;     /* inode, 0 if none */
+  int32_t   *lbn;       /* logical block in it, -level if indirect */
+
+  int        ndup;      /* blocks claimed again */
+  int        nbad;      /* addresses out of range */
+
+} s4_owners;
+
+#define s4_freemap_isfree( fm, b )  \
+  ((b) >= 0 && (b) < (fm)->fsize && ((fm)->bits[ (b) >> 5 ] >> ((b) & 31) & 1))
+
+/* the S4_NADDR block addresses of ino */
+#define s4_ilist_addr( il, ino )  (&(il)->addr[ (long)(ino) * S4_NADDR ])
+
 /* ---------------------------------------------------------------- */
 /* Handy macros */
 
@@ -575,7 +868,7 @@ typedef struct
 /*
  * PBA physical block address to ...
  */
-#define PBA_TO_OFFSET( d, pba )	((pba) * (d)->secsz)
+#define PBA_TO_OFFSET( d, pba )	((off_t)(pba) * (d)->secsz)
 #define PBA_TO_TRK( d, pba )	((pba) / (d)->pstrk)
 #define PBA_TO_CYL( d, pba )	((pba) / (d)->pscyl)
 #define PBA_TO_HEAD( d, pba )	((pba) % (d)->heads)
@@ -583,22 +876,23 @@ typedef struct
 #define PBA_TO_HDSEC( d, pba )	((pba) % (d)->pstrk)
 
 #define PBA_TO_VOL_LBA( d, pba ) \
-  (s4_pba2lba( pba, (d)->bbt, (d)->nbb, (d)->pstrk, (d)->heads ))
+  (s4_vol_pba2lba( (d), (pba) ))
 
 #define PBA_TO_FS_LBA( f, pba ) \
-  (s4_pba2lba( pba, (f)->bbt, (f)->nbb, (f)->vinfo->pstrk, (f)->vinfo->heads ))
+  (s4_vol_pba2lba( (f)->vinfo, (pba) ))
 
 
 /*
  * LBA logical block address to ...
  */
 
-/* converting LBA to physical involves looking at bad block table */
+/* converting LBA to physical involves looking at bad block table,
+   done through the per-track index in the vol. */
 #define LBA_TO_VOL_PBA( d, lba ) \
-  s4_lba2pba( lba, (d)->bbt, (d)->nbb, (d)->lstrk, (d)->heads )
+  s4_vol_lba2pba( (d), (lba) )
 
 #define LBA_TO_FS_PBA( xfs, lba ) \
-  s4_lba2pba( lba, (xfs)->bbt, (xfs)->nbb, (xfs)->vinfo->lstrk, (xfs)->vinfo->heads )
+  s4_filsys_lba2pba( (xfs), (lba) )
 
 #define LBA_TO_VOL_OFFSET( d, lba ) \
   PBA_TO_OFFSET(d, LBA_TO_VOL_PBA( d, lba ))
@@ -630,7 +924,7 @@ typedef struct
 #define TRK_TO_CYL( d, trk )        ((trk) / (d)->heads )
 #define TRK_TO_HEAD( d, trk )       ((trk) % (d)->heads )
 #define TRK_TO_CYLSEC( d, trk )     (TRK_TO_HEAD((d),trk) * (d)->pstrk)
-#define TRK_TO_OFFSET( d, trk )     ((trk) * (d)->ptrksz)
+#define TRK_TO_OFFSET( d, trk )     ((off_t)(trk) * (d)->ptrksz)
 
 /* ---------------------------------------------------------------- */
 /* State-free operations */
@@ -639,6 +933,17 @@ typedef struct
 int s4swapi( int i );
 int s4swaph( int i );
 
+/* s4swaph/s4swapi over n int16s or int32s, vectorized */
+void s4_swap16( void *p, int n );
+void s4_swap32( void *p, int n );
+
+/* swap the fixed fields of n inodes or directory entries */
+void s4_swap_inodes( struct s4_dinode *ip, int n );
+void s4_swap_dirs( struct s4_direct *dp, int n );
+
+/* which kernel the bulk swaps use: "avx2", "ssse3" or "scalar" */
+const char *s4_swap_kernel( void );
+
 /* does work on LE machine */
 int s4bei( int i );
 int s4beh( int i );
@@ -670,19 +975,90 @@ const char *s4btypestr( s4btype type );
 
 const char *s4atypestr( s4atype atype );
 
-/* do an lseek and a read, issuing errors. */
-s4err  s4_seek_read( int fd, int offset, char *buf, int blen );
+/* positional read, issuing errors; doesn't move the fd's file
+   position, so safe from several threads.  Past EOF reads as zeroes. */
+s4err  s4_pread( int fd, off_t offset, char *buf, size_t blen );
+
+/* positional write, issuing errors. */
+s4err  s4_pwrite( int fd, off_t offset, char *buf, size_t blen );
+
+/* monotonic seconds */
+double s4_now( void );
+
+/* zero the counters and start the clock */
+void   s4_stats_init( s4_stats *st );
 
-/* do an lseek and a write, issuing errors. */
-s4err  s4_seek_write( int fd, int offset, char *buf, int blen );
+/* sum from into to, keeping the earlier start */
+void   s4_stats_add( s4_stats *to, const s4_stats *from );
 
+/* count one read or write call that moved bytes */
+void   s4_stats_io( s4_stats *st, int wr, long long bytes );
 
-/* do bad block mapping given a bad block table and strk */
+/* count one sector sent elsewhere by the BBT */
+void   s4_stats_remap( s4_stats *st );
+
+/* add secs of swapping to st */
+void   s4_stats_time( s4_stats *st, double secs );
+
+/* s4_fsu_swap, timed into st */
+void   s4_stats_swap( s4_stats *st, s4_fsu *fsu, int btype );
+
+/* print the counters and throughput since st->start */
+void   s4_stats_show( const s4_stats *st );
+
+/* is buf all zeroes? */
+int    s4_iszero( const char *buf, size_t len );
+
+/* make len bytes at offset read as zeroes: a punched hole in a
+   regular file, written zeroes otherwise.  Doesn't grow the file. */
+s4err  s4_zero_range( int fd, off_t offset, off_t len );
+
+/* grow a regular file to size, sparse; never shrinks */
+s4err  s4_set_size( int fd, off_t size );
+
+/* is [offset, offset+len) all hole?  Moves the file position. */
+int    s4_is_hole( int fd, off_t offset, off_t len );
+
+
+/* do bad block mapping given a bad block table and strk.
+   Linear in the table; the vol functions below use the index. */
 int s4_lba2pba( int lba, struct s4_bbe *bbt, int nbb, int lstrk, int heads );
 
 /* reverse map physical block to lba.  FIXME - May not be useful. */
 int s4_pba2lba( int pba, struct s4_bbe *bbt, int nbb, int strk, int heads );
 
+/* ---------------------------------------------------------------- */
+/* S4_LOG */
+
+/* s4_log_level is the most verbose level set globally or on any
+   handle, so with nothing on, a message costs one compare. */
+extern int s4_log_level;
+extern int s4_log_want;
+extern int s4_log_mask;
+
+#define s4_log( lvl, cat, ... ) \
+  do { if( (lvl) <= s4_log_level && s4_log_on( NULL, lvl, cat ) ) \
+         s4_logf( __VA_ARGS__ ); } while( 0 )
+
+/* s4_log, but the handle's own level and mask apply */
+#define s4_vlog( v, lvl, cat, ... ) \
+  do { if( (lvl) <= s4_log_level && s4_log_on( v, lvl, cat ) ) \
+         s4_logf( __VA_ARGS__ ); } while( 0 )
+
+/* read S4_LOG from the environment, once; opens do this */
+void  s4_log_init( void );
+
+/* global level and categories, for handles that don't set their own */
+void  s4_log_set( int level, int mask );
+
+/* level and categories for one volume, -1 and 0 to follow global */
+void  s4_vol_set_log( s4_vol *vinfo, int level, int mask );
+
+/* would a message show, for vinfo or globally if NULL */
+int   s4_log_on( s4_vol *vinfo, int level, int cat );
+
+void  s4_logf( const char *fmt, ... );
+
 /* ---------------------------------------------------------------- */
 /* S4_DISK */
 
@@ -702,10 +1078,38 @@ void  s4_vol_show( s4_vol *vinfo );
 /* close a disk */
 s4err s4_vol_close( s4_vol *vinfo );
 
-/* map LBA to PBA */
-int   s4_vol_lba2pba( s4_vol *vinfo, s4_bbt *bbt, int lba, int lstrk );
+/* Get len bytes at offset.  Mapped, this is a pointer into the image;
+   otherwise they're read into buf, and buf is returned.  NULL on error. */
+char *s4_vol_ptr( s4_vol *vinfo, off_t offset, int len, char *buf );
+
+/* s4_vol_ptr for physical sector pba */
+char *s4_vol_sector( s4_vol *vinfo, int pba, char *buf );
+
+/* copy out the counters since open */
+void  s4_vol_stats( s4_vol *vinfo, s4_stats *st );
+
+/* map LBA to PBA, constant time using the track remap index */
+int   s4_vol_lba2pba( s4_vol *vinfo, int lba );
+
+/* map PBA back to LBA, constant time using the track remap index */
+int   s4_vol_pba2lba( s4_vol *vinfo, int pba );
 
 
+/* Split cnt blocks at absolute address baa (LBA or PBA, per the
+   volume) into physically contiguous runs, a logical track at a time.
+   runs needs room for cnt entries worst case.  Returns number of runs. */
+int   s4_vol_runs( s4_vol *vinfo, int baa, int cnt, s4_run *runs );
+
+/* read cnt blocks at absolute address baa with vectored I/O;
+   anything past the end of the image, or in a hole, reads as
+   zeroes without touching the disk. */
+s4err s4_vol_read_blks( s4_vol *vinfo, int baa, int cnt, char *buf );
+
+/* write blen bytes as successive blocks at absolute address baa;
+   a short last block is written short.  Long stretches of zeroes
+   become holes in the image. */
+s4err s4_vol_write_blks( s4_vol *vinfo, int baa, char *buf, int blen );
+
 /* import file to a partition in a volume */
 s4err s4_vol_import( s4_vol *ovinfo, int opnum, int ooffblks, int ifd );
 
@@ -719,6 +1123,41 @@ s4err s4_vol_transfer( s4_vol *ovinfo, int opnum, int ooffblks,
                        s4_vol *ivinfo, int ipnum, int ioffblks,
                        int icnt );
 
+/* ---------------------------------------------------------------- */
+/* S4_AIO */
+
+/* Start a queue of up to depth requests (0 for S4_AIO_DEPTH) using
+   the given backend.  s4_aio_any falls back to threads when io_uring
+   can't be had.  NULL on failure. */
+s4_aio     *s4_aio_open( int depth, s4_aiotype type );
+
+/* backend in use, "io_uring" or "threads" */
+const char *s4_aio_name( s4_aio *aio );
+
+/* queue req; req, its iov and buffers stay untouched until it's
+   returned by s4_aio_wait.  May wait for completions when full. */
+s4err       s4_aio_submit( s4_aio *aio, s4_aioreq *req );
+
+/* next completed request in any order, NULL if none outstanding */
+s4_aioreq  *s4_aio_wait( s4_aio *aio );
+
+/* wait out anything in flight and release */
+void        s4_aio_close( s4_aio *aio );
+
+/* Queue a read of cnt blocks at absolute address baa into buf, as
+   s4_vol_read_blks does it.  Reports through s4_vol_aio_wait, so an
+   aio used for these shouldn't carry other requests. */
+s4err s4_vol_aio_read( s4_vol *vinfo, s4_aio *aio, int baa, int cnt,
+                       char *buf, void *udata );
+
+/* Queue a write of blen bytes at absolute address baa */
+s4err s4_vol_aio_write( s4_vol *vinfo, s4_aio *aio, int baa,
+                        char *buf, int blen, void *udata );
+
+/* Wait for a whole queued read or write to finish, giving back its
+   udata.  s4_range when nothing is outstanding. */
+s4err s4_vol_aio_wait( s4_aio *aio, void **udatap );
+
 /* ---------------------------------------------------------------- */
 /* S4_FILSYS */
 
@@ -729,6 +1168,9 @@ s4err s4_vol_open_filsys( s4_vol *vinfo, int volnum, s4_filsys *fs );
 /* another way: open filesystem from path, no volume header */
 s4err s4_open_filsys( const char *path, s4_filsys *fs );
 
+/* same, with open mode, e.g. 004|S4_O_MMAP to map it read-only */
+s4err s4_open_filsys_mode( const char *path, int mode, s4_filsys *fs );
+
 /* given open FS, read LBA from it, scaling blk by bmul;
    if in a partition, add partlba, then convert to PBA  */
 s4err s4_filsys_read_blk( s4_filsys *xfs, s4_daddr blk, int bmul,
@@ -737,12 +1179,190 @@ s4err s4_filsys_read_blk( s4_filsys *xfs, s4_daddr blk, int bmul,
 /* map partition LBA to PBA handling bad blocks */
 int  s4_filsys_lba2pba( s4_filsys *xfs, int lba );
 
+/* Get FS block fblk, bksz bytes.  A pointer into the image when mapped
+   and the block is contiguous on disk; else read into buf.  NULL on error. */
+char *s4_filsys_blk( s4_filsys *xfs, s4_daddr fblk, char *buf );
+
+/* read n FS blocks from fblk into buf, n * bksz bytes, in as few
+   reads as the bad block map allows; bypasses the cache after
+   flushing it */
+s4err s4_filsys_read_fblks( s4_filsys *xfs, s4_daddr fblk, int n,
+                            char *buf );
+
+/* hint that n FS blocks from fblk will be read soon */
+void  s4_filsys_willneed( s4_filsys *xfs, s4_daddr fblk, int n );
+
+/* write FS block fblk, bksz bytes, from buf */
+s4err s4_filsys_write_fblk( s4_filsys *xfs, s4_daddr fblk, char *buf );
+
 /* show FS header info. */
 s4err s4_filsys_show( s4_filsys *fs );
 
+/* (Re)size the block cache, flushing the old one; 0 turns it off.
+   Filesystems are opened with S4_CACHE_NBLKS. */
+s4err s4_filsys_cache_init( s4_filsys *fs, int nblks );
+
+/* Get FS block fblk through the cache, in disk byte order.  The
+   pointer is good until the next cache call, so this is for
+   single threaded callers.  NULL on error. */
+s4_fsu *s4_filsys_cache_get( s4_filsys *fs, s4_daddr fblk );
+
+/* copy blen bytes of FS block fblk out of the cache; thread safe */
+s4err s4_filsys_cache_read( s4_filsys *fs, s4_daddr fblk,
+                            char *buf, int blen );
+
+/* write FS block fblk from buf, updating the cached copy if there
+   is one; works uncached too */
+s4err s4_filsys_cache_write( s4_filsys *fs, s4_daddr fblk, char *buf );
+
+/* note cached fblk was modified, to be written at eviction or flush */
+s4err s4_filsys_cache_dirty( s4_filsys *fs, s4_daddr fblk );
+
+/* write back all dirty blocks */
+s4err s4_filsys_cache_flush( s4_filsys *fs );
+
+/* flush and release the cache */
+s4err s4_filsys_cache_free( s4_filsys *fs );
+
+/* show hit/miss counts */
+void s4_filsys_cache_show( s4_filsys *fs );
+
+/* the volume's counters plus the cache's */
+void s4_filsys_stats( s4_filsys *fs, s4_stats *st );
+
 /* Stop working on filesystem */
 s4err s4_filsys_close( s4_filsys *fs );
 
+/* Read and decode the whole i-list, swapped and with the addresses
+   expanded, into il.  Free with s4_ilist_free. */
+s4err s4_filsys_ilist( s4_filsys *fs, s4_ilist *il );
+
+/* release the columns of an s4_ilist */
+void s4_ilist_free( s4_ilist *il );
+
+/* Get inode ino, swapped, and if addrs isn't NULL its S4_NADDR
+   addresses decoded there */
+s4err s4_filsys_iget( s4_filsys *fs, int ino, struct s4_dinode *dp,
+                      s4_daddr *addrs );
+
+/* Open directory ino for s4_filsys_readdir; s4_range if it isn't one */
+s4err s4_filsys_opendir( s4_filsys *fs, int ino, s4_dir *dp );
+
+/* Next used entry, d_ino in host order.  s4_range at the end.
+   Entries go into the name cache as they are read. */
+s4err s4_filsys_readdir( s4_dir *dp, struct s4_direct *de );
+
+/* ino of name in directory dir, via the name cache */
+s4err s4_filsys_lookup( s4_filsys *fs, int dir, const char *name,
+                        int *inop );
+
+/* ino of path, relative to the root whether or not it starts with '/';
+   s4_range if a part is missing or too long */
+s4err s4_filsys_namei( s4_filsys *fs, const char *path, int *inop );
+
+/* forget the cached entries of dir, after changing it */
+void s4_filsys_ncache_purge( s4_filsys *fs, int dir );
+
+/* make the name cache; opening does, before any threads can look up */
+s4err s4_filsys_ncache_init( s4_filsys *fs );
+
+/* drop the name cache; s4_filsys_close does */
+void s4_filsys_ncache_free( s4_filsys *fs );
+
+/* Read up to len bytes of inode ino at offset into buf, mapping
+   through the indirect blocks and reading adjacent blocks together;
+   holes read as zeroes.  Bytes read, short at end of file, or -1. */
+long s4_filsys_read_file( s4_filsys *fs, int ino, off_t offset, long len,
+                          char *buf );
+
+/* walk the free list once into a bitmap and extents */
+s4err s4_filsys_freemap( s4_filsys *fs, s4_freemap *fm );
+
+/* release an s4_freemap */
+void  s4_freemap_free( s4_freemap *fm );
+
+/* counts, extents and faults */
+void  s4_freemap_show( s4_freemap *fm );
+
+/* Owner and logical block of every block in one pass of the
+   i-list, il if not NULL.  The last claim of a block wins. */
+s4err s4_filsys_owners( s4_filsys *fs, const s4_ilist *il, s4_owners *ow );
+
+/* release an s4_owners */
+void  s4_owners_free( s4_owners *ow );
+
+/* say what block b is, with the owner's path if known */
+void  s4_owners_show( s4_owners *ow, s4_daddr b, const char *path );
+
+/* Write image.s4idx for the filesystem in image, from scratch */
+s4err s4_filsys_idx_build( s4_filsys *fs, const char *image );
+
+/* Map image.s4idx.  s4_range if stale: built from another version
+   of the image or of the format, or if fs isn't NULL, for another
+   filesystem than fs. */
+s4err s4_idx_open( const char *image, s4_filsys *fs, s4_idx *ix );
+
+/* open fs's index in image, building it first if missing or stale */
+s4err s4_filsys_idx( s4_filsys *fs, const char *image, s4_idx *ix );
+
+/* unmap an index */
+void  s4_idx_close( s4_idx *ix );
+
+/* ino of an absolute path, by binary search of the paths */
+s4err s4_idx_namei( s4_idx *ix, const char *path, int *inop );
+
+/* a path of ino, or NULL */
+const char *s4_idx_ipath( s4_idx *ix, int ino );
+
+/* Changing a filesystem.  The superblock is kept in memory and
+   written by s4_filsys_sync, which s4_filsys_close calls when it
+   has changed.  Paths are as for s4_filsys_namei. */
+
+/* write the superblock if changed, and any dirty cached blocks */
+s4err s4_filsys_sync( s4_filsys *fs );
+
+/* up to n free blocks into bnos from the superblock free cache,
+   refilling it from the free list; how many, short when full */
+int   s4_filsys_balloc( s4_filsys *fs, int n, s4_daddr *bnos );
+
+/* put block bno back on the free list */
+s4err s4_filsys_bfree( s4_filsys *fs, s4_daddr bno );
+
+/* a free inode, set up with mode, one link and the time; s_inode is
+   refilled by one pass over the i-list when empty */
+s4err s4_filsys_ialloc( s4_filsys *fs, int mode, int *inop );
+
+/* clear inode ino and put it back on s_inode */
+s4err s4_filsys_ifree( s4_filsys *fs, int ino );
+
+/* write inode ino from dp, host order, and if addrs isn't NULL its
+   addresses from there */
+s4err s4_filsys_iput( s4_filsys *fs, int ino, struct s4_dinode *dp,
+                      const s4_daddr *addrs );
+
+/* Write len bytes from buf at offset in inode ino, allocating blocks
+   as needed and growing the size.  Bytes written or -1. */
+long  s4_filsys_write_file( s4_filsys *fs, int ino, off_t offset, long len,
+                            const char *buf );
+
+/* cut or extend inode ino to size bytes, freeing blocks past it */
+s4err s4_filsys_truncate( s4_filsys *fs, int ino, long size );
+
+/* Make a file, S_IFREG unless mode has a type, giving its inode.  An
+   existing one of the same type is reused, a regular file emptied.
+   inop may be NULL. */
+s4err s4_filsys_create( s4_filsys *fs, const char *path, int mode, int *inop );
+
+/* make a directory with "." and ".."; inop may be NULL.  On an error
+   nothing of it is left behind. */
+s4err s4_filsys_mkdir( s4_filsys *fs, const char *path, int mode, int *inop );
+
+/* remove a name, and the file with its last link */
+s4err s4_filsys_unlink( s4_filsys *fs, const char *path );
+
+/* remove an empty directory */
+s4err s4_filsys_rmdir( s4_filsys *fs, const char *path );
+
 /* ---------------------------------------------------------------- */
 /* S4_FSU  */
 
@@ -784,6 +1404,20 @@ void s4ltol3r(char *cp, int *lp, int n);
 /* byte-swapping version of dabs to ints  */
 void s4l3tolr(int *lp, char *cp, int n);
 
+/* n dabs to ints and back, big endian dabs if be; what the four
+   above use, 4 at a time with SSSE3 */
+void s4_dab_decode( int *lp, const char *cp, int n, int be );
+void s4_dab_encode( char *cp, const int *lp, int n, int be );
+
+/* all S4_NADDR addresses of n inodes, e.g. a whole inode block, to
+   addrs[ n * S4_NADDR ]; doswap as for the filesystem */
+void s4_dinode_addrs( const struct s4_dinode *ip, int n, int doswap,
+                      s4_daddr *addrs );
+
+/* and back, for writing */
+void s4_dinode_set_addrs( struct s4_dinode *ip, int n, int doswap,
+                          const s4_daddr *addrs );
+
 /* ---------------------------------------------------------------- */
 
 /* returns lenggh of encoded obuf */
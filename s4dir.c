@@ -0,0 +1,308 @@
+/*
+ * s4dir.c -- directories and path lookup, see s4d.h
+ *
+ * Entries are entered in a per-filesystem name cache, keyed by
+ * (directory inode, name), as directory blocks are read.  A
+ * directory read to the end is marked complete, so a name it does
+ * not have is a miss without another scan.
+ */
+
+#include <s4d.h>
+
+
+/* starting hash buckets; doubled when the entries outgrow them */
+#define S4_NC_NHASH     1024
+
+/* a complete marker has no name */
+#define s4_nent_complete( np )  (!(np)->name[0])
+
+
+static unsigned s4_nc_hash( int dir, const char *name )
+{
+  unsigned h = 2166136261u ^ dir;
+  int      i;
+
+  for( i = 0; i < S4_DIRSIZ && name[i]; i++ )
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  return h;
+}
+
+
+/* called locked */
+static s4_nent *s4_nc_find( s4_ncache *nc, int dir, const char *key )
+{
+  s4_nent *np;
+
+  for( np = nc->hash[ s4_nc_hash( dir, key ) & nc->hmask ]; np ;
+       np = np->next )
+    if( np->dir == dir && !memcmp( np->name, key, S4_DIRSIZ ) )
+      return np;
+  return NULL;
+}
+
+
+/* called locked */
+static void s4_nc_grow( s4_ncache *nc )
+{
+  s4_nent **hash, *np, *next;
+  int       i, nhash = (nc->hmask + 1) * 2;
+
+  if( !(hash = calloc( nhash, sizeof(*hash) )) )
+    return;                     /* longer chains */
+
+  for( i = 0; i <= nc->hmask; i++ )
+    for( np = nc->hash[i]; np ; np = next )
+      {
+        next = np->next;
+        np->next = hash[ s4_nc_hash( np->dir, np->name ) & (nhash - 1) ];
+        hash[ s4_nc_hash( np->dir, np->name ) & (nhash - 1) ] = np;
+      }
+  free( nc->hash );
+  nc->hash  = hash;
+  nc->hmask = nhash - 1;
+}
+
+
+s4err s4_filsys_ncache_init( s4_filsys *fs )
+{
+  s4_ncache *nc;
+
+  if( !(nc = calloc( 1, sizeof(*nc) )) ||
+      !(nc->hash = calloc( S4_NC_NHASH, sizeof(*nc->hash) )) )
+    {
+      free( nc );
+      return s4_error;
+    }
+  nc->hmask = S4_NC_NHASH - 1;
+  pthread_mutex_init( &nc->lock, NULL );
+  fs->ncache = nc;
+  return s4_ok;
+}
+
+
+/* enter name in dir as ino; key is S4_DIRSIZ, NUL padded */
+static void s4_nc_enter( s4_filsys *fs, int dir, const char *key, int ino )
+{
+  s4_ncache *nc = fs->ncache;
+  s4_nent   *np;
+  s4_nent  **hp;
+
+  if( !nc )
+    return;
+
+  pthread_mutex_lock( &nc->lock );
+  if( (np = s4_nc_find( nc, dir, key )) )
+    np->ino = ino;
+  else if( (np = malloc( sizeof(*np) )) )
+    {
+      np->dir = dir;
+      np->ino = ino;
+      memcpy( np->name, key, S4_DIRSIZ );
+      hp = &nc->hash[ s4_nc_hash( dir, key ) & nc->hmask ];
+      np->next = *hp;
+      *hp = np;
+      if( ++nc->nents > 2 * (nc->hmask + 1) )
+        s4_nc_grow( nc );
+    }
+  pthread_mutex_unlock( &nc->lock );
+}
+
+
+/* ino of key in dir, 0 if not cached, -1 if dir is complete without it */
+static int s4_nc_lookup( s4_filsys *fs, int dir, const char *key )
+{
+  s4_ncache *nc = fs->ncache;
+  s4_nent   *np;
+  char       none[ S4_DIRSIZ ];
+  int        ino = 0;
+
+  if( !nc )
+    return 0;
+
+  memset( none, 0, sizeof(none) );
+  pthread_mutex_lock( &nc->lock );
+  if( (np = s4_nc_find( nc, dir, key )) )
+    ino = np->ino;
+  else if( s4_nc_find( nc, dir, none ) )
+    ino = -1;
+  if( ino )
+    nc->hits++;
+  else
+    nc->misses++;
+  pthread_mutex_unlock( &nc->lock );
+
+  return ino;
+}
+
+
+void s4_filsys_ncache_free( s4_filsys *fs )
+{
+  s4_ncache *nc = fs->ncache;
+  s4_nent   *np, *next;
+  int        i;
+
+  if( !nc )
+    return;
+
+  for( i = 0; i <= nc->hmask; i++ )
+    for( np = nc->hash[i]; np ; np = next )
+      {
+        next = np->next;
+        free( np );
+      }
+  pthread_mutex_destroy( &nc->lock );
+  free( nc->hash );
+  free( nc );
+  fs->ncache = NULL;
+}
+
+
+void s4_filsys_ncache_purge( s4_filsys *fs, int dir )
+{
+  s4_ncache *nc = fs->ncache;
+  s4_nent  **hp, *np;
+  int        i;
+
+  if( !nc )
+    return;
+
+  pthread_mutex_lock( &nc->lock );
+  for( i = 0; i <= nc->hmask; i++ )
+    for( hp = &nc->hash[i]; (np = *hp) ; )
+      {
+        if( np->dir == dir )
+          {
+            *hp = np->next;
+            free( np );
+            nc->nents--;
+          }
+        else
+          hp = &np->next;
+      }
+  pthread_mutex_unlock( &nc->lock );
+}
+
+
+s4err s4_filsys_opendir( s4_filsys *fs, int ino, s4_dir *dp )
+{
+  struct s4_dinode di;
+  s4err            rv;
+
+  memset( dp, 0, sizeof(*dp) );
+  if( s4_ok != (rv = s4_filsys_iget( fs, ino, &di, NULL )) )
+    return rv;
+  if( (di.di_mode & S_IFMT) != S_IFDIR )
+    return s4_range;
+
+  dp->fs   = fs;
+  dp->ino  = ino;
+  dp->size = di.di_size;
+  return s4_ok;
+}
+
+
+s4err s4_filsys_readdir( s4_dir *dp, struct s4_direct *de )
+{
+  s4_filsys  *fs = dp->fs;
+  char        key[ S4_DIRSIZ ];
+  long        n;
+  int         i;
+
+  for( ;; )
+    {
+      while( dp->i < dp->n )
+        {
+          *de = dp->dir[ dp->i++ ];
+          if( de->d_ino )
+            return s4_ok;
+        }
+
+      if( dp->off >= dp->size )
+        {
+          /* all of it seen */
+          memset( key, 0, sizeof(key) );
+          s4_nc_enter( fs, dp->ino, key, dp->ino );
+          return s4_range;
+        }
+
+      n = s4_filsys_read_file( fs, dp->ino, dp->off, fs->bksz,
+                               (char*)dp->dir );
+      if( n <= 0 )
+        return n < 0 ? s4_read : s4_range;
+
+      dp->off += n;
+      dp->n    = n / sizeof(struct s4_direct);
+      dp->i    = 0;
+      if( fs->doswap )
+        s4_swap_dirs( dp->dir, dp->n );
+
+      for( i = 0; i < dp->n; i++ )
+        {
+          if( !dp->dir[i].d_ino )
+            continue;
+          strncpy( key, dp->dir[i].d_name, S4_DIRSIZ );
+          if( key[0] )
+            s4_nc_enter( fs, dp->ino, key, dp->dir[i].d_ino );
+        }
+    }
+}
+
+
+s4err s4_filsys_lookup( s4_filsys *fs, int dir, const char *name, int *inop )
+{
+  struct s4_direct de;
+  s4_dir           d;
+  s4err            rv;
+  char             key[ S4_DIRSIZ ];
+  int              ino;
+
+  if( !name[0] || strlen( name ) > S4_DIRSIZ )
+    return s4_range;
+  strncpy( key, name, S4_DIRSIZ );
+
+  if( (ino = s4_nc_lookup( fs, dir, key )) )
+    {
+      *inop = ino;
+      return ino > 0 ? s4_ok : s4_range;
+    }
+
+  if( s4_ok != (rv = s4_filsys_opendir( fs, dir, &d )) )
+    return rv;
+  while( s4_ok == (rv = s4_filsys_readdir( &d, &de )) )
+    if( !strncmp( de.d_name, key, S4_DIRSIZ ) )
+      {
+        *inop = de.d_ino;
+        return s4_ok;
+      }
+  return rv;
+}
+
+
+s4err s4_filsys_namei( s4_filsys *fs, const char *path, int *inop )
+{
+  char   name[ S4_DIRSIZ + 1 ];
+  s4err  rv;
+  int    ino = S4_ROOTINO;
+  size_t n;
+
+  for( ;; )
+    {
+      while( '/' == *path )
+        path++;
+      if( !*path )
+        break;
+
+      n = strcspn( path, "/" );
+      if( n > S4_DIRSIZ )
+        return s4_range;
+      memcpy( name, path, n );
+      name[n] = 0;
+      path += n;
+
+      if( s4_ok != (rv = s4_filsys_lookup( fs, ino, name, &ino )) )
+        return rv;
+    }
+
+  *inop = ino;
+  return s4_ok;
+}
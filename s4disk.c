@@ -64,8 +64,9 @@ int main( int argc, char **argv )
     }
   printf("Device file %s\n", devfile );
 
-  /* 004 = O_READ */
-  if( (err = s4_open_vol( devfile, 004, &vinfo )) )
+  /* 004 = O_READ; -dump touches every sector, so map it */
+  if( (err = s4_open_vol( devfile, dumpflag ? 004 | S4_O_MMAP : 004,
+                          &vinfo )) )
     {
       printf("Problem opening '%s' -- %s\n", 
              devfile, s4errstr(err) );
@@ -98,6 +99,7 @@ int main( int argc, char **argv )
 static void s4_dump_vol( s4_vol *vinfo )
 {
   char     buf[ 512 ];
+  char    *bp;
   int      offset;
   int      blk;
   int      pnum;
@@ -117,7 +119,7 @@ static void s4_dump_vol( s4_vol *vinfo )
         }
 
       offset = blk * 512;
-      if( s4_ok != s4_seek_read( vinfo->fd, offset, buf, 512 ))
+      if( !(bp = s4_vol_sector( vinfo, blk, buf )) )
         break;
 
       lba = PBA_TO_VOL_LBA( vinfo, blk );
@@ -135,7 +137,7 @@ static void s4_dump_vol( s4_vol *vinfo )
              PBA_TO_HDSEC( vinfo, blk ) == 
              (vinfo->pstrk - 1) ? "SPARE" : "data");
 
-      s4dump( buf, sizeof(buf), 0, 0, 0);
+      s4dump( bp, sizeof(buf), 0, 0, 0);
     }
 }
 
@@ -4,7 +4,7 @@
  * Tool for exporting a filesystem image from a disk image,
  * removing bad blocks.
  *
- * Usage:  s4export -i volfile -o fsfile -v fspartnum -F -p
+ * Usage:  s4export -i volfile -o fsfile -v fspartnum -F -p --stats
  */
 
 #include <s4d.h>
@@ -25,6 +25,8 @@ int main( int argc, char **argv )
   int         consumed;
   int         blks;
   int         dbgflag = 0;
+  int         stats = 0;
+  s4_stats    st;
 
   for( argc--, argv++; argc > 0 && !help ; argc -= consumed, argv += consumed)
     {
@@ -47,6 +49,11 @@ int main( int argc, char **argv )
           dbgflag++;
           continue;
         }
+      else if( !strcmp( "--stats", argv[0] ) )
+        {
+          stats++;
+          continue;
+        }
       else 
         {
           printf("Unexpected argument or missing value to '%s'\n", argv[0]);
@@ -56,9 +63,12 @@ int main( int argc, char **argv )
 
   if( help || !volfile || !*volfile || !fsfile || !*fsfile)
    {
-      printf("usage: %s -i volfile -o fsfile\n", pname );
+      printf("usage: %s -i volfile -o fsfile [--stats]\n", pname );
       exit( 1 );
     }
+  if( dbgflag )
+    s4_log_set( dbgflag > 1 ? S4_LOG_DEBUG : S4_LOG_INFO, S4_LOG_ALL );
+
   printf("Volume file:   %s\n",     volfile );
   printf("FS-image file: %s\n",     fsfile );
 
@@ -103,6 +113,12 @@ int main( int argc, char **argv )
      rv = 1;
    }
 
+  if( stats )
+    {
+      s4_filsys_stats( &lfs, &st );
+      s4_stats_show( &st );
+    }
+
   s4_filsys_close( &lfs );
   s4_vol_close( d );
 
@@ -0,0 +1,551 @@
+/*
+ * s4extract.c
+ *
+ * Tool for extracting a whole filesystem from a volume or FS image
+ * into a host directory, without mounting it.
+ *
+ * The tree is walked first to make the directories and list the
+ * files, from the image's .s4idx if it has a current one, else by
+ * reading the directories.  The files are sorted by their first
+ * block so the reads go through the image in order, then a pool of
+ * threads copies them out.  Modes, owners and times are set
+ * afterwards, directories last so filling them doesn't change their
+ * times.
+ *
+ * Owners and device nodes need root.  Without it they are skipped
+ * and counted, not errors, so a rootless extract of a tree with a
+ * /dev still succeeds.
+ *
+ * Usage:  s4extract -i volfile | -f fsfile -o dir [-j jobs] [-d] [--stats]
+ */
+
+#include <s4d.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/sysmacros.h>
+
+/* most worker threads */
+#define S4X_MAXJOBS     32
+
+/* bytes per read of a file */
+#define S4X_CHUNK       (1024 * 1024)
+
+/* something to make, in walk order */
+typedef struct
+{
+  char     *path;
+  int       ino;
+  s4_daddr  first;              /* first block, to order the reads */
+
+} s4x_ent;
+
+typedef struct
+{
+  s4_filsys  *fs;
+  s4_ilist    il;
+  char      **where;            /* first path of each inode, for links */
+
+  s4x_ent    *dirs;
+  int         ndirs;
+  int         adirs;
+
+  s4x_ent    *files;
+  int         nfiles;
+  int         afiles;
+
+  int         nregs;
+  int         nlinks;
+  int         nspecial;
+  int         nnoperm;          /* devices mknod refused, not root */
+  long long   bytes;
+  int         errors;
+
+  /* the workers take files[next] */
+  int             next;
+  pthread_mutex_t lock;
+
+} s4xcx;
+
+
+static int s4x_add( s4x_ent **ents, int *np, int *ap, char *path, int ino,
+                    s4_daddr first )
+{
+  s4x_ent *p;
+
+  if( *np == *ap )
+    {
+      *ap = *ap ? *ap * 2 : 256;
+      if( !(p = realloc( *ents, *ap * sizeof(*p) )) )
+        {
+          printf("no memory for %d entries\n", *ap );
+          return -1;
+        }
+      *ents = p;
+    }
+
+  p = &(*ents)[ (*np)++ ];
+  p->path  = path;
+  p->ino   = ino;
+  p->first = first;
+  return 0;
+}
+
+
+static int s4x_first_cmp( const void *a, const void *b )
+{
+  const s4x_ent *x = a, *y = b;
+
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+
+/* mode, owner and times of ino onto path */
+static void s4x_attrs( s4xcx *cx, const char *path, int ino )
+{
+  struct s4_dinode di;
+  struct timeval   tv[2];
+
+  if( s4_ok != s4_filsys_iget( cx->fs, ino, &di, NULL ) )
+    return;
+
+  /* owners only stick for root */
+  if( lchown( path, di.di_uid, di.di_gid ) < 0 && EPERM != errno )
+    printf("chown %s: %s\n", path, strerror(errno) );
+  if( chmod( path, di.di_mode & 07777 ) < 0 )
+    printf("chmod %s: %s\n", path, strerror(errno) );
+
+  tv[0].tv_sec  = di.di_atime;
+  tv[0].tv_usec = 0;
+  tv[1].tv_sec  = di.di_mtime;
+  tv[1].tv_usec = 0;
+  if( utimes( path, tv ) < 0 )
+    printf("utimes %s: %s\n", path, strerror(errno) );
+}
+
+
+/* path names ino: make it, or list it to copy or link */
+static int s4x_enter( s4xcx *cx, char *path, int ino )
+{
+  s4_ilist *il = &cx->il;
+  int       fmt, dev;
+
+  fmt = il->mode[ino] & S_IFMT;
+
+  /* a second name for something already seen */
+  if( cx->where[ino] )
+    {
+      if( S_IFREG == fmt )
+        {
+          /* the file isn't there yet; link after the copy */
+          return s4x_add( &cx->files, &cx->nfiles, &cx->afiles, path,
+                          -ino, 0 );
+        }
+
+      if( S_IFDIR == fmt )
+        {
+          printf("%s: directory inode %d seen twice, skipped\n",
+                 path, ino );
+          cx->errors++;
+        }
+      else if( link( cx->where[ino], path ) < 0 )
+        {
+          printf("link %s: %s\n", path, strerror(errno) );
+          cx->errors++;
+        }
+      else
+        cx->nlinks++;
+      free( path );
+      return 0;
+    }
+  cx->where[ino] = path;
+
+  switch( fmt )
+    {
+    case S_IFDIR:
+      if( mkdir( path, 0700 ) < 0 && EEXIST != errno )
+        {
+          printf("mkdir %s: %s\n", path, strerror(errno) );
+          cx->errors++;
+          return 0;
+        }
+      return s4x_add( &cx->dirs, &cx->ndirs, &cx->adirs, path, ino, 0 );
+
+    case S_IFREG:
+      if( s4x_add( &cx->files, &cx->nfiles, &cx->afiles, path, ino,
+                   s4_ilist_addr( il, ino )[0] ) )
+        return -1;
+      cx->nregs++;
+      break;
+
+    default:
+      /* devices need root, fifos don't; old 8+8 bit numbers */
+      dev = s4_ilist_addr( il, ino )[0];
+      if( mknod( path, il->mode[ino],
+                 makedev( (dev >> 8) & 0xff, dev & 0xff ) ) < 0 )
+        {
+          if( EPERM == errno )
+            cx->nnoperm++;
+          else
+            {
+              printf("mknod %s: %s\n", path, strerror(errno) );
+              cx->errors++;
+            }
+          /* not there to link to; other names try again */
+          cx->where[ino] = NULL;
+          free( path );
+          return 0;
+        }
+      cx->nspecial++;
+      s4x_attrs( cx, path, ino );
+      break;
+    }
+  return 0;
+}
+
+
+/* walk the tree from the root, making directories and listing the rest */
+static int s4x_walk( s4xcx *cx )
+{
+  struct s4_direct de;
+  s4_dir           d;
+  s4_ilist        *il = &cx->il;
+  s4err            err;
+  char             name[ S4_DIRSIZ + 1 ];
+  char            *path;
+  int              i, ino;
+
+  /* dirs grows as we go */
+  for( i = 0; i < cx->ndirs; i++ )
+    {
+      err = s4_filsys_opendir( cx->fs, cx->dirs[i].ino, &d );
+      while( s4_ok == err && s4_ok == (err = s4_filsys_readdir( &d, &de )) )
+        {
+          memcpy( name, de.d_name, S4_DIRSIZ );
+          name[ S4_DIRSIZ ] = 0;
+          ino = de.d_ino;
+
+          if( !strcmp( name, "." ) || !strcmp( name, ".." ) )
+            continue;
+          if( !name[0] || strchr( name, '/' ) ||
+              ino < 1 || ino > il->ninode || !il->mode[ino] )
+            {
+              printf("%s: skipping bad entry '%s' inode %d\n",
+                     cx->dirs[i].path, name, ino );
+              cx->errors++;
+              continue;
+            }
+
+          if( !(path = malloc( strlen( cx->dirs[i].path ) + strlen( name ) + 2 )) )
+            return -1;
+          sprintf( path, "%s/%s", cx->dirs[i].path, name );
+          if( s4x_enter( cx, path, ino ) )
+            return -1;
+        }
+      if( s4_range != err )
+        {
+          printf("%s: reading directory: %s\n", cx->dirs[i].path,
+                 s4errstr(err) );
+          cx->errors++;
+        }
+    }
+  return 0;
+}
+
+
+/* the same from an index: its paths are sorted, so each directory
+   comes before what's in it, and no directory need be read */
+static int s4x_walk_idx( s4xcx *cx, s4_idx *ix )
+{
+  const char *name;
+  char       *path;
+  int         i, ino;
+
+  for( i = 0; i < ix->hdr->npath; i++ )
+    {
+      name = ix->str + ix->path[i].name;
+      ino  = ix->path[i].ino;
+      if( !strcmp( name, "/" ) )
+        continue;
+      if( ino < 1 || ino > cx->il.ninode || !cx->il.mode[ino] )
+        {
+          printf("%s: skipping bad index entry inode %d\n", name, ino );
+          cx->errors++;
+          continue;
+        }
+
+      if( !(path = malloc( strlen( cx->dirs[0].path ) + strlen( name ) + 1 )) )
+        return -1;
+      sprintf( path, "%s%s", cx->dirs[0].path, name );
+      if( s4x_enter( cx, path, ino ) )
+        return -1;
+    }
+  return 0;
+}
+
+
+/* make top and plan everything under it, from ix if it's open */
+static int s4x_plan( s4xcx *cx, const char *top, s4_idx *ix )
+{
+  char *path;
+
+  if( mkdir( top, 0755 ) < 0 && EEXIST != errno )
+    {
+      printf("Can't make '%s': %s\n", top, strerror(errno) );
+      return -1;
+    }
+  if( !(path = strdup( top )) ||
+      s4x_add( &cx->dirs, &cx->ndirs, &cx->adirs, path, S4_ROOTINO, 0 ) )
+    return -1;
+  cx->where[ S4_ROOTINO ] = path;
+
+  return ix->map ? s4x_walk_idx( cx, ix ) : s4x_walk( cx );
+}
+
+
+/* copy one file out */
+static int s4x_copy( s4xcx *cx, s4x_ent *fp, char *buf )
+{
+  long long off;
+  long      n;
+  int       fd, rv = 0;
+
+  if( (fd = open( fp->path, O_WRONLY | O_CREAT | O_TRUNC, 0600 )) < 0 )
+    {
+      printf("create %s: %s\n", fp->path, strerror(errno) );
+      return -1;
+    }
+
+  for( off = 0; off < cx->il.size[ fp->ino ]; off += n )
+    {
+      n = s4_filsys_read_file( cx->fs, fp->ino, off, S4X_CHUNK, buf );
+      if( n <= 0 )
+        {
+          printf("%s: short at %lld of %d\n", fp->path, off,
+                 cx->il.size[ fp->ino ] );
+          rv = -1;
+          break;
+        }
+      if( s4_ok != s4_pwrite( fd, off, buf, n ) )
+        {
+          rv = -1;
+          break;
+        }
+    }
+
+  if( close( fd ) < 0 )
+    rv = -1;
+  if( !rv )
+    s4x_attrs( cx, fp->path, fp->ino );
+  return rv;
+}
+
+
+static void *s4x_worker( void *arg )
+{
+  s4xcx     *cx = arg;
+  s4x_ent   *fp;
+  char      *buf;
+  int        i, errors = 0;
+  long long  bytes = 0;
+
+  if( !(buf = malloc( S4X_CHUNK )) )
+    return NULL;
+
+  for( ;; )
+    {
+      pthread_mutex_lock( &cx->lock );
+      i = cx->next++;
+      pthread_mutex_unlock( &cx->lock );
+      if( i >= cx->nfiles )
+        break;
+
+      fp = &cx->files[i];
+      if( fp->ino < 0 )
+        continue;
+      if( s4x_copy( cx, fp, buf ) )
+        errors++;
+      else
+        bytes += cx->il.size[ fp->ino ];
+    }
+
+  pthread_mutex_lock( &cx->lock );
+  cx->errors += errors;
+  cx->bytes  += bytes;
+  pthread_mutex_unlock( &cx->lock );
+
+  free( buf );
+  return NULL;
+}
+
+
+int main( int argc, char **argv )
+{
+  int	      rv = 0;
+
+  char       *pname   = argv[0];
+  char       *volfile = NULL;
+  char       *fsfile  = NULL;
+  char       *outdir  = NULL;
+  s4_vol      vinfo;
+  s4_filsys   lfs;
+  s4err       err = s4_ok;
+  int         help = 0;
+  int         consumed;
+  int         dbgflag = 0;
+  int         stats = 0;
+  int         jobs = 0;
+  int         i;
+  s4_stats    st;
+  s4_idx      idx;
+  s4xcx       cx;
+  pthread_t   threads[ S4X_MAXJOBS ];
+
+  for( argc--, argv++; argc > 0 && !help ; argc -= consumed, argv += consumed)
+    {
+      consumed = 2;
+      if( argc > 1 )
+        {
+          if( !strcmp( "-i", argv[0] ))
+            {
+              volfile = argv[1]; continue;
+            }
+          else if( !strcmp( "-f", argv[0] ))
+            {
+              fsfile = argv[1]; continue;
+            }
+          else if( !strcmp( "-o", argv[0] ) )
+            {
+              outdir = argv[1]; continue;
+            }
+          else if( !strcmp( "-j", argv[0] ) )
+            {
+              jobs = atoi( argv[1] ); continue;
+            }
+        }
+      consumed = 1;
+      if( !strcmp( "-d", argv[0] ) )
+        {
+          dbgflag++;
+          continue;
+        }
+      else if( !strcmp( "--stats", argv[0] ) )
+        {
+          stats++;
+          continue;
+        }
+      else
+        {
+          printf("Unexpected argument or missing value to '%s'\n", argv[0]);
+          help = 1;
+        }
+    }
+
+  if( help || !outdir || !*outdir || !volfile == !fsfile )
+   {
+      printf("usage: %s -i volfile | -f fsfile -o dir [-j jobs] [--stats]\n",
+             pname );
+      exit( 1 );
+    }
+  if( dbgflag )
+    s4_log_set( dbgflag > 1 ? S4_LOG_DEBUG : S4_LOG_INFO, S4_LOG_ALL );
+
+  if( jobs <= 0 )
+    jobs = sysconf( _SC_NPROCESSORS_ONLN );
+  if( jobs <= 0 )
+    jobs = 1;
+  if( jobs > S4X_MAXJOBS )
+    jobs = S4X_MAXJOBS;
+
+  memset( &lfs, 0, sizeof(lfs) );
+  if( volfile )
+    {
+      err = s4_open_vol( volfile, 004 | S4_O_MMAP, &vinfo );
+      if( s4_ok != err )
+        {
+          printf("Got '%s' opening %s\n", s4errstr(err), volfile );
+          exit( 1 ) ;
+        }
+      err = s4_vol_open_filsys( &vinfo, vinfo.fspnum, &lfs );
+    }
+  else
+    {
+      err = s4_open_filsys_mode( fsfile, 004 | S4_O_MMAP, &lfs );
+    }
+  if( s4_ok != err )
+    {
+      printf("Can't find filesystem in '%s'  -- %s\n",
+             volfile ? volfile : fsfile, s4errstr(err) );
+      exit( 1 );
+    }
+
+  memset( &cx, 0, sizeof(cx) );
+  cx.fs = &lfs;
+  pthread_mutex_init( &cx.lock, NULL );
+
+  /* an index of the image saves reading the directories */
+  if( s4_ok == s4_idx_open( volfile ? volfile : fsfile, &lfs, &idx ) )
+    printf("Planning from the index of '%s'\n", volfile ? volfile : fsfile );
+
+  if( s4_ok != s4_filsys_ilist( &lfs, &cx.il ) ||
+      !(cx.where = calloc( cx.il.ninode + 1, sizeof(*cx.where) )) ||
+      s4x_plan( &cx, outdir, &idx ) )
+    {
+      printf("Can't plan extraction to '%s'\n", outdir );
+      exit( 1 );
+    }
+
+  /* the reads go through the image in order, the links after their files */
+  qsort( cx.files, cx.nfiles, sizeof(*cx.files), s4x_first_cmp );
+
+  for( i = 0; i < jobs; i++ )
+    if( pthread_create( &threads[i], NULL, s4x_worker, &cx ) )
+      break;
+  if( !i )
+    s4x_worker( &cx );
+  jobs = i;
+  for( i = 0; i < jobs; i++ )
+    pthread_join( threads[i], NULL );
+
+  for( i = 0; i < cx.nfiles; i++ )
+    {
+      if( cx.files[i].ino > 0 )
+        continue;
+      if( link( cx.where[ -cx.files[i].ino ], cx.files[i].path ) < 0 )
+        {
+          printf("link %s: %s\n", cx.files[i].path, strerror(errno) );
+          cx.errors++;
+        }
+      else
+        cx.nlinks++;
+    }
+
+  /* deepest last made, so first done */
+  for( i = cx.ndirs; i-- > 0 ; )
+    s4x_attrs( &cx, cx.dirs[i].path, cx.dirs[i].ino );
+
+  printf("%d directories, %d files, %d links, %d special, %lld bytes\n",
+         cx.ndirs, cx.nregs, cx.nlinks, cx.nspecial, cx.bytes );
+  if( cx.nnoperm )
+    printf("%d device nodes skipped, making them needs root\n",
+           cx.nnoperm );
+  if( cx.errors )
+    {
+      printf("%d errors extracting filesystem\n", cx.errors );
+      rv = 1;
+    }
+
+  if( stats )
+    {
+      s4_filsys_stats( &lfs, &st );
+      s4_stats_show( &st );
+    }
+
+  s4_idx_close( &idx );
+  s4_ilist_free( &cx.il );
+  s4_filsys_close( &lfs );
+  if( volfile )
+    s4_vol_close( &vinfo );
+
+  return  rv;
+}
@@ -0,0 +1,228 @@
+/*
+ * s4file.c -- reading files out of a filesystem, see s4d.h
+ *
+ * Logical blocks are mapped through the direct and indirect
+ * addresses of the inode, then runs of physically adjacent blocks
+ * are read with one s4_filsys_read_fblks each.  Indirect blocks come
+ * through the block cache, and the last one used at each level is
+ * kept decoded, so a sequential read looks each one up once.
+ */
+
+#include <s4d.h>
+
+
+/* most FS blocks in one read */
+#define S4_FILE_MAXRUN  256
+
+/* largest S4_NINDIR, for 1K blocks */
+#define S4_FILE_NINDIR  (1024 / sizeof(s4_daddr))
+
+/* the decoded indirect block last used at one level */
+typedef struct
+{
+  s4_daddr  fblk;               /* 0 if none */
+  s4_daddr  ent[ S4_FILE_NINDIR ];
+
+} s4_ind;
+
+/* one file being mapped */
+typedef struct
+{
+  s4_filsys *fs;
+  int        nindir;            /* addresses per indirect block */
+  s4_daddr   addrs[ S4_NADDR ];
+  s4_ind     ind[ 3 ];
+
+} s4_bmap;
+
+
+s4err s4_filsys_iget( s4_filsys *fs, int ino, struct s4_dinode *dp,
+                      s4_daddr *addrs )
+{
+  s4_fsu   fsu;
+  s4err    rv;
+  int      inopb;
+
+  inopb = fs->bksz / sizeof(struct s4_dinode);
+  if( ino < 1 || ino > (fs->super.super.s_isize - 2) * inopb )
+    return s4_range;
+
+  rv = s4_filsys_read_blk( fs, 2 + (ino - 1) / inopb, fs->bksz / 512,
+                           fsu.buf, fs->bksz );
+  if( s4_ok != rv )
+    return rv;
+
+  *dp = fsu.dino[ (ino - 1) % inopb ];
+  if( fs->doswap )
+    s4_swap_inodes( dp, 1 );
+  if( addrs )
+    s4_dinode_addrs( dp, 1, fs->doswap, addrs );
+
+  return s4_ok;
+}
+
+
+/* entry idx of indirect block fblk at level lvl */
+static s4err s4_bmap_ind( s4_bmap *bm, int lvl, s4_daddr fblk, int idx,
+                          s4_daddr *fblkp )
+{
+  s4_ind  *ip = &bm->ind[ lvl ];
+  s4err    rv;
+  int      i;
+
+  if( fblk <= 0 )
+    {
+      *fblkp = 0;
+      return s4_ok;
+    }
+
+  if( ip->fblk != fblk )
+    {
+      ip->fblk = 0;
+      rv = s4_filsys_read_blk( bm->fs, fblk, bm->fs->bksz / 512,
+                               (char*)ip->ent, bm->fs->bksz );
+      if( s4_ok != rv )
+        return rv;
+      if( bm->fs->doswap )
+        for( i = 0; i < bm->nindir; i++ )
+          ip->ent[i] = s4swapi( ip->ent[i] );
+      ip->fblk = fblk;
+    }
+
+  *fblkp = ip->ent[ idx ];
+  return s4_ok;
+}
+
+
+/* FS block holding logical block lbn, 0 for a hole */
+static s4err s4_bmap_blk( s4_bmap *bm, long lbn, s4_daddr *fblkp )
+{
+  long     n = bm->nindir;
+  s4_daddr fblk;
+  s4err    rv;
+  int      lvl;
+
+  if( lbn < S4_NADDR - 3 )
+    {
+      *fblkp = bm->addrs[ lbn ];
+      return s4_ok;
+    }
+
+  /* find the level, 1 to 3 indirections */
+  lbn -= S4_NADDR - 3;
+  for( lvl = 1; lvl <= 3 && lbn >= n; lvl++ )
+    {
+      lbn -= n;
+      n   *= bm->nindir;
+    }
+  if( lvl > 3 )
+    return s4_range;
+
+  fblk = bm->addrs[ S4_NADDR - 4 + lvl ];
+  for( ; lvl > 0 ; lvl-- )
+    {
+      n /= bm->nindir;
+      rv = s4_bmap_ind( bm, 3 - lvl, fblk, (lbn / n) % bm->nindir, &fblk );
+      if( s4_ok != rv )
+        return rv;
+    }
+
+  *fblkp = fblk;
+  return s4_ok;
+}
+
+
+/* copy len bytes at boff of FS block fblk, zeroes for a hole */
+static s4err s4_file_part( s4_filsys *fs, s4_daddr fblk, int boff, int len,
+                           char *buf )
+{
+  s4_fsu   fsu;
+  char    *p;
+
+  if( !fblk )
+    {
+      memset( buf, 0, len );
+      return s4_ok;
+    }
+  if( !(p = s4_filsys_blk( fs, fblk, fsu.buf )) )
+    return s4_read;
+  memcpy( buf, p + boff, len );
+  return s4_ok;
+}
+
+
+long s4_filsys_read_file( s4_filsys *fs, int ino, off_t offset, long len,
+                          char *buf )
+{
+  struct s4_dinode  di;
+  s4_bmap          *bm;
+  s4_daddr          fblk, first;
+  s4err             rv;
+  long              lbn, nblks, done, boff, n;
+  int               bksz = fs->bksz;
+
+  if( !(bm = calloc( 1, sizeof(*bm) )) )
+    return -1;
+  bm->fs     = fs;
+  bm->nindir = bksz / sizeof(s4_daddr);
+
+  if( s4_ok != (rv = s4_filsys_iget( fs, ino, &di, bm->addrs )) )
+    {
+      printf("reading inode %d: %s\n", ino, s4errstr(rv) );
+      free( bm );
+      return -1;
+    }
+
+  if( offset < 0 || offset >= di.di_size || len <= 0 )
+    {
+      free( bm );
+      return 0;
+    }
+  if( len > di.di_size - offset )
+    len = di.di_size - offset;
+
+  done = 0;
+  rv   = s4_ok;
+  while( s4_ok == rv && done < len )
+    {
+      lbn  = (offset + done) / bksz;
+      boff = (offset + done) % bksz;
+      if( s4_ok != (rv = s4_bmap_blk( bm, lbn, &first )) )
+        break;
+
+      /* partial blocks and holes a block at a time */
+      if( boff || len - done < bksz || !first )
+        {
+          n = bksz - boff;
+          if( n > len - done )
+            n = len - done;
+          rv = s4_file_part( fs, first, boff, n, buf + done );
+          done += n;
+          continue;
+        }
+
+      /* whole blocks, as many as are adjacent on disk */
+      for( nblks = 1; nblks < S4_FILE_MAXRUN &&
+             (nblks + 1) * bksz <= len - done; nblks++ )
+        {
+          if( s4_ok != (rv = s4_bmap_blk( bm, lbn + nblks, &fblk )) )
+            break;
+          if( fblk != first + nblks )
+            break;
+        }
+      if( s4_ok != rv )
+        break;
+
+      rv = s4_filsys_read_fblks( fs, first, nblks, buf + done );
+      done += nblks * bksz;
+    }
+
+  free( bm );
+  if( s4_ok != rv )
+    {
+      printf("reading inode %d at %ld: %s\n", ino, (long)offset + done,
+             s4errstr(rv) );
+      return -1;
+    }
+  return done;
+}
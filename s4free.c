@@ -0,0 +1,161 @@
+/*
+ * s4free.c -- the free list as a bitmap, see s4d.h
+ *
+ * The chain of s4_fblk blocks from the superblock is walked once,
+ * asking for each link as soon as it is known, and every block on
+ * it is marked in a bitmap.  Runs of free blocks are then listed as
+ * extents.  Whatever is wrong with the chain is counted on the way.
+ */
+
+#include <s4d.h>
+
+
+/* mark one block listed as free */
+static void s4_freemap_mark( s4_freemap *fm, s4_daddr b )
+{
+  if( b < fm->isize || b >= fm->fsize )
+    fm->nbad++;
+  else if( s4_freemap_isfree( fm, b ) )
+    fm->ndup++;
+  else
+    {
+      fm->bits[ b >> 5 ] |= 1u << (b & 31);
+      fm->nfree++;
+    }
+}
+
+
+static s4err s4_freemap_extents( s4_freemap *fm )
+{
+  s4_extent *p;
+  s4_daddr   b, start;
+  int        alloc = 0;
+
+  for( b = fm->isize; b < fm->fsize; b++ )
+    {
+      if( !s4_freemap_isfree( fm, b ) )
+        continue;
+      for( start = b; b < fm->fsize && s4_freemap_isfree( fm, b ); b++ )
+        continue;
+
+      if( fm->next == alloc )
+        {
+          alloc = alloc ? alloc * 2 : 256;
+          if( !(p = realloc( fm->ext, alloc * sizeof(*p) )) )
+            return s4_error;
+          fm->ext = p;
+        }
+      fm->ext[ fm->next ].start = start;
+      fm->ext[ fm->next ].len   = b - start;
+      fm->next++;
+    }
+  return s4_ok;
+}
+
+
+s4err s4_filsys_freemap( s4_filsys *fs, s4_freemap *fm )
+{
+  struct s4_dfilsys *sp = &fs->super.super;
+  s4_daddr           list[ S4_NICFREE ];
+  s4_daddr           link;
+  s4_fsu             fsu;
+  char              *p;
+  int                i, cnt;
+
+  memset( fm, 0, sizeof(*fm) );
+  fm->isize = sp->s_isize;
+  fm->fsize = sp->s_fsize;
+  fm->tfree = sp->s_tfree;
+  if( fm->fsize <= 0 ||
+      !(fm->bits = calloc( (fm->fsize + 31) / 32, sizeof(*fm->bits) )) )
+    return s4_error;
+
+  cnt = sp->s_nfree;
+  if( cnt > 0 && cnt <= S4_NICFREE )
+    memcpy( list, sp->s_free, cnt * sizeof(list[0]) );
+
+  for( ;; )
+    {
+      if( cnt < 0 || cnt > S4_NICFREE )
+        {
+          fm->broken = 1;
+          break;
+        }
+      if( !cnt )
+        break;
+
+      /* on its way while we mark this batch */
+      link = list[0];
+      if( link >= fm->isize && link < fm->fsize &&
+          !s4_freemap_isfree( fm, link ) )
+        s4_filsys_willneed( fs, link, 1 );
+
+      for( i = 1; i < cnt; i++ )
+        s4_freemap_mark( fm, list[i] );
+
+      if( !link )
+        break;
+      if( link < fm->isize || link >= fm->fsize )
+        {
+          fm->nbad++;
+          fm->broken = 1;
+          break;
+        }
+      if( s4_freemap_isfree( fm, link ) )
+        {
+          fm->cycle = 1;
+          break;
+        }
+      s4_freemap_mark( fm, link );
+      fm->nchain++;
+
+      if( !(p = s4_filsys_blk( fs, link, fsu.buf )) )
+        {
+          fm->broken = 1;
+          break;
+        }
+      if( p != fsu.buf )
+        memcpy( fsu.buf, p, fs->bksz );
+      if( fs->doswap )
+        s4_fsu_swap( &fsu, s4b_free );
+
+      cnt = fsu.free.df_nfree;
+      if( cnt > 0 && cnt <= S4_NICFREE )
+        memcpy( list, fsu.free.df_free, cnt * sizeof(list[0]) );
+    }
+
+  if( s4_ok != s4_freemap_extents( fm ) )
+    {
+      s4_freemap_free( fm );
+      return s4_error;
+    }
+  return s4_ok;
+}
+
+
+void s4_freemap_free( s4_freemap *fm )
+{
+  free( fm->bits );
+  free( fm->ext );
+  memset( fm, 0, sizeof(*fm) );
+}
+
+
+void s4_freemap_show( s4_freemap *fm )
+{
+  int  i, big = 0;
+
+  for( i = 0; i < fm->next; i++ )
+    if( fm->ext[i].len > big )
+      big = fm->ext[i].len;
+
+  printf("Free list: %ld blocks (super says %ld) in %d chain blocks\n",
+         fm->nfree, fm->tfree, fm->nchain );
+  printf("           %d extents, largest %d, average %ld\n",
+         fm->next, big, fm->next ? fm->nfree / fm->next : 0 );
+  if( fm->ndup || fm->nbad || fm->cycle || fm->broken )
+    printf("           %d duplicates, %d out of range%s%s\n",
+           fm->ndup, fm->nbad,
+           fm->cycle  ? ", chain loops" : "",
+           fm->broken ? ", chain broken" : "" );
+}
@@ -49,39 +49,63 @@ int main( int argc, char **argv )
 {
   char       *fsfile = argv[1];
   int	      rv;
+  int         doidx = 0;
+  s4_idx      idx;
+  s4_owners   own;
+  const char *path;
   int         j, x;
   int         btype, curadr, lastadr;
   int         ioffset = 0;
   s4_vol     *vinfo;
   s4_filsys   fs;
   s4_fsu      disk_fsu;
+  s4_fsu     *dp = &disk_fsu;   /* into the image when mapped */
   s4_fsu      mem_fsu;
   char	      buf[ 1024 ];
   
   int         bmul = 1;
   s4fs_amode  amode = albar;
-  int         fblk, lbar, offset;
+  int         fblk = 1, lbar, offset;
 
+  if( fsfile && !strcmp( fsfile, "-x" ) )
+    {
+      doidx  = 1;
+      fsfile = argv[2];
+    }
   if( !fsfile || !*fsfile )
     {
-      printf("usage: %s fsfile\n", argv[0] );
+      printf("usage: %s [-x] fsfile\n", argv[0] );
       exit( 1 );
     }
 
   printf("Filesystem image %s\n", fsfile );
-  if( s4_ok != s4_open_filsys( fsfile, &fs ) )
+  /* 004 = O_READ; all reads come out of the mapping */
+  if( s4_ok != s4_open_filsys_mode( fsfile, 004 | S4_O_MMAP, &fs ) )
     {
       printf("Failed as filesystem image\n");
       /* Try as disk image instead */
       exit( 1 );
     }
 
+  own.owner = NULL;
   curadr = 1;
   amode  = albar;
   vinfo  = fs.vinfo;
 
   printf("Opened OK, FS block size is %d\n", fs.bksz );
 
+  /* use a current index for paths; -x builds one if needed */
+  if( doidx )
+    rv = s4_filsys_idx( &fs, fsfile, &idx );
+  else
+    rv = s4_idx_open( fsfile, &fs, &idx );
+  if( s4_ok == rv )
+    printf("Index %s%s: %d paths\n", fsfile, S4_IDX_SUFFIX,
+           idx.hdr->npath );
+  else if( s4_range == rv )
+    printf("Index %s%s is stale, use -x to rebuild\n",
+           fsfile, S4_IDX_SUFFIX );
+
   btype     = s4b_super;
   s4_fsu_show( &fs.super, btype );
   lastadr = -1;
@@ -156,12 +180,66 @@ int main( int argc, char **argv )
               printf("B:        Address as FS-size blocks\n");
               printf("I:        Address Inode number\n\n");
 
+              printf("m:        free list map summary\n");
+              printf("o:        owner of the current FS block\n");
               printf("D:        Goto directory block from inode\n");
               printf("j:        jump to inode from dir, dir from inodes\n");
+              printf("p:        jump to inode of a path, with an index\n");
 
               printf("q:        quit\n");
               continue;
 
+            case 'm':
+              {
+                s4_freemap fm;
+
+                if( s4_ok == s4_filsys_freemap( &fs, &fm ) )
+                  {
+                    s4_freemap_show( &fm );
+                    s4_freemap_free( &fm );
+                  }
+              }
+              continue;
+
+            case 'p':
+              {
+                char *nl;
+
+                if( !idx.map )
+                  {
+                    printf("No index, use -x\n");
+                    continue;
+                  }
+                printf("Path: ");
+                fflush(stdout);
+                if( !fgets( buf, sizeof(buf), stdin ) )
+                  continue;
+                if( (nl = strchr( buf, '\n' )) )
+                  *nl = 0;
+                if( s4_ok != s4_idx_namei( &idx, buf, &x ) )
+                  {
+                    printf("%s not found\n", buf );
+                    continue;
+                  }
+                curadr  = x;
+                btype   = s4b_ino;
+                amode   = ainode;
+                bmul    = 1;
+                lastadr = -1;
+                printf("jumping to inode %d\n", curadr );
+              }
+              break;
+
+            case 'o':
+              /* built the first time, the image doesn't change */
+              if( !own.owner && s4_ok != s4_filsys_owners( &fs, NULL, &own ) )
+                continue;
+              path = NULL;
+              if( idx.map && fblk < own.fsize && fblk >= 0 )
+                path = s4_idx_ipath( &idx, own.owner[ fblk ] );
+              s4_owners_show( &own, fblk, path );
+              continue;
+
             case 'D':
               if( ainode == amode && s4b_ino == btype )
                 {
@@ -256,9 +334,16 @@ int main( int argc, char **argv )
       /* reads always from FS relative LBA */
       if( lastadr != curadr || ainode == amode )
         {
-          rv = s4_seek_read( vinfo->fd, offset, disk_fsu.buf, S4_BSIZE);
-          if( s4_ok != rv )
+          /* whole FS blocks come through the cache, copied out as
+             commands like 'o' can recycle the cached one */
+          if( albar != amode )
+            dp = s4_ok == s4_filsys_cache_read( &fs, fblk, disk_fsu.buf,
+                                                S4_BSIZE ) ? &disk_fsu : NULL;
+          else
+            dp = (s4_fsu*)s4_vol_ptr( vinfo, offset, S4_BSIZE, disk_fsu.buf );
+          if( !dp )
             {
+              rv = s4_read;
               printf("err %s reading %s block %d at %d\n",
                      s4errstr(rv), bmul == 1 ? "LBA" : "FS",
                      curadr, offset );
@@ -272,6 +357,8 @@ int main( int argc, char **argv )
         {
           printf("\nShowing INO %d from FBLK %d LBAR %d idx %d\n", 
                  curadr, fblk, lbar, ioffset );
+          if( idx.map && (path = s4_idx_ipath( &idx, curadr )) )
+            printf("Path %s\n", path );
         }
       else if( s4b_ino == btype && ainode != amode )
         {
@@ -291,7 +378,7 @@ int main( int argc, char **argv )
           for( j = s4b_first_fs; j < s4b_last_fs; j++ )
             {
               /* copy it, then modify copy */
-              memcpy( &mem_fsu, &disk_fsu, sizeof(mem_fsu) );
+              memcpy( &mem_fsu, dp, sizeof(mem_fsu) );
               
               if( fs.doswap )
                 s4_fsu_swap( &mem_fsu, j );
@@ -302,12 +389,12 @@ int main( int argc, char **argv )
       if( s4b_raw == btype )
         {
           /* dump disk buffer, not the mem buffer */
-          s4_fsu_show( &disk_fsu, btype );
+          s4_fsu_show( dp, btype );
         }
       else
         {
           /* copy it, then modify copy */
-          memcpy( &mem_fsu, &disk_fsu, sizeof(mem_fsu) );
+          memcpy( &mem_fsu, dp, sizeof(mem_fsu) );
 
           if( fs.doswap )
             s4_fsu_swap( &mem_fsu, btype );
@@ -327,6 +414,8 @@ int main( int argc, char **argv )
   
   // s4_filsys_show_inodes( &fs );
   // s4_filsys_show_freelist( &fs );
+  s4_owners_free( &own );
+  s4_idx_close( &idx );
   s4_filsys_close( &fs );
 
   return 0;
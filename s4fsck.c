@@ -13,7 +13,8 @@
 
    Usage:
 
-   s4fsck fsfile ... [-s][-S][-n][-y|-Y][-D][-f|-F] [-q][-d]
+   s4fsck fsfile ... [-s][-S][-n][-y|-Y][-D][-f|-F] [-m mb] [-q][-d][--stats]
+                     [-j n] [--json]
 
     -s      force freelist salvage
     -S      conditional freelist salvage
@@ -21,9 +22,17 @@
     -y      answer 'yes' to all repair questions
     -f      "fast" check
     -D      extensive directory check
+    -m mb   most memory for the block cache, in megabytes
 
     -q      quiet (return status only)
     -d      debug output
+    --stats show I/O counters and throughput at exit
+
+    -j n    batch: check n images at once, each in its own process.
+            Never asks; answers 'no' unless -y.  Each image's output
+            is shown whole when it finishes, then a result line.
+    --json  batch, with one JSON result per image on stdout and the
+            output on stderr.  Exit status is 8 if any image fails.
 */
 
   
@@ -36,6 +45,8 @@
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "ismounted.h"
 
@@ -89,9 +100,14 @@ int doswap;                     /* magic numer says we should swap */
 #define MAXRAW	110		/* largest raw read (in blks) */
 s4_daddr startib;		/* blk num of first in raw area */
 unsigned niblk;			/* num of blks in raw area */
+unsigned ninwin;		/* num of blks read into it */
+unsigned curib;			/* blk of the last ginode() in it */
+char	*ibdirty;		/* its blks changed by inodirty() */
 
 struct bufarea {
-  struct bufarea *b_next;       /* must be first */
+  struct bufarea *b_next;       /* towards least recently used */
+  struct bufarea *b_prev;
+  struct bufarea *b_hnext;      /* hash chain */
   s4_daddr	  b_bno;
   int             b_swapped;    /* when type know, and swapped */
   s4btype         b_type;       /* what is in union below? */
@@ -113,13 +129,24 @@ BUFAREA	inoblk;			/* inode blocks */
 BUFAREA	fileblk;		/* other blks in filesys */
 BUFAREA	sblk;			/* file system superblock */
 #define ftypeok(dp)	(REG||DIR||BLK||CHR||FIFO)
-BUFAREA	*poolhead;		/* ptr to first buffer in pool */
+
+/* The block cache, hashed by block number and kept in LRU order,
+   sized from the filesystem in setup() */
+#define MINBUF	64		/* fewest buffers in the cache */
+#define HASHBLK(b)	((unsigned)(b) & (nhash - 1))
+BUFAREA	*bufpool;		/* the buffers */
+BUFAREA	**bufhash;		/* hash chains */
+BUFAREA	*poolhead;		/* most recently used */
+BUFAREA	*pooltail;		/* least recently used */
+unsigned nbuf;			/* buffers in the pool */
+unsigned nhash;			/* hash chains, a power of 2 */
+#define inpool(bp)	((bp) >= bufpool && (bp) < &bufpool[nbuf])
 
 #define initbarea(x)	(x)->b_dirty = 0;(x)->b_bno = (s4_daddr)-1;     \
                         (x)->b_type = s4b_unk;(x)->b_swapped = NO;
 #undef  dirty
 #define dirty(x)	(x)->b_dirty = 1
-#define inodirty()	inoblk.b_dirty = 1
+#define inodirty()	markino()
 #define fbdirty()	fileblk.b_dirty = 1
 #define sbdirty()	sblk.b_dirty = 1
 
@@ -134,63 +161,125 @@ struct filecntl {
 };
 
 struct filecntl	dfile;		/* file descriptors for filesys */
-struct filecntl	sfile;		/* file descriptors for scratch file */
 
 /* typedef unsigned MEMSIZE; */
 typedef size_t MEMSIZE;
 
-MEMSIZE	memsize;		/* amt of memory we got */
-
-#ifdef pdp11
-#define MAXDATA	((MEMSIZE)54*1024)
-#endif
-#ifdef u3b
-#define MAXDATA ((MEMSIZE)350*1024)
-#endif
-#ifdef m68k
-#define MAXDATA ((MEMSIZE)64*1024)
-#endif
-#ifdef vax
-#ifdef STANDALONE
-#define	MAXDATA ((MEMSIZE)256*1024)
-#else
-#define	MAXDATA ((MEMSIZE)350*1024)
-#endif
-#endif
+MEMSIZE	membudget;		/* -m, most for the cache; 0 no limit */
+
+/* Phase 1 scanning.  Threads each take a range of the i-list, read
+   its inodes and chase their indirect blocks, noting the blocks of
+   each inode in the order pass1() visits them; a read that failed is
+   noted as -blk.  The checks, messages and repairs are then made from
+   that in inode order, as if it were read serially. */
+#define MAXSCAN	8		/* most scanning threads */
+#define SCANBLKS 16		/* fewest inode blocks per thread */
+
+struct scanrng {
+  struct scan *sc;
+  s4_ino    lo, hi;             /* inodes lo..hi-1 */
+  s4_daddr *blks;               /* their blocks, pass1() order */
+  long      nblk, ablk;
+  long     *first;              /* of inode lo+i in blks */
+  s4_stats  st;
+  int       nomem;
+};
 
-#ifndef MAXDATA
-#define MAXDATA ((MEMSIZE)600*1024)
-#endif
+struct scan {
+  DINODE   *inos;               /* every inode, in memory order */
+  char     *unread;             /* inodes whose block wouldn't read */
+  int       nrng;
+  struct scanrng rng[MAXSCAN];
+};
 
 /* two different types of visit functions */
 typedef int (*visitdir)(DIRECT *dir, BUFAREA *bp);
 typedef int (*visitblk)(s4_daddr blk, int flg);
 
 
-#define	DUPTBLSIZE	100	/* num of dup blocks to remember */
-s4_daddr	duplist[DUPTBLSIZE];	/* dup block table */
-s4_daddr	*enddup;		/* next entry in dup table */
-s4_daddr	*muldup;		/* multiple dups part of table */
+#define	MAXFREEDUP	100	/* limit on dup blks in free list */
+
+/* Growable hash sets of block or inode numbers, with a count for
+   each; 0 is never a member.  A count of 0 is as good as absent. */
+struct hent {
+  s4_daddr key;
+  int      cnt;
+};
+
+struct hset {
+  struct hent *tab;
+  unsigned     size;            /* a power of 2, 0 until used */
+  unsigned     n;               /* keys entered */
+};
+
+struct hset dupset;		/* dup blks, and how many more claims */
+struct hset dup1b;		/* dup blks whose first claim Phase 1b seeks */
+unsigned ndup1b;		/* of those, not found yet */
+struct hset lnset;		/* inos with zero link cnts */
+
+/* what one check found and did, for the batch results */
+#define PH1	0
+#define PH1B	1
+#define PH2	2
+#define PH3	3
+#define PH4	4
+#define PH5	5
+#define PH6	6
+#define NPHASE	7
+
+struct fsckres {
+  char	r_done;			/* check ran to the end */
+  char	r_mod;			/* file system was written */
+  char	r_ran[NPHASE];		/* phases run */
+  int	r_exit;			/* worker's exit status */
+  long	r_files;		/* as in the summary line */
+  long	r_blks;
+  long	r_free;
+  long	r_bad;			/* bad blk claims, Phase 1 */
+  long	r_dup;			/* dup blk claims, Phase 1 */
+  long	r_fbad;			/* bad blks in the free list */
+  long	r_fdup;			/* dup blks in the free list */
+  long	r_missing;		/* blks neither used nor free */
+  long	r_found[NPHASE];	/* problems asked about */
+  long	r_fixed[NPHASE];	/* of those, repaired */
+  double	r_secs[NPHASE];		/* time in each phase */
+  double	r_total;		/* time for the image */
+  s4_stats	r_io;
+};
 
-#define MAXLNCNT	20	/* num zero link cnts to remember */
-s4_ino	badlncnt[MAXLNCNT];	/* table of inos with zero link cnts */
-s4_ino	*badlnp;		/* next entry in table */
+struct fsckres	fres1;		/* for checks run serially */
+struct fsckres	*fr = &fres1;	/* the image being checked */
+int	phase = -1;		/* PH* being run, or -1 */
+double	phaset;			/* when it began */
+int	jobs;			/* images checked at once, batch */
+char	jsonflag;		/* --json, batch results as JSON */
+
+/* superblk is for the other build, s4fsck or s4fsck1b */
+#if S4_FsTYPE==2
+#define othertype()	(superblk.s_magic != S4_FsMAGIC ||		\
+			 superblk.s_type == S4_Fs1b)
+#else
+#define othertype()	(superblk.s_magic == S4_FsMAGIC &&		\
+			 superblk.s_type == S4_Fs2b)
+#endif
+
+#define qfixed()	(fr->r_found[phase]++, fr->r_fixed[phase]++)
 
 char	sflag;			/* salvage free block list */
 char	csflag;			/* salvage free block list (conditional) */
 char	nflag;			/* assume a no response */
 char	yflag;			/* assume a yes response */
-char	tflag;			/* scratch file specified */
 char	rplyflag;		/* any questions asked? */
 char	qflag;			/* less verbose flag */
 char    dbgflag;                /* very verbose debug flag */
+char    statsflag;              /* --stats, show I/O counters at exit */
+s4_stats iostats;               /* counted in bread/bwrite */
 char	Dirc;			/* extensive directory check */
 char	fast;			/* fast check- dup blks and free list check */
 char	hotroot;		/* checking root device */
-char	rawflg;			/* read raw device */
-char	rmscr;			/* remove scratch file when done */
+char	rawflg;			/* inode blocks read in bulk */
 char	fixfree;		/* corrupted free list */
-char	*membase;		/* base of memory we get */
+char	*membase;		/* raw inode blocks */
 char	*blkmap;		/* ptr to primary blk allocation map */
 char	*freemap;		/* ptr to secondary blk allocation map */
 char	*statemap;		/* ptr to inode state table */
@@ -202,7 +291,6 @@ char	*srchname;		/* name being searched for in dir */
 char	pss2done;			/* do not check dir blks anymore */
 char	initdone;
 char	pathname[MAXPATH];
-char	scrfile[80];
 char	devname[25];
 char	*lfname =	"lost+found";
 
@@ -226,9 +314,6 @@ s4_ino	orphan;			/* orphaned inode */
 s4_off	filsize;		/* num blks seen in file */
 s4_off	bmapsz;			/* num chars in blkmap */
 
-s4_daddr smapblk;               /* starting blk of state map */
-s4_daddr lncntblk;              /* starting blk of link cnt table */
-s4_daddr fmapblk;               /* starting blk of free map */
 s4_daddr n_free;		/* number of free blocks */
 s4_daddr n_blks;		/* number of blocks used */
 s4_daddr n_files;               /* number of files seen */
@@ -281,20 +366,39 @@ const char *cbname(void *f);
 #define error3(f,a1,a2,a3)    printf(f,a1,a2,a3)
 #define error4(f,a1,a2,a3,a4) printf(f,a1,a2,a3,a4)
 
-#define errexit0(f)             {printf(f);exit(8);}
-#define errexit1(f,a1)          {printf(f,a1);exit(8);}
-#define errexit2(f,a1,a2 )      {printf(f,a1,a2); exit(8);}
-#define errexit3(f,a1,a2,a3)    {printf(f,a1,a2,a3); exit(8);}
-#define errexit4(f,a1,a2,a3,a4) {printf(f,a1,a2,a3,a4);exit(8);}
+#define errexit0(f)             {printf(f);errfini();exit(8);}
+#define errexit1(f,a1)          {printf(f,a1);errfini();exit(8);}
+#define errexit2(f,a1,a2 )      {printf(f,a1,a2);errfini();exit(8);}
+#define errexit3(f,a1,a2,a3)    {printf(f,a1,a2,a3);errfini();exit(8);}
+#define errexit4(f,a1,a2,a3,a4) {printf(f,a1,a2,a3,a4);errfini();exit(8);}
 
 void initmem(void);
 void check(char *dev);
+void setphase(int ph);
+int batch(char **imgs, int nimg);
+int checkone(char *dev);
+int respass(struct fsckres *r);
+const char *resstatus(struct fsckres *r);
+void textres(char *img, struct fsckres *r);
+void jsonres(char *img, struct fsckres *r);
+void jsonstr(char *s);
 void descend(void);
+void scan1(struct scan *sc);
+void scan1free(struct scan *sc);
+int ckinode1(struct scan *sc);
 
 int fsck_getline(FILE *fp, char *loc, int maxlen);
 DINODE	*ginode(void);
 BUFAREA *getblk( BUFAREA *bp, int blk );
 BUFAREA *search(s4_daddr blk);
+void bhash(BUFAREA *bp);
+void binval(s4_daddr blk);
+void freemem(void);
+void markino(void);
+struct hent *hfind(struct hset *hs, s4_daddr key, int add);
+void hclear(struct hset *hs);
+void inoflush(void);
+void errfini(void);
 void flush(struct filecntl *fcp, BUFAREA *bp );
 void	catch(int sig);
 
@@ -336,6 +440,7 @@ int chkempt(DINODE *dp);
 int setup(char *dev);
 int checksb(char *dev);
 int reply(char *s);
+int replyes(char *s);
 int getno(FILE *fp);
 int domap(s4_daddr blk, int flg);
 int dolncnt(short val, int flg);
@@ -366,7 +471,6 @@ int main(int argc, char **argv)
   int n;
   int svargc, argvix;
   int ix;
-  struct stat statbuf;
 
   if ( argv[0][0] >= '0' && argv[0][0] <= '9' ) id = argv[0][0];
 
@@ -374,19 +478,28 @@ int main(int argc, char **argv)
   setbuf(stdout,NULL);
   sync();
 
+  s4_stats_init(&iostats);
+
   svargc = argc;
   for(i = 1, --argc;  *argv[i] == '-'; i++, --argc) {
     switch(*(argv[i]+1)) {
-    case 't':
-    case 'T':
-      tflag++;
-      if(*argv[++i] == '-' || --argc <= 0)
-        errexit1("%c Bad -t option\n",id);
-      strcpy(scrfile,argv[i]);
-      if( (stat(scrfile,&statbuf) >= 0) &&
-          ((statbuf.st_mode & S_IFMT) != S_IFREG) )
-        errexit2("%c Illegal scratch file <%s>\n",
-                 id, scrfile);
+    case '-':
+      if(!strcmp(argv[i],"--stats"))
+        statsflag++;
+      else if(!strcmp(argv[i],"--json"))
+        jsonflag++;
+      else
+        errexit2("%c %s option?\n",id,argv[i]);
+      break;
+    case 'j':
+      if(--argc <= 0 || (n = atoi(argv[++i])) <= 0)
+        errexit1("%c Bad -j option\n",id);
+      jobs = n;
+      break;
+    case 'm':
+      if(--argc <= 0 || (n = atoi(argv[++i])) <= 0)
+        errexit1("%c Bad -m option\n",id);
+      membudget = (MEMSIZE)n << 20;
       break;
     case 's':	/* salvage flag */
       stype(argv[i]+2);
@@ -423,6 +536,10 @@ int main(int argc, char **argv)
       errexit2("%c %c option?\n",id,*(argv[i]+1));
     }
   }
+  if(jsonflag && !jobs)
+    jobs = 1;
+  if(jobs && !yflag)		/* a batch never asks */
+    nflag++;
   if(nflag && sflag)
     errexit1("%c Incompatible options: -n and -s\n",id);
   if(nflag && qflag)
@@ -432,18 +549,15 @@ int main(int argc, char **argv)
   if(csflag) nflag++;
 
   ix = argvix = svargc - argc;		/* position of first fs argument */
+  if(jobs)
+    exit(batch(&argv[ix],argc));
   while(argc > 0) {
     initbarea(&sblk);
     if(checksb(argv[ix]) == NO) {
       argc--; ix++;
       continue;
     }
-#if S4_FsTYPE==2
-    if(superblk.s_magic != S4_FsMAGIC ||
-       (superblk.s_magic == S4_FsMAGIC && superblk.s_type == S4_Fs1b)) {
-#else
-      if(superblk.s_magic == S4_FsMAGIC && superblk.s_type == S4_Fs2b) {
-#endif
+    if(othertype()) {
         if(dfile.rfdes > 0 )
           close(dfile.rfdes);
         if(argvix < svargc - argc) {
@@ -460,11 +574,7 @@ int main(int argc, char **argv)
           errexit2("%c %sCannot exec ./s4fsck\n",
                    id,devname);
 #endif
-#if S4_FsTYPE==2
-      } /* match FS2 bracket */
-#else
-    } /* match else bracket */
-#endif
+    }
 
     if(!initdone) {
       initmem();
@@ -473,6 +583,8 @@ int main(int argc, char **argv)
     check(argv[ix++]);
     argc--;
   }
+  if(statsflag)
+    s4_stats_show(&iostats);
   exit(0);
 }
 
@@ -483,17 +595,6 @@ void initmem(void)
   register int n;
   struct stat statbuf;
   void (*sg)(int);
-  void *sbrk();
-  void *brk;
-
-  /* number of block buffers */
-  memsize = 256 * sizeof(BUFAREA);
-  brk = sbrk( memsize );
-  if( (long int)brk == -1 )
-    errexit1("%c Can't get memory\n",id);
-
-  membase = brk;
-
 
   for(n = 1; n < NSIG; n++) {
     if(n == SIGCLD || n == SIGPWR)
@@ -514,10 +615,9 @@ void check(char *dev)
 {
   register DINODE *dp;
   register int n;
-  register s4_ino *blp;
+  struct hent *hp;
   s4_ino savino;
-  s4_daddr blk;
-  BUFAREA *bp1, *bp2;
+  struct scan sc;
 
   if(pipedev != -1) {
     strcpy(devname,dev);
@@ -529,43 +629,42 @@ void check(char *dev)
     return;
 
   printf("%c %s** Phase 1 - Check Blocks and Sizes\n",id,devname);
+  setphase(PH1);
   bpfunc = pass1;
+  scan1(&sc);
   for(inum = 1; inum <= imax; inum++) {
-    if((dp = ginode()) == NULL)
+    /* as ginode() would have */
+    if(sc.unread[inum]) {
+      rwerr("READ",itod(inum));
       continue;
+    }
+    dp = &sc.inos[inum];
 
     if( dbgflag ) {
       printf("Inode %d:\n", inum );
-      s4_dinode_show( (struct s4_dinode*)
-                      &inoblk.b_un.b_dinode[inum%S4_INOPB] );
+      s4_dinode_show( dp );
     }
 
+    /* repairs are made to the inode itself */
     if(ALLOC) {
       lastino = inum;
       if(ftypeok(dp) == NO) {
         printf("%c %sUNKNOWN FILE TYPE I=%u",id,devname,inum);
         if(dp->di_size)
           printf(" (NOT EMPTY)");
-        if(reply("CLEAR") == YES) {
+        if(reply("CLEAR") == YES && (dp = ginode()) != NULL) {
           zapino(dp);
           inodirty();
         }
         continue;
       }
       n_files++;
-      if(setlncnt(dp->di_nlink) <= 0) {
-        if(badlnp < &badlncnt[MAXLNCNT])
-          *badlnp++ = inum;
-        else {
-          printf("%c %sLINK COUNT TABLE OVERFLOW",id,devname);
-          if(reply("CONTINUE") == NO)
-            errexit0("\n");
-        }
-      }
+      if(setlncnt(dp->di_nlink) <= 0)
+        hfind(&lnset,inum,1)->cnt = 1;
       setstate(DIR ? DSTATE : FSTATE);
       badblk = dupblk = 0;
       filsize = 0;
-      ckinode(dp,ADDR);
+      ckinode1(&sc);
       if((n = getstate()) == DSTATE || n == FSTATE)
         sizechk(dp);
     }
@@ -573,15 +672,17 @@ void check(char *dev)
       printf("%c %sPARTIALLY ALLOCATED INODE I=%u",id,devname,inum);
       if(dp->di_size)
         printf(" (NOT EMPTY)");
-      if(reply("CLEAR") == YES) {
+      if(reply("CLEAR") == YES && (dp = ginode()) != NULL) {
         zapino(dp);
         inodirty();
       }
     }
   }
+  scan1free(&sc);
 
-  if(enddup != &duplist[0]) {
+  if(dupset.n) {
     printf("%c %s** Phase 1b - Rescan For More DUPS\n",id,devname);
+    setphase(PH1B);
     bpfunc = pass1b;
     for(inum = 1; inum <= lastino; inum++) {
       if(getstate() != USTATE && (dp = ginode()) != NULL)
@@ -589,27 +690,12 @@ void check(char *dev)
           break;
     }
   }
-  if(rawflg) {
-    if(inoblk.b_dirty)
-      bwrite(&dfile,membase,startib,niblk*S4_BSIZE);
-    inoblk.b_dirty = 0;
-    if(poolhead) {
-      clear(membase,niblk*S4_BSIZE);
-      for(bp1 = poolhead;bp1->b_next;bp1 = bp1->b_next);
-      bp2 = &((BUFAREA *)membase)[(niblk*S4_BSIZE)/sizeof(BUFAREA)];
-      while(--bp2 >= (BUFAREA *)membase) {
-        initbarea(bp2);
-        bp2->b_next = bp1->b_next;
-        bp1->b_next = bp2;
-      }
-    }
-    rawflg = 0;
-
-  }
+  inoflush();
 
 
   if(!fast) {
     printf("%c %s** Phase 2 - Check Pathnames\n",id,devname);
+    setphase(PH2);
     inum = S4_ROOTINO;
     thisname = pathp = pathname;
     dpfunc = pass2;
@@ -638,6 +724,7 @@ void check(char *dev)
 
     pss2done++;
     printf("%c %s** Phase 3 - Check Connectivity\n",id,devname);
+    setphase(PH3);
     for(inum = S4_ROOTINO; inum <= lastino; inum++) {
       if(getstate() == DSTATE) {
         dpfunc = findino;
@@ -666,26 +753,23 @@ void check(char *dev)
 
 
     printf("%c %s** Phase 4 - Check Reference Counts\n",id,devname);
+    setphase(PH4);
     bpfunc = pass4;
     for(inum = S4_ROOTINO; inum <= lastino; inum++) {
       switch(getstate()) {
       case FSTATE:
         if((n = getlncnt()))
           adjust((short)n);
-        else {
-          for(blp = badlncnt;blp < badlnp; blp++)
-            if(*blp == inum) {
-              if((dp = ginode()) &&
-                 dp->di_size) {
-                if((n = linkup()) == NO)
-                  clri("UNREF",NO);
-                if (n == REM)
-                  clri("UNREF",REM);
-              }
-              else
-                clri("UNREF",YES);
-              break;
-            }
+        else if((hp = hfind(&lnset,inum,0)) && hp->cnt) {
+          if((dp = ginode()) &&
+             dp->di_size) {
+            if((n = linkup()) == NO)
+              clri("UNREF",NO);
+            if (n == REM)
+              clri("UNREF",REM);
+          }
+          else
+            clri("UNREF",YES);
         }
         break;
       case DSTATE:
@@ -700,6 +784,7 @@ void check(char *dev)
       if (qflag) {
         superblk.s_tinode = imax - n_files;
         sbdirty();
+        qfixed();
         printf("\n%c %sFIXED\n",id,devname);
       }
       else if(reply("FIX") == YES) {
@@ -709,31 +794,26 @@ void check(char *dev)
     }
     /* FIXME -- what is the type of fileblk here? */
     flush(&dfile,&fileblk);
+    inoflush();
 
   }	/* if fast check, skip to phase 5 */
   printf("%c %s** Phase 5 - Check Free List ",id,devname);
+  setphase(PH5);
   if(sflag || (csflag && rplyflag == 0)) {
     printf("(Ignored)\n");
     fixfree = 1;
   }
   else {
     printf("\n");
-    if(freemap)
-      copy(blkmap,freemap,(MEMSIZE)bmapsz);
-    else {
-      for(blk = 0; blk < fmapblk; blk++) {
-        bp1 = getblk(NULL,blk);
-        bp2 = getblk(NULL,blk+fmapblk);
-        copy(bp1->b_un.b_buf,bp2->b_un.b_buf,S4_BSIZE);
-        dirty(bp2);
-      }
-    }
+    copy(blkmap,freemap,(MEMSIZE)bmapsz);
     badblk = dupblk = 0;
     freeblk.df_nfree = superblk.s_nfree;
     bsetmem(&fileblk, s4b_free);
     for(n = 0; n < S4_NICFREE; n++)
       freeblk.df_free[n] = superblk.s_free[n];
     freechk();
+    fr->r_fbad = badblk;
+    fr->r_fdup = dupblk;
     if(badblk)
       printf("%c %s%d BAD BLKS IN FREE LIST\n",id,devname,badblk);
     if(dupblk)
@@ -741,8 +821,8 @@ void check(char *dev)
 
     if(fixfree == 0) {
       if((n_blks+n_free) != (f_max-f_min)) {
-        printf("%c %s%ld BLK(S) MISSING\n",id,devname,
-               (long)f_max-f_min-n_blks-n_free);
+        fr->r_missing = (long)f_max-f_min-n_blks-n_free;
+        printf("%c %s%ld BLK(S) MISSING\n",id,devname,fr->r_missing);
         fixfree = 1;
       }
       else if(n_free != superblk.s_tfree) {
@@ -750,6 +830,7 @@ void check(char *dev)
         if(qflag) {
           superblk.s_tfree = n_free;
           sbdirty();
+          qfixed();
           printf("\n%c %sFIXED\n",id,devname);
         }
         else if(reply("FIX") == YES) {
@@ -762,6 +843,7 @@ void check(char *dev)
       printf("%c %sBAD FREE LIST",id,devname);
       if(qflag && !sflag) {
         fixfree = 1;
+        qfixed();
         printf("\n%c %sSALVAGED\n",id,devname);
       }
       else if(reply("SALVAGE") == NO)
@@ -771,6 +853,7 @@ void check(char *dev)
 
   if(fixfree) {
     printf("%c %s** Phase 6 - Salvage Free List\n",id,devname);
+    setphase(PH6);
     makefree();
     n_free = superblk.s_tfree;
   }
@@ -779,13 +862,17 @@ void check(char *dev)
   flush(&dfile,&sblk);
 
 
+  setphase(-1);
+  fr->r_files = n_files;
 #if S4_FsTYPE==2
-  printf("%c %s%ld files %ld blocks %ld free\n",id,devname,
-         (long)n_files,(long)n_blks*2,(long)n_free*2);
+  fr->r_blks = (long)n_blks*2;
+  fr->r_free = (long)n_free*2;
 #else
-  printf("%c %s%ld files %ld blocks %ld free\n",id,devname,
-         n_files,n_blks,n_free);
+  fr->r_blks = n_blks;
+  fr->r_free = n_free;
 #endif
+  printf("%c %s%ld files %ld blocks %ld free\n",id,devname,
+         fr->r_files,fr->r_blks,fr->r_free);
 
   if(dfile.mod) {
     time_t t;       /* local time_t, not time32_t */
@@ -804,6 +891,408 @@ void check(char *dev)
 
   if(dfile.mod)
     printf("%c %s***** FILE SYSTEM WAS MODIFIED *****\n",id,devname);
+  fr->r_mod = dfile.mod;
+  fr->r_done = 1;
+}
+
+
+/* account the phase ending to it, and start ph, -1 for none */
+void setphase(int ph)
+{
+  double t = s4_now();
+
+  if(phase >= 0)
+    fr->r_secs[phase] += t - phaset;
+  if(ph >= 0)
+    fr->r_ran[ph] = 1;
+  phase = ph;
+  phaset = t;
+}
+
+
+/*
+ * Check the images jobs at a time, each in a forked worker with its
+ * own copy of everything above, so a fatal errexit ends only that
+ * image.  Workers fill their fsckres in shared memory and write to a
+ * log, which is shown whole as each finishes.
+ */
+int batch(char **imgs, int nimg)
+{
+  struct fsckres *res;
+  pid_t *pids, pid;
+  FILE **logs;
+  double *t0;
+  int i, n, st, next, running, bad;
+  char buf[S4_BSIZE];
+
+  res = mmap(NULL,(MEMSIZE)nimg*sizeof(*res),PROT_READ|PROT_WRITE,
+             MAP_SHARED|MAP_ANONYMOUS,-1,0);
+  if(res == MAP_FAILED ||
+     (pids = calloc(nimg,sizeof(*pids))) == NULL ||
+     (logs = calloc(nimg,sizeof(*logs))) == NULL ||
+     (t0 = calloc(nimg,sizeof(*t0))) == NULL)
+    errexit1("%c Can't get memory\n",id);
+
+  next = running = bad = 0;
+  while(next < nimg || running) {
+    if(next < nimg && running < jobs) {
+      i = next++;
+      if((logs[i] = tmpfile()) == NULL)
+        errexit1("%c Can't make a log file\n",id);
+      t0[i] = s4_now();
+      if((pid = fork()) < 0)
+        errexit1("%c Can't fork\n",id);
+      if(pid == 0) {
+        dup2(fileno(logs[i]),1);
+        fr = &res[i];
+        exit(checkone(imgs[i]));
+      }
+      pids[i] = pid;
+      running++;
+      continue;
+    }
+    if((pid = wait(&st)) < 0)
+      break;
+    for(i = 0; i < nimg && pids[i] != pid; i++)
+      continue;
+    if(i == nimg)
+      continue;
+    running--;
+    res[i].r_total = s4_now() - t0[i];
+    res[i].r_exit = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+
+    rewind(logs[i]);
+    while((n = fread(buf,1,sizeof(buf),logs[i])) > 0)
+      fwrite(buf,1,n,jsonflag ? stderr : stdout);
+    fclose(logs[i]);
+    if(jsonflag)
+      jsonres(imgs[i],&res[i]);
+    else
+      textres(imgs[i],&res[i]);
+    if(respass(&res[i]) == NO)
+      bad++;
+  }
+  munmap(res,(MEMSIZE)nimg*sizeof(*res));
+  free(pids);
+  free(logs);
+  free(t0);
+  return(bad ? 8 : 0);
+}
+
+
+/* a batch worker's check of dev, returning its exit status */
+int checkone(char *dev)
+{
+  initbarea(&sblk);
+  if(checksb(dev) == NO)
+    return(8);
+  if(othertype()) {
+#if S4_FsTYPE==2
+    printf("%c %s is for s4fsck1b\n",id,dev);
+#else
+    printf("%c %s is for s4fsck\n",id,dev);
+#endif
+    ckfini();
+    return(8);
+  }
+  initmem();
+  check(dev);
+  fr->r_io = iostats;
+  if(statsflag)
+    s4_stats_show(&iostats);
+  return(fr->r_done ? 0 : 8);
+}
+
+
+/* checked to the end, with every problem found repaired */
+int respass(struct fsckres *r)
+{
+  int n;
+
+  if(r->r_exit || !r->r_done)
+    return(NO);
+  for(n = 0; n < NPHASE; n++)
+    if(r->r_fixed[n] < r->r_found[n])
+      return(NO);
+  return(YES);
+}
+
+
+const char *resstatus(struct fsckres *r)
+{
+  if(r->r_exit || !r->r_done)
+    return("error");
+  if(respass(r) == NO)
+    return("unfixed");
+  return(r->r_mod ? "fixed" : "clean");
+}
+
+
+static const char *phname[NPHASE] = { "1", "1b", "2", "3", "4", "5", "6" };
+
+void textres(char *img, struct fsckres *r)
+{
+  long found, fixed;
+  int n;
+
+  found = fixed = 0;
+  for(n = 0; n < NPHASE; n++) {
+    found += r->r_found[n];
+    fixed += r->r_fixed[n];
+  }
+  printf("%c %s: %s, %ld found %ld fixed, %.3f secs\n",id,img,
+         resstatus(r),found,fixed,r->r_total);
+}
+
+
+/* one line per image */
+void jsonres(char *img, struct fsckres *r)
+{
+  long found, fixed;
+  int n, sep;
+
+  found = fixed = 0;
+  for(n = 0; n < NPHASE; n++) {
+    found += r->r_found[n];
+    fixed += r->r_fixed[n];
+  }
+  printf("{\"image\":");
+  jsonstr(img);
+  printf(",\"status\":\"%s\",\"pass\":%s,\"exit\":%d,\"modified\":%s",
+         resstatus(r),respass(r) ? "true" : "false",r->r_exit,
+         r->r_mod ? "true" : "false");
+  printf(",\"files\":%ld,\"blocks\":%ld,\"free\":%ld",
+         r->r_files,r->r_blks,r->r_free);
+  printf(",\"bad\":%ld,\"dup\":%ld,\"freebad\":%ld,\"freedup\":%ld"
+         ",\"missing\":%ld",r->r_bad,r->r_dup,r->r_fbad,r->r_fdup,
+         r->r_missing);
+  printf(",\"found\":%ld,\"fixed\":%ld,\"secs\":%.6f",
+         found,fixed,r->r_total);
+  printf(",\"rbytes\":%lld,\"wbytes\":%lld",r->r_io.rbytes,r->r_io.wbytes);
+  printf(",\"phases\":[");
+  for(sep = 0, n = 0; n < NPHASE; n++) {
+    if(!r->r_ran[n])
+      continue;
+    printf("%s{\"phase\":\"%s\",\"found\":%ld,\"fixed\":%ld,\"secs\":%.6f}",
+           sep++ ? "," : "",phname[n],r->r_found[n],r->r_fixed[n],
+           r->r_secs[n]);
+  }
+  printf("]}\n");
+}
+
+
+/* s as a JSON string */
+void jsonstr(char *s)
+{
+  putchar('"');
+  for(; *s; s++) {
+    if(*s == '"' || *s == '\\')
+      printf("\\%c",*s);
+    else if((unsigned char)*s < ' ')
+      printf("\\u%04x",(unsigned char)*s);
+    else
+      putchar(*s);
+  }
+  putchar('"');
+}
+
+
+/* note a block of the inode being scanned */
+static void scanadd(struct scanrng *sr, s4_daddr blk)
+{
+  s4_daddr *p;
+
+  if(sr->nblk == sr->ablk) {
+    sr->ablk = sr->ablk ? sr->ablk * 2 : 4096;
+    if((p = realloc(sr->blks,sr->ablk*sizeof(*p))) == NULL) {
+      sr->nomem++;
+      sr->ablk = sr->nblk;
+      return;
+    }
+    sr->blks = p;
+  }
+  sr->blks[sr->nblk++] = blk;
+}
+
+
+/* blk, an indirect block at ilevel, and what is under it, as iblock() */
+static void scanind(struct scanrng *sr, s4_daddr blk, int ilevel)
+{
+  register s4_daddr *ap;
+  s4_fsu fsu;
+
+  scanadd(sr,blk);
+  if(outrange(blk))
+    return;
+  s4_stats_io(&sr->st,0,S4_BSIZE);
+  if(pread(dfile.rfdes,fsu.buf,S4_BSIZE,(off_t)blk<<S4_BSHIFT) != S4_BSIZE) {
+    scanadd(sr,-blk);
+    return;
+  }
+  if(doswap)
+    s4_stats_swap(&sr->st,&fsu,s4b_idx);
+
+  ilevel--;
+  for(ap = fsu.indir; ap < &fsu.indir[S4_NINDIR]; ap++) {
+    if(*ap) {
+      if(ilevel > 0)
+        scanind(sr,*ap,ilevel);
+      else
+        scanadd(sr,*ap);
+    }
+  }
+}
+
+
+/* a thread: read the inodes of a range, then note their blocks */
+static void *scanrange(void *arg)
+{
+  struct scanrng *sr = arg;
+  struct scan *sc = sr->sc;
+  register DINODE *dp;
+  register s4_daddr *ap;
+  s4_daddr iaddrs[S4_NADDR];
+  s4_daddr iblk, lblk;
+  char *buf;
+  unsigned n, i;
+  s4_ino ino;
+  int lvl;
+
+  /* whole inode blocks, MAXRAW at a time */
+  if((buf = malloc((MEMSIZE)MAXRAW*S4_BSIZE)) == NULL) {
+    sr->nomem++;
+    return(NULL);
+  }
+  lblk = itod(sr->hi - 1);
+  for(iblk = itod(sr->lo); iblk <= lblk; iblk += n) {
+    n = minsz(lblk - iblk + 1, MAXRAW);
+    s4_stats_io(&sr->st,0,(MEMSIZE)n*S4_BSIZE);
+    if(pread(dfile.rfdes,buf,(MEMSIZE)n*S4_BSIZE,(off_t)iblk<<S4_BSHIFT) !=
+       (ssize_t)n*S4_BSIZE) {
+      /* find the bad ones */
+      for(i = 0; i < n; i++) {
+        s4_stats_io(&sr->st,0,S4_BSIZE);
+        if(pread(dfile.rfdes,buf+i*S4_BSIZE,S4_BSIZE,
+                 (off_t)(iblk+i)<<S4_BSHIFT) != S4_BSIZE)
+          for(ino = (iblk+i-2)*S4_INOPB+1;
+              ino <= (iblk+i-1)*S4_INOPB; ino++)
+            sc->unread[ino] = 1;
+      }
+    }
+    for(i = 0; i < n; i++) {
+      if(doswap)
+        s4_stats_swap(&sr->st,(s4_fsu *)(buf+i*S4_BSIZE),s4b_ino);
+      copy(buf+i*S4_BSIZE,&sc->inos[(iblk+i-2)*S4_INOPB+1],S4_BSIZE);
+    }
+  }
+  free(buf);
+
+  /* then the blocks of each, as ckinode() visits them for pass1() */
+  for(ino = sr->lo; ino < sr->hi; ino++) {
+    sr->first[ino - sr->lo] = sr->nblk;
+    dp = &sc->inos[ino];
+    if(sc->unread[ino] || !ALLOC || ftypeok(dp) == NO || SPECIAL)
+      continue;
+    if(doswap)
+      s4l3tolr(iaddrs,dp->di_addr,S4_NADDR);
+    else
+      s4l3tol(iaddrs,dp->di_addr,S4_NADDR);
+    for(ap = iaddrs; ap < &iaddrs[S4_NADDR-3]; ap++)
+      if(*ap)
+        scanadd(sr,*ap);
+    for(lvl = 1; lvl < 4; lvl++, ap++)
+      if(*ap)
+        scanind(sr,*ap,lvl);
+  }
+  sr->first[sr->hi - sr->lo] = sr->nblk;
+  return(NULL);
+}
+
+
+/* scan the i-list for Phase 1, in threads when there is enough */
+void scan1(struct scan *sc)
+{
+  pthread_t tids[MAXSCAN];
+  struct scanrng *sr;
+  s4_daddr nib, per;
+  long ncpu;
+  int i;
+
+  memset(sc,0,sizeof(*sc));
+  if((sc->inos = malloc((MEMSIZE)(imax+S4_INOPB+1)*sizeof(DINODE))) == NULL ||
+     (sc->unread = calloc(imax+S4_INOPB+1,1)) == NULL)
+    errexit2("%c %sCan't get memory\n",id,devname);
+
+  /* ranges of whole inode blocks */
+  nib = f_min - (S4_SUPERB+1);
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  sc->nrng = minsz(ncpu, MAXSCAN);
+  if(sc->nrng > nib / SCANBLKS)
+    sc->nrng = nib / SCANBLKS;
+  if(sc->nrng < 1)
+    sc->nrng = 1;
+  per = howmany(nib,sc->nrng);
+  for(i = 0; i < sc->nrng; i++) {
+    sr = &sc->rng[i];
+    sr->sc = sc;
+    sr->lo = (s4_ino)(i*per)*S4_INOPB + 1;
+    sr->hi = (s4_ino)minsz((i+1)*per,nib)*S4_INOPB + 1;
+    s4_stats_init(&sr->st);
+    if((sr->first = calloc(sr->hi - sr->lo + 1,sizeof(long))) == NULL)
+      errexit2("%c %sCan't get memory\n",id,devname);
+  }
+
+  for(i = 0; i < sc->nrng; i++)
+    if(i == sc->nrng - 1 ||
+       pthread_create(&tids[i],NULL,scanrange,&sc->rng[i]) != 0) {
+      scanrange(&sc->rng[i]);
+      tids[i] = 0;
+    }
+  for(i = 0; i < sc->nrng; i++) {
+    if(tids[i])
+      pthread_join(tids[i],NULL);
+    if(sc->rng[i].nomem)
+      errexit2("%c %sCan't get memory\n",id,devname);
+    s4_stats_add(&iostats,&sc->rng[i].st);
+  }
+  if(dbgflag)
+    printf("Phase 1 scanned by %d threads\n",sc->nrng);
+}
+
+
+void scan1free(struct scan *sc)
+{
+  int i;
+
+  for(i = 0; i < sc->nrng; i++) {
+    free(sc->rng[i].blks);
+    free(sc->rng[i].first);
+  }
+  free(sc->inos);
+  free(sc->unread);
+}
+
+
+/* ckinode(dp,ADDR) for inum, from the scan */
+int ckinode1(struct scan *sc)
+{
+  struct scanrng *sr;
+  s4_daddr *ap, *end;
+  int ret;
+
+  for(sr = sc->rng; inum >= sr->hi; sr++)
+    continue;
+  ap = &sr->blks[sr->first[inum - sr->lo]];
+  end = &sr->blks[sr->first[inum - sr->lo + 1]];
+  for( ; ap < end; ap++) {
+    if(*ap < 0) {
+      rwerr("READ",-*ap);
+      continue;
+    }
+    if((ret = pass1(*ap,0)) & STOP)
+      return(ret);
+  }
+  return(KEEPON);
 }
 
 
@@ -862,8 +1351,8 @@ int iblock( s4_daddr blk, int ilevel, int flg)
   register s4_daddr *ap;
   register int n;
   visitblk  bfunc = nobfunc;
-
-  BUFAREA ib;
+  BUFAREA  *ib;
+  s4_daddr  ind[S4_NINDIR];
 
   if(flg == BBLK) {
     bfunc = chkblk;
@@ -879,16 +1368,17 @@ int iblock( s4_daddr blk, int ilevel, int flg)
   if(outrange(blk))		/* protect thyself */
       return(SKIP);
 
-  initbarea(&ib);
-  if(getblk(&ib,blk) == NULL)
+  /* from the cache; copied, going deeper may reuse the buffer */
+  if((ib = getblk(NULL,blk)) == NULL)
     return(SKIP);
 
   /* do we know it is an index? */
-  bset(&ib,s4b_idx);
+  bset(ib,s4b_idx);
+  copy(ib->b_un.b_indir,ind,sizeof(ind));
 
   /* now, for all the blocks in the indir, go deeper */
   ilevel--;
-  for(ap = ib.b_un.b_indir; ap < &ib.b_un.b_indir[S4_NINDIR]; ap++) {
+  for(ap = ind; ap < &ind[S4_NINDIR]; ap++) {
     if(*ap) {
       if(ilevel > 0) 
         n = iblock(*ap,ilevel,flg); /* recurse */
@@ -978,10 +1468,11 @@ int chkblk(int blk, int flg)
 
 int pass1(s4_daddr blk, int flg)
 {
-  register s4_daddr *dlp;
+  register struct hent *hp;
 
   if(outrange(blk)) {
     blkerr("BAD",blk);
+    fr->r_bad++;
     if(++badblk >= MAXBAD) {
       printf("%c %sEXCESSIVE BAD BLKS I=%u",id,devname,inum);
       if(reply("CONTINUE") == NO)
@@ -992,27 +1483,17 @@ int pass1(s4_daddr blk, int flg)
   }
   if(getbmap(blk)) {
     blkerr("DUP",blk);
+    fr->r_dup++;
     if(++dupblk >= MAXDUP) {
       printf("%c %sEXCESSIVE DUP BLKS I=%u",id,devname,inum);
       if(reply("CONTINUE") == NO)
         errexit0("\n");
       return(STOP);
     }
-    if(enddup >= &duplist[DUPTBLSIZE]) {
-      printf("%c %sDUP TABLE OVERFLOW.",id,devname);
-      if(reply("CONTINUE") == NO)
-        errexit0("\n");
-      return(STOP);
-    }
-    for(dlp = duplist; dlp < muldup; dlp++) {
-      if(*dlp == blk) {
-        *enddup++ = blk;
-        break;
-      }
-    }
-    if(dlp >= muldup) {
-      *enddup++ = *muldup;
-      *muldup++ = blk;
+    /* the first claim is found again in Phase 1b */
+    if((hp = hfind(&dupset,blk,1))->cnt++ == 0) {
+      hfind(&dup1b,blk,1)->cnt = 1;
+      ndup1b++;
     }
   }
   else {
@@ -1026,17 +1507,14 @@ int pass1(s4_daddr blk, int flg)
 
 int pass1b(s4_daddr blk, int flg)
 {
-  register s4_daddr *dlp;
+  register struct hent *hp;
 
   if(outrange(blk))
     return(SKIP);
-  for(dlp = duplist; dlp < muldup; dlp++) {
-    if(*dlp == blk) {
-      blkerr("DUP",blk);
-      *dlp = *--muldup;
-      *muldup = blk;
-      return(muldup == duplist ? STOP : KEEPON);
-    }
+  if((hp = hfind(&dup1b,blk,0)) && hp->cnt) {
+    blkerr("DUP",blk);
+    hp->cnt = 0;
+    return(--ndup1b == 0 ? STOP : KEEPON);
   }
   return(KEEPON);
 }
@@ -1103,16 +1581,16 @@ int pass2(DIRECT *dirp, BUFAREA *bp)
 
 int pass4( s4_daddr blk, int flg )
 {
-  register s4_daddr *dlp;
+  register struct hent *hp;
 
   if(outrange(blk))
     return(SKIP);
   if(getbmap(blk)) {
-    for(dlp = duplist; dlp < enddup; dlp++)
-      if(*dlp == blk) {
-        *dlp = *--enddup;
-        return(KEEPON);
-      }
+    /* still claimed by another */
+    if((hp = hfind(&dupset,blk,0)) && hp->cnt) {
+      hp->cnt--;
+      return(KEEPON);
+    }
     clrbmap(blk);
     n_blks--;
   }
@@ -1136,7 +1614,7 @@ int pass5(s4_daddr blk, int flg )
   }
   if(getfmap(blk)) {
     fixfree = 1;
-    if(++dupblk >= DUPTBLSIZE) {
+    if(++dupblk >= MAXFREEDUP) {
       printf("%c %sEXCESSIVE DUP BLKS IN FREE LIST.",id,devname);
       if(reply("CONTINUE") == NO)
         errexit0("\n");
@@ -1443,15 +1921,11 @@ int chkempt(DINODE *dp )
 
 int setup( char *dev )
 {
-  register int n;
   register BUFAREA *bp;
-  register MEMSIZE msize;
-  char *mbase;
-  s4_daddr bcnt, nscrblk;
   s4_dev rootdev;
   extern s4_dev pipedev;	/* non-zero iff standard input is a pipe,
 				 * which means we can't check pipedev */
-  s4_off smapsz, lncntsz, totsz;
+  s4_off smapsz, lncntsz;
 
   struct stat statarea;
 
@@ -1482,7 +1956,7 @@ int setup( char *dev )
       }
   }
   else if((statarea.st_mode & S_IFMT) == S_IFCHR)
-    rawflg++;
+    ;				/* raw device */
   else if(ismounted(dev)) {	/* loop mounted */
     if(!nflag) {
       error3("%c %s%s is a mounted file system, ignored\n",
@@ -1504,14 +1978,16 @@ int setup( char *dev )
   fixfree = 0;
   dfile.mod = 0;
   n_files = n_blks = n_free = 0;
-  muldup = enddup = &duplist[0];
-  badlnp = &badlncnt[0];
+  hclear(&dupset);
+  hclear(&dup1b);
+  hclear(&lnset);
+  ndup1b = 0;
   lfdir = 0;
   rplyflag = 0;
+  memset(fr,0,sizeof(*fr));
+  phase = -1;
   initbarea(&fileblk);
   initbarea(&inoblk);
-  sfile.wfdes = sfile.rfdes = -1;
-  rmscr = 0;
   if(getblk(&sblk,S4_SUPERB) == NULL) {
     ckfini();
     return(NO);
@@ -1532,85 +2008,51 @@ int setup( char *dev )
   printf("%c %sFile System: %.6s Volume: %.6s\n\n",id,devname,
          superblk.s_fname,superblk.s_fpack);
 
+  /* the maps are small; they all stay in memory */
   smapsz = roundup(howmany((long)(imax+1),STATEPB),sizeof(*lncntp));
   lncntsz = (long)(imax+1) * sizeof(*lncntp);
-  if(bmapsz > smapsz+lncntsz)
-    smapsz = bmapsz-lncntsz;
-  totsz = bmapsz+smapsz+lncntsz;
-  msize = memsize;
-  mbase = membase;
-  if(rawflg) {
-    if(msize < (MEMSIZE)(NINOBLK*S4_BSIZE) + 2*sizeof(BUFAREA))
-      rawflg = 0;
-    else {
-      msize -= (MEMSIZE)NINOBLK*S4_BSIZE;
-      mbase += (MEMSIZE)NINOBLK*S4_BSIZE;
-      niblk = NINOBLK;
-      startib = f_max;
-    }
-  }
-  clear(mbase,msize);
-  if((s4_off)msize < totsz) {
-    bmapsz = roundup(bmapsz,S4_BSIZE);
-    smapsz = roundup(smapsz,S4_BSIZE);
-    lncntsz = roundup(lncntsz,S4_BSIZE);
-    nscrblk = (bmapsz+smapsz+lncntsz)>>S4_BSHIFT;
-    if(tflag == 0) {
-      printf("\n%c %sNEED SCRATCH FILE (%ld BLKS)\n",
-             id,devname,(long)nscrblk);
-      do {
-        printf("%c %sENTER FILENAME:\n",id,devname);
-        if((n = fsck_getline(stdin,scrfile,sizeof(scrfile))) == EOF)
-          errexit0("\n");
-      } while(n == 0);
-    }
-    if(stat(scrfile,&statarea) < 0 ||
-       (statarea.st_mode & S_IFMT) == S_IFREG)
-      rmscr++;
-    if((sfile.wfdes = creat(scrfile,0666)) < 0 ||
-       (sfile.rfdes = open(scrfile,0)) < 0) {
-      error3("%c %sCan't create %s\n",id,devname,scrfile);
-      ckfini();
-      return(NO);
-    }
-    bp = &((BUFAREA *)mbase)[(msize/sizeof(BUFAREA))];
-    poolhead = NULL;
-    while(--bp >= (BUFAREA *)mbase) {
-      initbarea(bp);
-      bp->b_next = poolhead;
-      poolhead = bp;
-    }
-    bp = poolhead;
-    for(bcnt = 0; bcnt < nscrblk; bcnt++) {
-      bp->b_bno = bcnt;
-      dirty(bp);
-      flush(&sfile,bp);
-    }
-    blkmap = freemap = statemap = (char *) NULL;
-    lncntp = (short *) NULL;
-    smapblk = bmapsz / S4_BSIZE;
-    lncntblk = smapblk + smapsz / S4_BSIZE;
-    fmapblk = smapblk;
-  }
-  else {
-    if(rawflg && (s4_off)msize > totsz+S4_BSIZE) {
-      niblk += (unsigned)((s4_off)msize-totsz)>>S4_BSHIFT;
-#if S4_FsTYPE==2
-      if(niblk > MAXRAW / 2)
-        niblk = MAXRAW / 2;
-#else
-      if(niblk > MAXRAW)
-        niblk = MAXRAW;
-#endif
-      msize = memsize - (niblk*S4_BSIZE);
-      mbase = membase + (niblk*S4_BSIZE);
-    }
-    poolhead = NULL;
-    blkmap = mbase;
-    statemap = &mbase[(MEMSIZE)bmapsz];
-    freemap = statemap;
-    lncntp = (short *)&statemap[(MEMSIZE)smapsz];
-  }
+  if((blkmap = calloc(1,bmapsz)) == NULL ||
+     (freemap = calloc(1,bmapsz)) == NULL ||
+     (statemap = calloc(1,smapsz)) == NULL ||
+     (lncntp = calloc(1,lncntsz)) == NULL)
+    errexit2("%c %sCan't get memory\n",id,devname);
+
+  /* room for every indirect block the data area could need, within
+     the -m budget */
+  nbuf = 2 * howmany(f_max - f_min,S4_NINDIR) + MINBUF;
+  if(membudget && nbuf > membudget / sizeof(BUFAREA))
+    nbuf = membudget / sizeof(BUFAREA);
+  if(nbuf < MINBUF)
+    nbuf = MINBUF;
+  for(nhash = 1; nhash < nbuf; nhash <<= 1)
+    continue;
+  if((bufpool = calloc(nbuf,sizeof(BUFAREA))) == NULL ||
+     (bufhash = calloc(nhash,sizeof(BUFAREA *))) == NULL)
+    errexit2("%c %sCan't get memory\n",id,devname);
+  poolhead = pooltail = NULL;
+  for(bp = &bufpool[nbuf]; --bp >= bufpool; ) {
+    initbarea(bp);
+    bp->b_prev = NULL;
+    bp->b_next = poolhead;
+    if(poolhead)
+      poolhead->b_prev = bp;
+    else
+      pooltail = bp;
+    poolhead = bp;
+  }
+
+  /* inode blocks are read in bulk from anything: the whole i-list
+     when it fits in half the -m budget, else as much as does */
+  niblk = f_min - (S4_SUPERB+1);
+  if(membudget && niblk > membudget / 2 / S4_BSIZE)
+    niblk = membudget / 2 / S4_BSIZE;
+  if(niblk < NINOBLK)
+    niblk = minsz(NINOBLK,f_min - (S4_SUPERB+1));
+  startib = f_max;
+  ninwin = 0;
+  if((membase = malloc((MEMSIZE)niblk*S4_BSIZE)) != NULL &&
+     (ibdirty = calloc(niblk,1)) != NULL)
+    rawflg++;
   return(YES);
 }
 
@@ -1639,28 +2081,86 @@ int checksb(char *dev)
   return(YES);
 }
 
+/* the inode of the last ginode() is changed */
+void markino(void)
+{
+  if(!rawflg)
+    inoblk.b_dirty = 1;
+  else if(ninwin)
+    ibdirty[curib] = 1;
+}
+
+
+/* write back the changed blocks of the bulk inode blocks */
+void inoflush(void)
+{
+  register unsigned i, j, k;
+  char *mbase = membase;
+
+  if(!rawflg)
+    return;
+  for(i = 0; i < ninwin; i = j) {
+    for(j = i; j < ninwin && ibdirty[j]; j++)
+      ibdirty[j] = 0;
+    if(j == i) {
+      j++;
+      continue;
+    }
+    if(doswap)
+      for(k = i; k < j; k++)
+        s4_stats_swap(&iostats,(s4_fsu *)&mbase[k<<S4_BSHIFT],s4b_ino);
+    bwrite(&dfile,&mbase[i<<S4_BSHIFT],startib+i,(MEMSIZE)(j-i)*S4_BSIZE);
+    if(doswap)
+      for(k = i; k < j; k++)
+        s4_stats_swap(&iostats,(s4_fsu *)&mbase[k<<S4_BSHIFT],s4b_ino);
+  }
+  inoblk.b_dirty = 0;
+}
+
+
+/* inode repairs made so far reach the disk before an errexit, as the
+   directory and free list writes of the same repairs already have */
+void errfini(void)
+{
+  static char busy;		/* a failed write can errexit again */
+
+  if(busy++ == 0)
+    inoflush();
+}
+
+
 DINODE *ginode(void)
 {
   register DINODE *dp;
   register char *mbase;
   register s4_daddr iblk;
+  unsigned n;
 
   if(inum > imax)
     return(NULL);
   iblk = itod(inum);
   if(rawflg) {
     mbase = membase;
-    if(iblk < startib || iblk >= startib+niblk) {
-      if(inoblk.b_dirty)
-        bwrite(&dfile,mbase,startib,niblk*S4_BSIZE);
-      inoblk.b_dirty = 0;
-      if(bread(&dfile,mbase,iblk,niblk*S4_BSIZE) == NO) {
+    if(iblk < startib || iblk >= startib+ninwin) {
+      inoflush();
+      /* as much as fits from iblk, within the i-list */
+      startib = f_min - niblk;
+      if(startib > iblk)
+        startib = iblk;
+      if(startib < S4_SUPERB+1)
+        startib = S4_SUPERB+1;
+      ninwin = minsz(niblk,f_min - startib);
+      if(bread(&dfile,mbase,startib,(MEMSIZE)ninwin*S4_BSIZE) == NO) {
         startib = f_max;
+        ninwin = 0;
         return(NULL);
       }
-      startib = iblk;
+      if(doswap)
+        for(n = 0; n < ninwin; n++)
+          s4_stats_swap(&iostats,(s4_fsu *)&mbase[n<<S4_BSHIFT],s4b_ino);
     }
-    dp = (DINODE *)&mbase[(unsigned)((iblk-startib)<<S4_BSHIFT)];
+    curib = iblk - startib;
+    dp = (DINODE *)&mbase[(unsigned)(curib<<S4_BSHIFT)];
   }
   else if(getblk(&inoblk,iblk) != NULL)
     {
@@ -1678,6 +2178,8 @@ int reply( char *s )
 
   rplyflag = 1;
   line[0] = '\0';
+  if(phase >= 0 && strcmp(s,"CONTINUE"))
+    fr->r_found[phase]++;
   printf("\n%c %s%s? ",id,devname,s);
   if(nflag || dfile.wfdes < 0) {
     printf(" no\n\n");
@@ -1685,14 +2187,14 @@ int reply( char *s )
   }
   if(yflag) {
     printf(" yes\n\n");
-    return(YES);
+    return(replyes(s));
   }
   while (line[0] == '\0') {
     if(fsck_getline(stdin,line,sizeof(line)) == EOF)
       errexit0("\n");
     printf("\n");
     if(line[0] == 'y' || line[0] == 'Y')
-      return(YES);
+      return(replyes(s));
     if(line[0] == 'n' || line[0] == 'N')
       return(NO);
     printf("%c %sAnswer 'y' or 'n' (yes or no)\n",id,devname);
@@ -1702,6 +2204,15 @@ int reply( char *s )
 }
 
 
+/* a yes to s; a repair unless it only goes on */
+int replyes(char *s)
+{
+  if(phase >= 0 && strcmp(s,"CONTINUE"))
+    fr->r_fixed[phase]++;
+  return(YES);
+}
+
+
 int fsck_getline(FILE *fp, char *loc, int maxlen)
 {
   register int n;
@@ -1768,26 +2279,14 @@ int dostate(int statebit, int noset )
 {
   register char *p;
   register unsigned byte, shift;
-  BUFAREA *bp;
 
   byte = ((unsigned)inum)/STATEPB;
   shift = LSTATE * (((unsigned)inum)%STATEPB);
-  if(statemap != NULL) {
-    bp = NULL;
-    p = &statemap[byte];
-  }
-  else if((bp = getblk(NULL,smapblk+(byte/S4_BSIZE))) == NULL) {
-    errexit2("%c %sFatal I/O error\n",id,devname);
-  }
-  else {
-    p = &bp->b_un.b_buf[byte%S4_BSIZE];
-  }
+  p = &statemap[byte];
   switch(noset) {
   case 0:
     *p &= ~(SMASK<<(shift));
     *p |= statebit<<(shift);
-    if(bp != NULL)
-      dirty(bp);
     return(statebit);
   case 1:
     return((*p>>(shift)) & SMASK);
@@ -1800,31 +2299,12 @@ int domap(s4_daddr blk, int flg)
 {
   register char *p;
   register unsigned n;
-  register BUFAREA *bp;
   s4_off byte;
 
   byte = blk >> BITSHIFT;
   n = 1<<((unsigned)(blk & BITMASK));
-  if(flg & 04) {
-    p = freemap;
-    blk = fmapblk;
-  }
-  else {
-    p = blkmap;
-    blk = 0;
-  }
-  if(p != NULL) {
-    bp = NULL;
-    p += (unsigned)byte;
-  }
-  else if((bp = getblk(NULL,blk+(byte>>S4_BSHIFT))) == NULL) {
-    errexit2("%c %sFatal I/O error\n",id,devname);
-  }
-  else {
-    p = &bp->b_un.b_buf[(unsigned)(byte&S4_BMASK)];
-  /*	saven = n;
-	savep = p;*/
-  }
+  p = (flg & 04) ? freemap : blkmap;
+  p += (unsigned)byte;
 
   switch(flg&03) {
   case 0: /* set */
@@ -1832,13 +2312,10 @@ int domap(s4_daddr blk, int flg)
     break;
   case 1: /* get */
     n &= *p;
-    bp = NULL;
     break;
   case 2: /* clear */
     *p &= ~n;
   }
-  if(bp != NULL)
-    dirty(bp);
   return(n);
 }
 
@@ -1846,31 +2323,15 @@ int domap(s4_daddr blk, int flg)
 int dolncnt(short val,int flg)
 {
   register short *sp;
-  register BUFAREA *bp;
 
-  if(lncntp != NULL) {
-    bp = NULL;
-    sp = &lncntp[(unsigned)inum];
-  }
-  else if((bp = getblk(NULL,lncntblk+((unsigned)inum/SPERB))) == NULL) {
-    errexit2("%c %sFatal I/O error\n",id,devname);
-  }
-  else {
-      bset(bp,s4b_linkcnt);
-      sp = &bp->b_un.b_lnks[(unsigned)inum%SPERB];
-  }
+  sp = &lncntp[(unsigned)inum];
   switch(flg) {
   case 0:
     *sp = val;
     break;
-  case 1:
-    bp = NULL;
-    break;
   case 2:
     (*sp)--;
   }
-  if(bp != NULL)
-    dirty(bp);
   return(*sp);
 }
 
@@ -1878,14 +2339,12 @@ int dolncnt(short val,int flg)
 BUFAREA *
 getblk( BUFAREA *bp, int blk )
 {
-  register struct filecntl *fcp;
+  register struct filecntl *fcp = &dfile;
+  int cached = (bp == NULL);
 
-  if(bp == NULL) {
+  /* NULL for a buffer from the cache */
+  if(cached)
     bp = search(blk);
-    fcp = &sfile;
-  }
-  else
-    fcp = &dfile;
 
   if(bp->b_bno == blk)
     {
@@ -1896,9 +2355,7 @@ getblk( BUFAREA *bp, int blk )
   if(blk == S4_SUPERB) {
     bset(bp,s4b_super);
     flush(fcp,bp);
-    if(lseek(fcp->rfdes,(long)S4_SUPERBOFF,0) < 0)
-      rwerr("SEEK",blk);
-    else if(read(fcp->rfdes,bp->b_un.b_buf,SBSIZE) == SBSIZE) {
+    if(pread(fcp->rfdes,bp->b_un.b_buf,SBSIZE,(off_t)S4_SUPERBOFF) == SBSIZE) {
       bp->b_bno = blk;
       btomem(bp);
       if(dbgflag) printf("getblk read blk %d\n", blk );      
@@ -1912,6 +2369,8 @@ getblk( BUFAREA *bp, int blk )
   if(bread(fcp,bp->b_un.b_buf,blk,S4_BSIZE) != NO) {
     bp->b_bno = blk;
     bp->b_swapped = NO;                  
+    if(cached)
+      bhash(bp);
     if(dbgflag) printf("getblk read blk %d\n", blk );      
     return(bp);
   }
@@ -1930,9 +2389,7 @@ void flush(struct filecntl *fcp, BUFAREA *bp )
         bp->b_dirty = 0;
         return;
       }
-      if(lseek(fcp->wfdes,(long)S4_SUPERBOFF,0) < 0)
-        rwerr("SEEK",bp->b_bno);
-      else if(write(fcp->wfdes,bp->b_un.b_buf,SBSIZE) == SBSIZE) {
+      if(pwrite(fcp->wfdes,bp->b_un.b_buf,SBSIZE,(off_t)S4_SUPERBOFF) == SBSIZE) {
         fcp->mod = 1;
         bp->b_dirty = 0;
         return;
@@ -1945,6 +2402,10 @@ void flush(struct filecntl *fcp, BUFAREA *bp )
     btodisk(bp);
     bwrite(fcp,bp->b_un.b_buf,bp->b_bno,S4_BSIZE);
     btomem(bp);
+
+    /* a cached copy is stale now */
+    if(!inpool(bp))
+      binval(bp->b_bno);
   }
   bp->b_dirty = 0;
 }
@@ -1985,20 +2446,13 @@ void ckfini(void)
 {
   flush(&dfile,&fileblk);
   flush(&dfile,&sblk);
+  inoflush();
   flush(&dfile,&inoblk);
   if( dfile.rfdes > 0 )
     close(dfile.rfdes);
   if( dfile.wfdes > 0 )
     close(dfile.wfdes);
-  if( sfile.rfdes > 0 )
-    close(sfile.rfdes);
-  if( sfile.wfdes > 0 )
-    close(sfile.wfdes);
-
-  if(rmscr) {
-    unlink(scrfile);
-  }
-
+  freemem();
 }
 
 
@@ -2133,26 +2587,160 @@ void makefree(void)
 
 
 
+/* unlink bp from the LRU list */
+static void bunlink(BUFAREA *bp)
+{
+  if(bp->b_prev)
+    bp->b_prev->b_next = bp->b_next;
+  else
+    poolhead = bp->b_next;
+  if(bp->b_next)
+    bp->b_next->b_prev = bp->b_prev;
+  else
+    pooltail = bp->b_prev;
+}
+
+
+/* take bp off its hash chain */
+static void bunhash(BUFAREA *bp)
+{
+  BUFAREA **hp;
+
+  if(bp->b_bno == (s4_daddr)-1)
+    return;
+  for(hp = &bufhash[HASHBLK(bp->b_bno)]; *hp; hp = &(*hp)->b_hnext)
+    if(*hp == bp) {
+      *hp = bp->b_hnext;
+      break;
+    }
+}
+
+
+/* The cache buffer for blk, most recently used now.  If it doesn't
+   have blk, it is the least recently used one, flushed and unhashed
+   for getblk() to read into and bhash(). */
 BUFAREA *
 search(s4_daddr blk)
 {
-  BUFAREA *pbp, *bp;
-
-  pbp = NULL;
+  BUFAREA *bp;
 
-  for(bp = (BUFAREA *) &poolhead; bp->b_next; ) {
-    pbp = bp;
-    bp = pbp->b_next;
+  for(bp = bufhash[HASHBLK(blk)]; bp; bp = bp->b_hnext)
     if(bp->b_bno == blk)
       break;
+  if(bp == NULL) {
+    bp = pooltail;
+    flush(&dfile,bp);
+    bunhash(bp);
+    initbarea(bp);
   }
-  pbp->b_next = bp->b_next;
+  bunlink(bp);
+  bp->b_prev = NULL;
   bp->b_next = poolhead;
+  if(poolhead)
+    poolhead->b_prev = bp;
+  else
+    pooltail = bp;
   poolhead = bp;
   return(bp);
 }
 
 
+/* enter a cache buffer under its block */
+void bhash(BUFAREA *bp)
+{
+  BUFAREA **hp = &bufhash[HASHBLK(bp->b_bno)];
+
+  bp->b_hnext = *hp;
+  *hp = bp;
+}
+
+
+/* forget any cached copy of blk */
+void binval(s4_daddr blk)
+{
+  BUFAREA *bp;
+
+  if(bufhash == NULL)
+    return;
+  for(bp = bufhash[HASHBLK(blk)]; bp; bp = bp->b_hnext)
+    if(bp->b_bno == blk) {
+      bunhash(bp);
+      initbarea(bp);
+      break;
+    }
+}
+
+
+/* The entry for key in hs, added with a count of 0 if add, or NULL.
+   Open addressing; the table doubles when half full. */
+struct hent *hfind(struct hset *hs, s4_daddr key, int add)
+{
+  register struct hent *hp = NULL;
+  struct hent *otab;
+  unsigned i, osize;
+
+  if(hs->size) {
+    for(i = ((uint32_t)key * 2654435761u) & (hs->size - 1);
+        (hp = &hs->tab[i])->key; i = (i + 1) & (hs->size - 1))
+      if(hp->key == key)
+        return(hp);
+  }
+  if(!add)
+    return(NULL);
+
+  if(2 * (hs->n + 1) > hs->size) {
+    otab = hs->tab;
+    osize = hs->size;
+    hs->size = osize ? osize * 2 : 1024;
+    if((hs->tab = calloc(hs->size,sizeof(*hs->tab))) == NULL)
+      errexit2("%c %sCan't get memory\n",id,devname);
+    hs->n = 0;
+    for(i = 0; i < osize; i++)
+      if(otab[i].key)
+        *hfind(hs,otab[i].key,1) = otab[i];
+    free(otab);
+    return(hfind(hs,key,1));
+  }
+  hp->key = key;
+  hp->cnt = 0;
+  hs->n++;
+  return(hp);
+}
+
+
+/* empty hs */
+void hclear(struct hset *hs)
+{
+  free(hs->tab);
+  hs->tab = NULL;
+  hs->size = hs->n = 0;
+}
+
+
+/* release the maps and the cache of the last filesystem */
+void freemem(void)
+{
+  BUFAREA *bp;
+
+  for(bp = bufpool; bp && bp < &bufpool[nbuf]; bp++)
+    flush(&dfile,bp);
+  free(bufpool);
+  free(bufhash);
+  free(membase);
+  free(ibdirty);
+  free(blkmap);
+  free(freemap);
+  free(statemap);
+  free(lncntp);
+  bufpool = poolhead = pooltail = NULL;
+  bufhash = NULL;
+  nbuf = nhash = 0;
+  membase = ibdirty = blkmap = freemap = statemap = NULL;
+  rawflg = 0;
+  lncntp = NULL;
+}
+
+
 int findino(DIRECT *dirp, BUFAREA *bp)
 {
   register char *p1, *p2;
@@ -2212,7 +2800,7 @@ int linkup(void)
   register DINODE *dp;
   register int lostdir;
   register s4_ino pdir;
-  register s4_ino *blp;
+  struct hent *hp;
   int n;
 
   if((dp = ginode()) == NULL)
@@ -2317,13 +2905,8 @@ int linkup(void)
     dp->di_nlink++;
     inodirty();
     setlncnt(getlncnt()+1);
-    if(lostdir) {
-      for(blp = badlncnt; blp < badlnp; blp++)
-        if(*blp == inum) {
-          *blp = 0L;
-          break;
-        }
-    }
+    if(lostdir && (hp = hfind(&lnset,inum,0)))
+      hp->cnt = 0;
   }
   if(lostdir) {
     dpfunc = chgdd;
@@ -2345,9 +2928,8 @@ int linkup(void)
 
 int bread(struct filecntl *fcp, char *buf, s4_daddr blk, MEMSIZE size)
 {
-  if(lseek(fcp->rfdes,blk<<S4_BSHIFT,0) < 0)
-    rwerr("SEEK",blk);
-  else if(read(fcp->rfdes,buf,size) == size)
+  s4_stats_io(&iostats,0,size);
+  if(pread(fcp->rfdes,buf,size,(off_t)blk<<S4_BSHIFT) == size)
     return(YES);
   rwerr("READ",blk);
   return(NO);
@@ -2358,9 +2940,8 @@ int bwrite(struct filecntl *fcp, char *buf, s4_daddr blk, MEMSIZE size)
 {
   if(fcp->wfdes < 0)
     return(NO);
-  if(lseek(fcp->wfdes,blk<<S4_BSHIFT,0) < 0)
-    rwerr("SEEK",blk);
-  else if(write(fcp->wfdes,buf,size) == size) {
+  s4_stats_io(&iostats,1,size);
+  if(pwrite(fcp->wfdes,buf,size,(off_t)blk<<S4_BSHIFT) == size) {
     fcp->mod = 1;
     return(YES);
   }
@@ -2410,7 +2991,7 @@ void btomem( struct bufarea *bp )
 {
   if( doswap && NO == bp->b_swapped )
     {
-      s4_fsu_swap( (s4_fsu*)bp->b_un.b_buf, bp->b_type );
+      s4_stats_swap( &iostats, (s4_fsu*)bp->b_un.b_buf, bp->b_type );
       bp->b_swapped = YES;
 
       if(dbgflag)
@@ -2429,7 +3010,7 @@ void btodisk( struct bufarea *bp )
       if(dbgflag)
         printf("to disk %p %s\n", bp, s4btypestr( bp->b_type ));
 
-      s4_fsu_swap( (s4_fsu*)bp->b_un.b_buf, bp->b_type );
+      s4_stats_swap( &iostats, (s4_fsu*)bp->b_un.b_buf, bp->b_type );
       bp->b_swapped = NO;
     }
 }
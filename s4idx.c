@@ -0,0 +1,477 @@
+/*
+ * s4idx.c -- the .s4idx sidecar index of a filesystem image, see s4d.h
+ *
+ * An index is built once from the filesystem and written next to
+ * the image as image.s4idx.  It is an s4_idxhdr followed by fixed
+ * width sections, each 8 byte aligned, in host byte order:
+ *
+ *   inodes    s4_idxino[ ninode + 1 ], by inode number
+ *   paths     s4_idxpath[ npath ], every name, sorted by path
+ *   owners    int32_t[ fsize ], inode owning each block, 0 for none
+ *   hashes    uint64_t[ fsize ], FNV-1a of each block
+ *   strings   the paths, NUL terminated
+ *
+ * It is used by mapping it.  The image's size and mtime are kept
+ * in the header; an index that doesn't match them, or has another
+ * magic, version or header size, is stale and should be rebuilt.
+ */
+
+#include <s4d.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+
+/* most FS blocks hashed per read */
+#define S4_IDX_CHUNK    256
+
+#define S4_IDX_ALIGN( n )   (((n) + 7) & ~(int64_t)7)
+
+
+/* the index file for image, malloc'd */
+static char *s4_idx_name( const char *image )
+{
+  char *name;
+
+  if( (name = malloc( strlen( image ) + sizeof(S4_IDX_SUFFIX) )) )
+    sprintf( name, "%s%s", image, S4_IDX_SUFFIX );
+  return name;
+}
+
+
+static uint64_t s4_idx_fnv( const unsigned char *p, int len )
+{
+  uint64_t h = 14695981039346656037ull;
+
+  while( len-- > 0 )
+    h = (h ^ *p++) * 1099511628211ull;
+  return h;
+}
+
+
+/* ---------------------------------------------------------------- */
+/* building */
+
+typedef struct
+{
+  s4_filsys   *fs;
+  s4_ilist     il;
+
+  s4_idxpath  *paths;
+  int          npath;
+  int          apath;
+
+  char        *strs;
+  int64_t      nstr;
+  int64_t      astr;
+
+} s4_idxcx;
+
+
+/* add path for ino; its index, or -1 */
+static int s4_idx_addpath( s4_idxcx *cx, const char *path, int ino )
+{
+  s4_idxpath *pp;
+  char       *sp;
+  size_t      n = strlen( path ) + 1;
+
+  if( cx->npath == cx->apath )
+    {
+      cx->apath = cx->apath ? cx->apath * 2 : 1024;
+      if( !(pp = realloc( cx->paths, cx->apath * sizeof(*pp) )) )
+        return -1;
+      cx->paths = pp;
+    }
+  while( cx->nstr + (int64_t)n > cx->astr )
+    {
+      cx->astr = cx->astr ? cx->astr * 2 : 65536;
+      if( !(sp = realloc( cx->strs, cx->astr )) )
+        return -1;
+      cx->strs = sp;
+    }
+
+  memcpy( cx->strs + cx->nstr, path, n );
+  cx->paths[ cx->npath ].ino  = ino;
+  cx->paths[ cx->npath ].name = cx->nstr;
+  cx->nstr += n;
+  return cx->npath++;
+}
+
+
+/* every name from the root down; directories are walked once */
+static s4err s4_idx_walk( s4_idxcx *cx )
+{
+  struct s4_direct de;
+  s4_dir           d;
+  char            *seen;
+  char             path[ 4096 ];
+  char             name[ S4_DIRSIZ + 1 ];
+  s4err            rv = s4_ok;
+  int              i, ino;
+
+  if( !(seen = calloc( cx->il.ninode + 1, 1 )) )
+    return s4_error;
+
+  seen[ S4_ROOTINO ] = 1;
+  if( s4_idx_addpath( cx, "/", S4_ROOTINO ) < 0 )
+    rv = s4_error;
+
+  /* paths grows as we go; dirs among them are walked in turn */
+  for( i = 0; s4_ok == rv && i < cx->npath; i++ )
+    {
+      ino = cx->paths[i].ino;
+      if( (cx->il.mode[ ino ] & S_IFMT) != S_IFDIR ||
+          (i && seen[ ino ] != 1) )
+        continue;
+      seen[ ino ] = 2;
+      if( s4_ok != s4_filsys_opendir( cx->fs, ino, &d ) )
+        continue;
+
+      while( s4_ok == rv && s4_ok == s4_filsys_readdir( &d, &de ) )
+        {
+          memcpy( name, de.d_name, S4_DIRSIZ );
+          name[ S4_DIRSIZ ] = 0;
+          if( !name[0] || !strcmp( name, "." ) || !strcmp( name, ".." ) ||
+              strchr( name, '/' ) || de.d_ino > cx->il.ninode ||
+              !cx->il.mode[ de.d_ino ] )
+            continue;
+
+          /* a directory's first name is the one walked */
+          if( (cx->il.mode[ de.d_ino ] & S_IFMT) == S_IFDIR )
+            {
+              if( seen[ de.d_ino ] )
+                continue;
+              seen[ de.d_ino ] = 1;
+            }
+
+          snprintf( path, sizeof(path), "%s%s%s",
+                    cx->strs + cx->paths[i].name, i ? "/" : "", name );
+          if( s4_idx_addpath( cx, path, de.d_ino ) < 0 )
+            rv = s4_error;
+        }
+    }
+
+  free( seen );
+  return rv;
+}
+
+
+static const char *s4_idx_sortstrs;
+
+static int s4_idx_pathcmp( const void *a, const void *b )
+{
+  const s4_idxpath *x = a, *y = b;
+
+  return strcmp( s4_idx_sortstrs + x->name, s4_idx_sortstrs + y->name );
+}
+
+
+static s4err s4_idx_hashes( s4_filsys *fs, uint64_t *hash )
+{
+  s4_daddr  fblk, fsize = fs->super.super.s_fsize;
+  s4err     rv = s4_ok;
+  char     *buf;
+  int       i, n;
+
+  if( !(buf = malloc( (size_t)S4_IDX_CHUNK * fs->bksz )) )
+    return s4_error;
+
+  for( fblk = 0; fblk < fsize; fblk += n )
+    {
+      n = fsize - fblk < S4_IDX_CHUNK ? fsize - fblk : S4_IDX_CHUNK;
+      if( s4_ok != (rv = s4_filsys_read_fblks( fs, fblk, n, buf )) )
+        break;
+      for( i = 0; i < n; i++ )
+        hash[ fblk + i ] = s4_idx_fnv( (unsigned char*)buf + i * fs->bksz,
+                                       fs->bksz );
+    }
+
+  free( buf );
+  return rv;
+}
+
+
+/* write section len bytes at *offp, moving it on */
+static s4err s4_idx_put( int fd, int64_t *offp, const void *p, int64_t len )
+{
+  s4err rv = s4_ok;
+
+  if( len > 0 )
+    rv = s4_pwrite( fd, *offp, (char*)p, len );
+  *offp = S4_IDX_ALIGN( *offp + len );
+  return rv;
+}
+
+
+s4err s4_filsys_idx_build( s4_filsys *fs, const char *image )
+{
+  s4_idxcx     cx;
+  s4_idxhdr    h;
+  s4_idxino   *inos = NULL;
+  s4_owners    ow;
+  int32_t     *nblks = NULL;
+  uint64_t    *hash = NULL;
+  struct stat  sb;
+  s4err        rv;
+  char        *name = NULL, *tmp = NULL;
+  int64_t      off;
+  int          i, fd = -1, fsize = fs->super.super.s_fsize;
+
+  if( stat( image, &sb ) < 0 )
+    {
+      printf("%s checking status of '%s'\n", strerror(errno), image );
+      return s4_open;
+    }
+
+  memset( &cx, 0, sizeof(cx) );
+  memset( &ow, 0, sizeof(ow) );
+  cx.fs = fs;
+  if( s4_ok != (rv = s4_filsys_ilist( fs, &cx.il )) )
+    return rv;
+
+  rv = s4_error;
+  if( !(inos  = calloc( cx.il.ninode + 1, sizeof(*inos) )) ||
+      !(nblks = calloc( cx.il.ninode + 1, sizeof(*nblks) )) ||
+      !(hash  = calloc( fsize, sizeof(*hash) )) ||
+      !(name  = s4_idx_name( image )) ||
+      !(tmp   = malloc( strlen( name ) + 8 )) )
+    goto out;
+  sprintf( tmp, "%s.tmp", name );
+
+  if( s4_ok != (rv = s4_idx_walk( &cx )) ||
+      s4_ok != (rv = s4_idx_hashes( fs, hash )) ||
+      s4_ok != (rv = s4_filsys_owners( fs, &cx.il, &ow )) )
+    goto out;
+  for( i = 0; i < fsize; i++ )
+    nblks[ ow.owner[i] ]++;
+
+  s4_idx_sortstrs = cx.strs;
+  qsort( cx.paths, cx.npath, sizeof(*cx.paths), s4_idx_pathcmp );
+
+  for( i = 1; i <= cx.il.ninode; i++ )
+    {
+      inos[i].mode  = cx.il.mode[i];
+      inos[i].nlink = cx.il.nlink[i];
+      inos[i].uid   = cx.il.uid[i];
+      inos[i].gid   = cx.il.gid[i];
+      inos[i].size  = cx.il.size[i];
+      inos[i].mtime = cx.il.mtime[i];
+      inos[i].nblks = nblks[i];
+      inos[i].path  = -1;
+    }
+  for( i = cx.npath; i-- > 0 ; )
+    inos[ cx.paths[i].ino ].path = i;
+
+  memset( &h, 0, sizeof(h) );
+  h.magic      = S4_IDX_MAGIC;
+  h.version    = S4_IDX_VERSION;
+  h.hdrsize    = sizeof(h);
+  h.bksz       = fs->bksz;
+  h.imgsize    = sb.st_size;
+  h.imgmtime   = sb.st_mtim.tv_sec;
+  h.imgmtimens = sb.st_mtim.tv_nsec;
+  h.partoff    = fs->part->partoff;
+  h.fsize      = fsize;
+  h.ninode     = cx.il.ninode;
+  h.npath      = cx.npath;
+
+  off       = S4_IDX_ALIGN( sizeof(h) );
+  h.inooff  = off;  off = S4_IDX_ALIGN( off + (h.ninode + 1) * sizeof(*inos) );
+  h.pathoff = off;  off = S4_IDX_ALIGN( off + h.npath * sizeof(*cx.paths) );
+  h.ownoff  = off;  off = S4_IDX_ALIGN( off + fsize * sizeof(*ow.owner) );
+  h.hashoff = off;  off = S4_IDX_ALIGN( off + fsize * sizeof(*hash) );
+  h.stroff  = off;
+  h.strlen  = cx.nstr;
+
+  /* a whole new file, or the old one stays */
+  if( (fd = creat( tmp, 0644 )) < 0 )
+    {
+      printf("Can't create '%s': %s\n", tmp, strerror(errno) );
+      rv = s4_open;
+      goto out;
+    }
+  off = 0;
+  if( s4_ok != (rv = s4_idx_put( fd, &off, &h, sizeof(h) )) ||
+      s4_ok != (rv = s4_idx_put( fd, &off, inos,
+                                 (h.ninode + 1) * sizeof(*inos) )) ||
+      s4_ok != (rv = s4_idx_put( fd, &off, cx.paths,
+                                 h.npath * sizeof(*cx.paths) )) ||
+      s4_ok != (rv = s4_idx_put( fd, &off, ow.owner,
+                                 fsize * sizeof(*ow.owner) )) ||
+      s4_ok != (rv = s4_idx_put( fd, &off, hash, fsize * sizeof(*hash) )) ||
+      s4_ok != (rv = s4_idx_put( fd, &off, cx.strs, cx.nstr )) )
+    goto out;
+
+  if( close( fd ) < 0 || rename( tmp, name ) < 0 )
+    {
+      printf("Can't write '%s': %s\n", name, strerror(errno) );
+      rv = s4_write;
+    }
+  fd = -1;
+
+ out:
+  if( fd >= 0 )
+    close( fd );
+  if( s4_ok != rv && tmp )
+    unlink( tmp );
+  free( name );
+  free( tmp );
+  free( inos );
+  free( nblks );
+  s4_owners_free( &ow );
+  free( hash );
+  free( cx.paths );
+  free( cx.strs );
+  s4_ilist_free( &cx.il );
+  return rv;
+}
+
+
+/* ---------------------------------------------------------------- */
+/* using */
+
+
+/* n of size sz at an aligned off lie past the header, inside the
+   mapping */
+static int s4_idx_fits( const s4_idx *ix, int64_t off, int64_t n, size_t sz )
+{
+  return off >= (int64_t)sizeof(s4_idxhdr) && off <= (int64_t)ix->len &&
+    off % sizeof(int64_t) == 0 &&
+    n >= 0 && n <= ((int64_t)ix->len - off) / (int64_t)sz;
+}
+
+/* point ix at the tables if every one lies in the mapping, every index
+   in them inside its table, and the strings end; a truncated or damaged
+   index is treated as stale */
+static int s4_idx_sane( s4_idx *ix )
+{
+  const s4_idxhdr *h = ix->hdr;
+  int              i;
+
+  if( h->ninode < 0 || h->npath < 0 || h->fsize < 0 ||
+      !s4_idx_fits( ix, h->inooff, (int64_t)h->ninode + 1,
+                    sizeof(s4_idxino) ) ||
+      !s4_idx_fits( ix, h->pathoff, h->npath, sizeof(s4_idxpath) ) ||
+      !s4_idx_fits( ix, h->ownoff, h->fsize, sizeof(int32_t) ) ||
+      !s4_idx_fits( ix, h->hashoff, h->fsize, sizeof(uint64_t) ) ||
+      !s4_idx_fits( ix, h->stroff, h->strlen, 1 ) )
+    return 0;
+
+  ix->ino   = (const s4_idxino *)(ix->map + h->inooff);
+  ix->path  = (const s4_idxpath *)(ix->map + h->pathoff);
+  ix->owner = (const int32_t *)(ix->map + h->ownoff);
+  ix->hash  = (const uint64_t *)(ix->map + h->hashoff);
+  ix->str   = ix->map + h->stroff;
+  if( h->strlen && ix->str[ h->strlen - 1 ] )
+    return 0;
+
+  for( i = 0; i <= h->ninode; i++ )
+    if( ix->ino[ i ].path < -1 || ix->ino[ i ].path >= h->npath )
+      return 0;
+  for( i = 0; i < h->npath; i++ )
+    if( ix->path[ i ].name >= h->strlen ||
+        ix->path[ i ].ino < 0 || ix->path[ i ].ino > h->ninode )
+      return 0;
+  return 1;
+}
+
+
+s4err s4_idx_open( const char *image, s4_filsys *fs, s4_idx *ix )
+{
+  const s4_idxhdr *h;
+  struct stat      sb, isb;
+  s4err            rv = s4_range;
+  char            *name;
+  int              fd;
+
+  memset( ix, 0, sizeof(*ix) );
+  if( stat( image, &isb ) < 0 || !(name = s4_idx_name( image )) )
+    return s4_open;
+  fd = open( name, O_RDONLY );
+  free( name );
+  if( fd < 0 )
+    return s4_open;
+
+  if( fstat( fd, &sb ) < 0 || sb.st_size < (off_t)sizeof(*h) )
+    goto done;
+  ix->len = sb.st_size;
+  ix->map = mmap( NULL, ix->len, PROT_READ, MAP_SHARED, fd, 0 );
+  if( MAP_FAILED == ix->map )
+    {
+      ix->map = NULL;
+      goto done;
+    }
+
+  /* stale unless it's this version, of this image, as it is now */
+  h = (const s4_idxhdr *)ix->map;
+  if( S4_IDX_MAGIC != h->magic || S4_IDX_VERSION != h->version ||
+      sizeof(*h) != h->hdrsize ||
+      h->imgsize != isb.st_size || h->imgmtime != isb.st_mtim.tv_sec ||
+      h->imgmtimens != isb.st_mtim.tv_nsec ||
+      (fs && (h->partoff != fs->part->partoff || h->bksz != fs->bksz ||
+              h->fsize != fs->super.super.s_fsize)) )
+    goto done;
+
+  ix->hdr = h;
+  if( s4_idx_sane( ix ) )
+    rv = s4_ok;
+
+ done:
+  close( fd );
+  if( s4_ok != rv )
+    s4_idx_close( ix );
+  return rv;
+}
+
+
+void s4_idx_close( s4_idx *ix )
+{
+  if( ix->map )
+    munmap( ix->map, ix->len );
+  memset( ix, 0, sizeof(*ix) );
+}
+
+
+s4err s4_filsys_idx( s4_filsys *fs, const char *image, s4_idx *ix )
+{
+  s4err rv;
+
+  if( s4_ok == s4_idx_open( image, fs, ix ) )
+    return s4_ok;
+
+  s4_vlog( fs->vinfo, S4_LOG_INFO, S4_LOG_FS,
+           "Building index of %s\n", image );
+  if( s4_ok != (rv = s4_filsys_idx_build( fs, image )) )
+    return rv;
+  return s4_idx_open( image, fs, ix );
+}
+
+
+s4err s4_idx_namei( s4_idx *ix, const char *path, int *inop )
+{
+  int   lo = 0, hi = ix->hdr->npath - 1, mid, c;
+
+  while( lo <= hi )
+    {
+      mid = (lo + hi) / 2;
+      c   = strcmp( path, ix->str + ix->path[ mid ].name );
+      if( !c )
+        {
+          *inop = ix->path[ mid ].ino;
+          return s4_ok;
+        }
+      if( c < 0 )
+        hi = mid - 1;
+      else
+        lo = mid + 1;
+    }
+  return s4_range;
+}
+
+
+const char *s4_idx_ipath( s4_idx *ix, int ino )
+{
+  if( ino < 1 || ino > ix->hdr->ninode || ix->ino[ ino ].path < 0 )
+    return NULL;
+  return ix->str + ix->path[ ix->ino[ ino ].path ].name;
+}
@@ -0,0 +1,116 @@
+/*
+ * s4ilist.c -- the i-list as columns, see s4d.h
+ *
+ * The inode blocks are read a chunk at a time, swapped in place and
+ * spread into one array per field, so scans over every inode are
+ * loops over memory rather than a block read per inode.
+ */
+
+#include <s4d.h>
+
+
+/* FS blocks per read */
+#define S4_ILIST_CHUNK  64
+
+
+void s4_ilist_free( s4_ilist *il )
+{
+  free( il->mode );
+  free( il->nlink );
+  free( il->uid );
+  free( il->gid );
+  free( il->size );
+  free( il->mtime );
+  free( il->addr );
+  memset( il, 0, sizeof(*il) );
+}
+
+
+static s4err s4_ilist_alloc( s4_ilist *il, int ninode )
+{
+  long n = ninode + 1L;
+
+  memset( il, 0, sizeof(*il) );
+  il->ninode = ninode;
+  il->mode   = calloc( n, sizeof(*il->mode) );
+  il->nlink  = calloc( n, sizeof(*il->nlink) );
+  il->uid    = calloc( n, sizeof(*il->uid) );
+  il->gid    = calloc( n, sizeof(*il->gid) );
+  il->size   = calloc( n, sizeof(*il->size) );
+  il->mtime  = calloc( n, sizeof(*il->mtime) );
+  il->addr   = calloc( n * S4_NADDR, sizeof(*il->addr) );
+
+  if( !il->mode || !il->nlink || !il->uid || !il->gid ||
+      !il->size || !il->mtime || !il->addr )
+    {
+      printf("no memory for %d inodes\n", ninode );
+      s4_ilist_free( il );
+      return s4_error;
+    }
+  return s4_ok;
+}
+
+
+s4err s4_filsys_ilist( s4_filsys *fs, s4_ilist *il )
+{
+  struct s4_dinode *ip;
+  s4err             rv;
+  char             *buf;
+  double            t0;
+  int               inopb, isize, fblk, n, i, ino;
+
+  inopb = fs->bksz / sizeof(struct s4_dinode);
+  isize = fs->super.super.s_isize;
+  if( isize <= 2 || isize > fs->super.super.s_fsize )
+    {
+      printf("bad i-list size %d\n", isize );
+      return s4_range;
+    }
+
+  if( s4_ok != (rv = s4_ilist_alloc( il, (isize - 2) * inopb )) )
+    return rv;
+
+  if( !(buf = malloc( (size_t)S4_ILIST_CHUNK * fs->bksz )) )
+    {
+      s4_ilist_free( il );
+      return s4_error;
+    }
+
+  ino = 1;
+  for( fblk = 2; fblk < isize; fblk += n )
+    {
+      n = isize - fblk;
+      if( n > S4_ILIST_CHUNK )
+        n = S4_ILIST_CHUNK;
+
+      if( s4_ok != (rv = s4_filsys_read_fblks( fs, fblk, n, buf )) )
+        {
+          printf("reading i-list at FBLK %d: %s\n", fblk, s4errstr(rv) );
+          break;
+        }
+
+      ip = (struct s4_dinode *)buf;
+      if( fs->doswap )
+        {
+          t0 = s4_now();
+          s4_swap_inodes( ip, n * inopb );
+          s4_stats_time( &fs->vinfo->stats, s4_now() - t0 );
+        }
+      s4_dinode_addrs( ip, n * inopb, fs->doswap, s4_ilist_addr( il, ino ) );
+
+      for( i = 0; i < n * inopb; i++, ino++ )
+        {
+          il->mode[ino]  = ip[i].di_mode;
+          il->nlink[ino] = ip[i].di_nlink;
+          il->uid[ino]   = ip[i].di_uid;
+          il->gid[ino]   = ip[i].di_gid;
+          il->size[ino]  = ip[i].di_size;
+          il->mtime[ino] = ip[i].di_mtime;
+        }
+    }
+
+  free( buf );
+  if( s4_ok != rv )
+    s4_ilist_free( il );
+  return rv;
+}
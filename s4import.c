@@ -7,7 +7,7 @@
  * 
  * Usage:
  *
- *  s4import -i fsfile -o volfile -F
+ *  s4import -i fsfile -o volfile -F --stats
  *
  *  volfile and fsfile must already exist; volfile will
  *  be over-written.
@@ -32,6 +32,8 @@ int main( int argc, char **argv )
   int         consumed;
   int         dbgflag = 0;
   int         avail;
+  int         stats = 0;
+  s4_stats    st;
   
   for( argc--, argv++; argc > 0 ; argc -= consumed, argv += consumed )
     {
@@ -59,22 +61,31 @@ int main( int argc, char **argv )
           dbgflag++;
           continue;
         }
+      else if( !strcmp( "--stats", argv[0] ) )
+        {
+          stats++;
+          continue;
+        }
       else
         help = 1;
     }
 
   if( help || !volfile || !*volfile || !fsfile  || !*fsfile)
     {
-      printf("usage: %s -i fsfile -o volimage [-F][-d]\n\n"
+      printf("usage: %s -i fsfile -o volimage [-F][-d][--stats]\n\n"
              "-i fsfile           filesystem image to import\n"
              "-o volfile          volume file to modify\n\n"
              "-F                  volume is a floppy\n"
-             "-d                  increase debug output\n",
+             "-d                  increase debug output\n"
+             "--stats             show I/O counters at exit\n",
              pname );
       exit( 1 );
     }
 
 
+  if( dbgflag )
+    s4_log_set( dbgflag > 1 ? S4_LOG_DEBUG : S4_LOG_INFO, S4_LOG_ALL );
+
   /* 006 = READ/WRITE */
   err =  s4_open_vol( volfile, 006, d );
   if( s4_ok != err )
@@ -125,6 +136,12 @@ int main( int argc, char **argv )
   if( ifd > 0 )
     close( ifd );
 
+  if( stats )
+    {
+      s4_vol_stats( d, &st );
+      s4_stats_show( &st );
+    }
+
   s4_vol_close( d );
 
   return  rv;
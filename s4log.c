@@ -0,0 +1,115 @@
+/*
+ * s4log.c -- leveled, categorized diagnostics, see s4d.h
+ *
+ * S4_LOG in the environment sets the starting level and categories:
+ *
+ *   S4_LOG=info             everything at info
+ *   S4_LOG=debug:io,remap   per block detail, io and remap only
+ *   S4_LOG=2                levels can be numbers
+ */
+
+#include <s4d.h>
+
+#include <stdarg.h>
+
+int s4_log_level = 0;           /* gate: most verbose level anywhere */
+int s4_log_want  = 0;           /* global level, handles default here */
+int s4_log_mask  = S4_LOG_ALL;  /* global categories */
+
+static int s4_log_inited;
+
+static const struct
+{
+  const char *name;
+  int         bit;
+
+} s4_log_cats[] =
+{
+  { "io",    S4_LOG_IO    },
+  { "remap", S4_LOG_REMAP },
+  { "swap",  S4_LOG_SWAP  },
+  { "fs",    S4_LOG_FS    },
+  { "all",   S4_LOG_ALL   },
+  { NULL, 0 }
+};
+
+
+void s4_log_init( void )
+{
+  const char *env, *p;
+  int         level, mask, i, n;
+
+  if( s4_log_inited )
+    return;
+  s4_log_inited = 1;
+
+  if( !(env = getenv( "S4_LOG" )) || !*env )
+    return;
+
+  if( !strncmp( env, "info", 4 ) )
+    level = S4_LOG_INFO;
+  else if( !strncmp( env, "debug", 5 ) )
+    level = S4_LOG_DEBUG;
+  else
+    level = atoi( env );
+
+  /* categories after a ':', comma separated; none is all */
+  mask = 0;
+  if( (p = strchr( env, ':' )) )
+    {
+      for( p++; *p; p += n + (p[n] == ',') )
+        {
+          n = strcspn( p, "," );
+          for( i = 0; s4_log_cats[i].name; i++ )
+            if( strlen( s4_log_cats[i].name ) == (size_t)n &&
+                !strncmp( p, s4_log_cats[i].name, n ) )
+              mask |= s4_log_cats[i].bit;
+        }
+    }
+
+  s4_log_set( level, mask ? mask : S4_LOG_ALL );
+}
+
+
+void s4_log_set( int level, int mask )
+{
+  s4_log_inited = 1;
+
+  s4_log_want = level;
+  s4_log_mask = mask;
+  if( level > s4_log_level )
+    s4_log_level = level;
+}
+
+
+void s4_vol_set_log( s4_vol *vinfo, int level, int mask )
+{
+  vinfo->loglevel = level;
+  vinfo->logmask  = mask;
+  if( level > s4_log_level )
+    s4_log_level = level;
+}
+
+
+int s4_log_on( s4_vol *vinfo, int level, int cat )
+{
+  int   want = s4_log_want;
+  int   mask = s4_log_mask;
+
+  if( vinfo && vinfo->loglevel >= 0 )
+    want = vinfo->loglevel;
+  if( vinfo && vinfo->logmask )
+    mask = vinfo->logmask;
+
+  return level <= want && (cat & mask);
+}
+
+
+void s4_logf( const char *fmt, ... )
+{
+  va_list ap;
+
+  va_start( ap, fmt );
+  vprintf( fmt, ap );
+  va_end( ap );
+}
@@ -2,8 +2,11 @@
  * s4merge -- merge multiple disk images into one
  *            choosing sectors that vary.
  *
- * Usage:  s4merge image-file ... -o output-image-file.
+ * Usage:  s4merge image-file ... -o output-image-file [-a [-x]] [--stats]
  *
+ * With -a, each differing sector is attributed to the file owning
+ * it in the filesystem of the first image, a volume or FS image.
+ * Paths come from the image's index if it has one; -x builds it.
  */
 
 #include <stdio.h>
@@ -20,6 +23,43 @@
 
 # define S4MERGE_MAX_FILES  4
 
+/* what's at sector blk of the filesystem's image.  In a volume the
+   sector is physical; FS blocks are laid out by LBA, around the spare
+   sector of each track and the remaps, as in s4_filsys_baa. */
+static void s4merge_attr( s4_filsys *fs, int isvol, s4_owners *ow,
+                          s4_idx *ix, int blk )
+{
+  s4_vol     *d = fs->vinfo;
+  const char *path = NULL;
+  s4_daddr    fblk;
+  off_t       off;
+  int         ba;
+
+  if( isvol )
+    {
+      ba = (off_t)blk * 512 / d->secsz;
+      if( s4a_lba == d->lba_or_pba )
+        ba = PBA_TO_VOL_LBA( d, ba ) - fs->part->partlba;
+      else
+        ba -= fs->part->partpba;
+      fblk = ba < 0 ? -1 : ba / (fs->bksz / d->secsz);
+    }
+  else
+    {
+      off  = (off_t)blk * 512 - fs->part->partoff;
+      fblk = off < 0 ? -1 : off / fs->bksz;
+    }
+  if( fblk < 0 || fblk >= ow->fsize )
+    {
+      printf("Sector %d is outside the filesystem\n", blk );
+      return;
+    }
+  if( ix->map )
+    path = s4_idx_ipath( ix, ow->owner[ fblk ] );
+  printf("Sector %d is ", blk );
+  s4_owners_show( ow, fblk, path );
+}
+
 /* merge file */
 typedef struct
 {
@@ -45,11 +85,22 @@ int main( int argc, char **argv )
   s4mf *ef;                     /* infput file */
   char  lbuf[ 128 ];            
   s4mf  infiles[ S4MERGE_MAX_FILES ];
+  int   stats = 0;
+  s4_stats st;
+  int        attr = 0;
+  int        doidx = 0;
+  s4_vol     vinfo;
+  s4_filsys  fs;
+  s4_owners  own;
+  s4_idx     idx;
+  int        isvol = 0;
   
   pname = argv[0];
   argc--;
   argv++;
 
+  s4_stats_init( &st );
+
   for( ; argc > 0 ; argv += consumed, argc -= consumed )
     {
       consumed = 2;
@@ -63,6 +114,21 @@ int main( int argc, char **argv )
         }
 
       consumed = 1;
+      if( !strcmp( "--stats", argv[0] ) )
+        {
+          stats = 1;
+          continue;
+        }
+      if( !strcmp( "-a", argv[0] ) )
+        {
+          attr = 1;
+          continue;
+        }
+      if( !strcmp( "-x", argv[0] ) )
+        {
+          doidx = 1;
+          continue;
+        }
       if( nf < S4MERGE_MAX_FILES )
         {
           infiles[ nf ].fn = argv[0];
@@ -78,9 +144,41 @@ int main( int argc, char **argv )
     }
   if( argc > 0 )
     {
-      printf("Usage %s infile ... -o outfile\n", pname );
+      printf("Usage %s infile ... -o outfile [-a [-x]] [--stats]\n", pname );
       exit( 0 );
     } 
+  /* owners, and paths from its index, of the first image's FS */
+  if( attr && nf )
+    {
+      uint32_t magic = 0;
+
+      /* a volume starts with its header */
+      if( pread( infiles[0].fd, &magic, sizeof(magic), 0 ) == sizeof(magic) &&
+          (S4_VHBMAGIC_BE == magic || S4_VHBMAGIC_LE == magic) )
+        {
+          if( s4_ok != s4_open_vol( infiles[0].fn, 004 | S4_O_MMAP, &vinfo ) ||
+              s4_ok != s4_vol_open_filsys( &vinfo, vinfo.fspnum, &fs ) )
+            {
+              printf("No filesystem in volume '%s' to attribute sectors\n",
+                     infiles[0].fn );
+              exit( 1 );
+            }
+          isvol = 1;
+        }
+      else if( s4_ok != s4_open_filsys_mode( infiles[0].fn, 004 | S4_O_MMAP,
+                                             &fs ) )
+        {
+          printf("No filesystem in '%s' to attribute sectors\n",
+                 infiles[0].fn );
+          exit( 1 );
+        }
+      if( s4_ok != s4_filsys_owners( &fs, NULL, &own ) )
+        exit( 1 );
+      if( s4_ok != (doidx ? s4_filsys_idx( &fs, infiles[0].fn, &idx )
+                          : s4_idx_open( infiles[0].fn, &fs, &idx )) )
+        printf("No index of '%s', no paths\n", infiles[0].fn );
+    }
+
   ofd = open( outfn, 002| O_CREAT, 0640 );
 
   if( ofd < 0 )
@@ -101,6 +199,7 @@ int main( int argc, char **argv )
           if( ef->fd > 0 )
             {
               actual = read( ef->fd, ef->buf, 512 );
+              s4_stats_io( &st, 0, actual > 0 ? actual : 0 );
               if( actual != 512 )
                 {
                   printf("got %d from '%s', closing\n", actual, ef->fn );
@@ -135,6 +234,8 @@ int main( int argc, char **argv )
       if( dif )
         {
           printf("\n");
+          if( attr )
+            s4merge_attr( &fs, isvol, &own, &idx, blk );
 
         again:
           printf("%d diffs on block %d\n", dif, blk );
@@ -186,6 +287,7 @@ int main( int argc, char **argv )
         }
 
       actual = write( ofd, infiles[i].buf, 512 );
+      s4_stats_io( &st, 1, actual > 0 ? actual : 0 );
       if( actual != 512 )
         {
           printf("%s writing output '%s'\n", strerror(errno), outfn );
@@ -200,5 +302,17 @@ int main( int argc, char **argv )
         close( infiles[i].fd > 0 );
     }
 
+  if( attr )
+    {
+      s4_owners_free( &own );
+      s4_idx_close( &idx );
+      s4_filsys_close( &fs );
+      if( isvol )
+        s4_vol_close( &vinfo );
+    }
+
+  if( stats )
+    s4_stats_show( &st );
+
   return 0;
 }
@@ -82,6 +82,8 @@ int	error;                  /* indication of trouble as exit status */
 s4_ino	ino;                    /* one we are working on */
 int     doswap;                 /* should we byte-swap? */
 int     endian;                 /* which endiannes is FS? */
+int     statsflag;              /* show I/O counters at exit */
+s4_stats stats;                 /* our I/O, counted in rdfs/wtfs */
      
 /* make sure these are aligned */
 int onebuf[FSBSIZE/sizeof(int)];
@@ -134,9 +136,12 @@ int main(int argc, char **argv)
 
         pname = argv[0];
         endian = S4_ENDIAN;
-        if( argc > 1 && argv[1][0] == '-' )
+        s4_stats_init( &stats );
+        while( argc > 1 && argv[1][0] == '-' )
         {
-                if( !strcmp("-be", argv[1]) )
+                if( !strcmp("--stats", argv[1]) )
+                        statsflag = 1;
+                else if( !strcmp("-be", argv[1]) )
                 {
                         doswap = S4_ENDIAN == S4_BE ? 0 : 1;
                         endian = S4_BE;
@@ -154,7 +159,7 @@ int main(int argc, char **argv)
          * open relevent files
          */
         if(argc < 3) {
-                printf("usage: %s filsys blocks[:inodes] [gap blocks/cyl]\n", 
+                printf("usage: %s [-be|-le] [--stats] filsys blocks[:inodes] [gap blocks/cyl]\n", 
                        pname );
                 exit(1);
         }
@@ -257,16 +262,19 @@ int main(int argc, char **argv)
         filsys->s_tinode = 0;
         filsys->s_tfree = filsys->s_fsize;
      
-        /* write zeros to the whole inode table */
-        memset( buf, 0, FSBSIZE );
-        for(n=2; n!=filsys->s_isize; n++) {
-                wtfs(n, buf, s4b_ino );
-                filsys->s_tinode += NBINODE;
-        }
-                   
         /* touch end block to set length and ensure writable. */
+        memset( buf, 0, FSBSIZE );
         wtfs( nb - 1, buf, s4b_raw );
 
+        /* zero the whole inode table; a hole in a fresh image file */
+        if( s4_ok != s4_zero_range( fsfd, (off_t)2 * FSBSIZE,
+                                    (off_t)(filsys->s_isize - 2) * FSBSIZE ) ) {
+                printf("can't clear inode table\n");
+                exit(1);
+        }
+        for(n=2; n!=filsys->s_isize; n++)
+                filsys->s_tinode += NBINODE;
+
         /* populate the freelist */
         bflist();
 
@@ -278,16 +286,16 @@ int main(int argc, char **argv)
 
         /* write super-block onto file system */
         if( doswap )
-                s4_fsu_swap( (s4_fsu*)filsys, s4b_super );
+                s4_stats_swap( &stats, (s4_fsu*)filsys, s4b_super );
 
-        lseek(fsfd, (long)S4_SUPERBOFF, 0);
-        if(write(fsfd, (char *)filsys, SBSIZE) != SBSIZE) {
+        if(pwrite(fsfd, (char *)filsys, SBSIZE, (off_t)S4_SUPERBOFF) != SBSIZE) {
                 printf("write error: super-block\n");
                 exit(1);
         }
+        s4_stats_io( &stats, 1, SBSIZE );
      
         if( doswap )
-                s4_fsu_swap( (s4_fsu*)filsys, s4b_super );
+                s4_stats_swap( &stats, (s4_fsu*)filsys, s4b_super );
 
         if( error )     
         {
@@ -300,6 +308,8 @@ int main(int argc, char **argv)
                        (double)filsys->s_tfree * FSBSIZE / 1024,
                        (double)filsys->s_tfree * FSBSIZE / 1024 / 1024 );
         }
+        if( statsflag )
+                s4_stats_show( &stats );
         exit(error);
 }
 
@@ -360,14 +370,14 @@ void rdfs(s4_daddr bno, char *bf, s4btype type )
 {
         int n;
 
-        lseek(fsfd, (long)(bno*FSBSIZE), 0);
-        n = read(fsfd, bf, FSBSIZE);
+        n = pread(fsfd, bf, FSBSIZE, (off_t)bno*FSBSIZE);
         if(n != FSBSIZE) {
           printf("read error: %ld\n", (long)bno);
           exit(1);
         }
+        s4_stats_io( &stats, 0, n );
         if( doswap )
-                s4_fsu_swap( (s4_fsu*)bf, type );
+                s4_stats_swap( &stats, (s4_fsu*)bf, type );
 }
 
 void wtfs(s4_daddr bno, char *bf, s4btype type)
@@ -376,18 +386,18 @@ void wtfs(s4_daddr bno, char *bf, s4btype type)
 
         /* swap to disk format */
         if( doswap )
-                s4_fsu_swap( (s4_fsu*)bf, type );
+                s4_stats_swap( &stats, (s4_fsu*)bf, type );
                    
-        lseek(fsfd, (long)(bno*FSBSIZE), 0);
-        n = write(fsfd, bf, FSBSIZE);
+        n = pwrite(fsfd, bf, FSBSIZE, (off_t)bno*FSBSIZE);
         if(n != FSBSIZE) {
           printf("write error: %ld\n", (long)bno);
           exit(1);
         }
+        s4_stats_io( &stats, 1, n );
                    
         /* return to native */
         if( doswap )
-                s4_fsu_swap( (s4_fsu*)bf, type );
+                s4_stats_swap( &stats, (s4_fsu*)bf, type );
 }
                    
 /* allocate a block from superblock cache, refilling as needed */
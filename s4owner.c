@@ -0,0 +1,134 @@
+/*
+ * s4owner.c -- which inode owns each FS block, see s4d.h
+ *
+ * One pass over the i-list marks the direct blocks of each file,
+ * directory and pipe, and reads its indirect blocks to mark the
+ * rest.  Each block gets the owning inode and its logical block in
+ * that file; indirect blocks get the negative of their level.
+ */
+
+#include <s4d.h>
+
+
+/* a block of ino at logical block lbn, or indirect at level -lbn */
+static void s4_owners_mark( s4_owners *ow, s4_daddr b, int ino, long lbn )
+{
+  if( b < ow->isize || b >= ow->fsize )
+    {
+      ow->nbad++;
+      return;
+    }
+  if( ow->owner[ b ] )
+    ow->ndup++;
+  ow->owner[ b ] = ino;
+  ow->lbn[ b ]   = lbn;
+}
+
+
+/* blocks under indirect fblk at level lvl, the first being lbn */
+static void s4_owners_ind( s4_filsys *fs, s4_owners *ow, s4_daddr fblk,
+                           int lvl, int ino, long lbn )
+{
+  s4_fsu   fsu;
+  s4_daddr ent;
+  long     span;
+  int      i, nindir = fs->bksz / sizeof(s4_daddr);
+
+  s4_owners_mark( ow, fblk, ino, -lvl );
+  if( fblk < ow->isize || fblk >= ow->fsize ||
+      s4_ok != s4_filsys_read_blk( fs, fblk, fs->bksz / 512,
+                                   fsu.buf, fs->bksz ) )
+    return;
+
+  for( span = 1, i = 1; i < lvl; i++ )
+    span *= nindir;
+  for( i = 0; i < nindir; i++, lbn += span )
+    {
+      ent = fs->doswap ? s4swapi( fsu.indir[i] ) : fsu.indir[i];
+      if( !ent )
+        continue;
+      if( lvl > 1 )
+        s4_owners_ind( fs, ow, ent, lvl - 1, ino, lbn );
+      else
+        s4_owners_mark( ow, ent, ino, lbn );
+    }
+}
+
+
+s4err s4_filsys_owners( s4_filsys *fs, const s4_ilist *il, s4_owners *ow )
+{
+  s4_ilist  lil;
+  s4_daddr *addrs;
+  s4err     rv;
+  long      lbn, span;
+  int       ino, i, fmt, nindir = fs->bksz / sizeof(s4_daddr);
+
+  memset( ow, 0, sizeof(*ow) );
+  ow->isize = fs->super.super.s_isize;
+  ow->fsize = fs->super.super.s_fsize;
+  if( !il )
+    {
+      if( s4_ok != (rv = s4_filsys_ilist( fs, &lil )) )
+        return rv;
+      il = &lil;
+    }
+
+  if( !(ow->owner = calloc( ow->fsize, sizeof(*ow->owner) )) ||
+      !(ow->lbn   = calloc( ow->fsize, sizeof(*ow->lbn) )) )
+    {
+      s4_owners_free( ow );
+      if( &lil == il )
+        s4_ilist_free( &lil );
+      return s4_error;
+    }
+
+  for( ino = 1; ino <= il->ninode; ino++ )
+    {
+      fmt = il->mode[ ino ] & S_IFMT;
+      if( S_IFREG != fmt && S_IFDIR != fmt && S_IFIFO != fmt )
+        continue;
+
+      addrs = s4_ilist_addr( il, ino );
+      for( i = 0; i < S4_NADDR - 3; i++ )
+        if( addrs[i] )
+          s4_owners_mark( ow, addrs[i], ino, i );
+
+      /* single, double, triple indirect follow the direct blocks */
+      for( lbn = S4_NADDR - 3, span = nindir, i = 1; i <= 3;
+           lbn += span, span *= nindir, i++ )
+        if( addrs[ S4_NADDR - 4 + i ] )
+          s4_owners_ind( fs, ow, addrs[ S4_NADDR - 4 + i ], i, ino, lbn );
+    }
+
+  if( &lil == il )
+    s4_ilist_free( &lil );
+  return s4_ok;
+}
+
+
+void s4_owners_free( s4_owners *ow )
+{
+  free( ow->owner );
+  free( ow->lbn );
+  ow->owner = NULL;
+  ow->lbn   = NULL;
+}
+
+
+void s4_owners_show( s4_owners *ow, s4_daddr b, const char *path )
+{
+  if( b < 0 || b >= ow->fsize )
+    printf("FBLK %d: beyond the filesystem\n", b );
+  else if( b < ow->isize )
+    printf("FBLK %d: %s\n", b, b < 2 ? "boot/superblock" : "i-list" );
+  else if( !ow->owner[ b ] )
+    printf("FBLK %d: not in any file\n", b );
+  else if( ow->lbn[ b ] < 0 )
+    printf("FBLK %d: level %d indirect block of ino %d%s%s\n",
+           b, (int)-ow->lbn[ b ], ow->owner[ b ],
+           path ? " " : "", path ? path : "" );
+  else
+    printf("FBLK %d: block %d of ino %d%s%s\n",
+           b, (int)ow->lbn[ b ], ow->owner[ b ],
+           path ? " " : "", path ? path : "" );
+}
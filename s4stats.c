@@ -0,0 +1,116 @@
+/*
+ * s4stats.c -- I/O counters for volumes and the tools, see s4d.h
+ *
+ * Each s4_vol keeps an s4_stats, bumped where the library does its
+ * I/O.  Tools doing their own I/O keep one of their own and bump it
+ * with s4_stats_io and s4_stats_swap.  Threads may share a volume,
+ * so the bumps are atomic.
+ */
+
+#include <s4d.h>
+
+#include <time.h>
+
+
+double s4_now( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+void s4_stats_init( s4_stats *st )
+{
+  memset( st, 0, sizeof(*st) );
+  st->start = s4_now();
+}
+
+
+void s4_stats_add( s4_stats *to, const s4_stats *from )
+{
+  to->calls    += from->calls;
+  to->rbytes   += from->rbytes;
+  to->wbytes   += from->wbytes;
+  to->remaps   += from->remaps;
+  to->hits     += from->hits;
+  to->misses   += from->misses;
+  to->swaptime += from->swaptime;
+
+  /* the earliest start covers both */
+  if( from->start && (!to->start || from->start < to->start) )
+    to->start = from->start;
+}
+
+
+void s4_stats_io( s4_stats *st, int wr, long long bytes )
+{
+  __atomic_add_fetch( &st->calls, 1, __ATOMIC_RELAXED );
+  __atomic_add_fetch( wr ? &st->wbytes : &st->rbytes, bytes,
+                      __ATOMIC_RELAXED );
+}
+
+
+void s4_stats_remap( s4_stats *st )
+{
+  __atomic_add_fetch( &st->remaps, 1, __ATOMIC_RELAXED );
+}
+
+
+void s4_stats_time( s4_stats *st, double secs )
+{
+  double old, new;
+
+  __atomic_load( &st->swaptime, &old, __ATOMIC_RELAXED );
+  do
+    new = old + secs;
+  while( !__atomic_compare_exchange( &st->swaptime, &old, &new, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED ) );
+}
+
+
+void s4_stats_swap( s4_stats *st, s4_fsu *fsu, int btype )
+{
+  double t0 = s4_now();
+
+  s4_fsu_swap( fsu, btype );
+  s4_stats_time( st, s4_now() - t0 );
+}
+
+
+void s4_stats_show( const s4_stats *st )
+{
+  double secs = s4_now() - st->start;
+  double mb   = (st->rbytes + st->wbytes) / (1024.0 * 1024.0);
+  long   n    = st->hits + st->misses;
+
+  printf("Stats: %ld I/O calls, %.2fM read, %.2fM written, "
+         "%ld sectors remapped\n",
+         st->calls, st->rbytes / (1024.0 * 1024.0),
+         st->wbytes / (1024.0 * 1024.0), st->remaps );
+  printf("       cache %ld hits %ld misses (%ld%%), %.3fs swapping\n",
+         st->hits, st->misses, n ? st->hits * 100 / n : 0, st->swaptime );
+  printf("       %.2fs elapsed, %.2f MB/s\n",
+         secs, secs > 0 ? mb / secs : 0.0 );
+}
+
+
+void s4_vol_stats( s4_vol *vinfo, s4_stats *st )
+{
+  *st = vinfo->stats;
+}
+
+
+void s4_filsys_stats( s4_filsys *fs, s4_stats *st )
+{
+  s4_vol_stats( fs->vinfo, st );
+
+  if( fs->cache )
+    {
+      pthread_mutex_lock( &fs->cache->lock );
+      st->hits   += fs->cache->hits;
+      st->misses += fs->cache->misses;
+      pthread_mutex_unlock( &fs->cache->lock );
+    }
+}
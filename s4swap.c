@@ -0,0 +1,344 @@
+/*
+ * s4swap.c -- bulk byte swapping of whole FS blocks, see s4d.h
+ *
+ * Every block type is a fixed pattern of byte moves repeating every
+ * 16 bytes (inodes: every 64), so one shuffle kernel does them all:
+ * pshufb with SSSE3, vpshufb with AVX2.  Without either, it's the
+ * field at a time loops that s4_fsu_swap always had.
+ * The kernel is picked at first use from what the CPU has; S4_SWAP
+ * in the environment (scalar, ssse3, avx2) overrides for testing.
+ *
+ * Like s4swapi, these do nothing on a big endian host.
+ *
+ * The 3-byte disk address decoders below widen 4 addresses at a
+ * time with the same pshufb, and share the pick.
+ */
+
+#include <s4d.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define S4_SWAP_X86
+#include <immintrin.h>
+#endif
+
+/* the inode masks below know the layout */
+typedef char s4_dinode_is_64[ sizeof(struct s4_dinode) == 64 ? 1 : -1 ];
+typedef char s4_direct_is_16[ sizeof(struct s4_direct) == 16 ? 1 : -1 ];
+
+/* permute each 16 byte chunk of p by masks, cycling through nmasks
+   of them; len is a multiple of 16 * nmasks */
+typedef void (*s4_shuf_fn)( unsigned char *p, long len,
+                            const unsigned char *masks, int nmasks );
+
+static const unsigned char s4_mask16[16] =
+  { 1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14 };
+
+static const unsigned char s4_mask32[16] =
+  { 3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12 };
+
+/* d_ino, then the name as is */
+static const unsigned char s4_maskdir[16] =
+  { 1,0, 2,3,4,5,6,7, 8,9,10,11,12,13,14,15 };
+
+/* mode nlink uid gid size | addr ... | addr atime mtime ctime */
+static const unsigned char s4_maskino[64] =
+{
+  1,0, 3,2, 5,4, 7,6, 11,10,9,8, 12,13,14,15,
+  0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
+  0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,
+  0,1,2,3, 7,6,5,4, 11,10,9,8, 15,14,13,12
+};
+
+
+#ifdef S4_SWAP_X86
+
+__attribute__((target("ssse3")))
+static void s4_shuf_ssse3( unsigned char *p, long len,
+                           const unsigned char *masks, int nmasks )
+{
+  __m128i  m[4];
+  __m128i *q;
+  long     off;
+  int      k;
+
+  for( k = 0; k < nmasks; k++ )
+    m[k] = _mm_loadu_si128( (const __m128i*)(masks + 16 * k) );
+
+  for( off = 0; off < len; off += 16 * nmasks )
+    for( k = 0; k < nmasks; k++ )
+      {
+        q = (__m128i*)(p + off + 16 * k);
+        _mm_storeu_si128( q, _mm_shuffle_epi8( _mm_loadu_si128( q ), m[k] ));
+      }
+}
+
+/* vpshufb stays within 128 bit lanes, so a 32 byte mask is two of
+   the 16 byte ones side by side */
+__attribute__((target("avx2")))
+static void s4_shuf_avx2( unsigned char *p, long len,
+                          const unsigned char *masks, int nmasks )
+{
+  __m256i  m[2];
+  __m256i *q;
+  long     off, step;
+  int      k, nm;
+
+  if( 1 == nmasks )
+    {
+      nm   = 1;
+      m[0] = _mm256_broadcastsi128_si256(
+               _mm_loadu_si128( (const __m128i*)masks ) );
+    }
+  else
+    {
+      nm = nmasks / 2;
+      for( k = 0; k < nm; k++ )
+        m[k] = _mm256_loadu_si256( (const __m256i*)(masks + 32 * k) );
+    }
+
+  step = 32 * nm;
+  for( off = 0; off + step <= len; off += step )
+    for( k = 0; k < nm; k++ )
+      {
+        q = (__m256i*)(p + off + 32 * k);
+        _mm256_storeu_si256( q, _mm256_shuffle_epi8( _mm256_loadu_si256( q ),
+                                                     m[k] ));
+      }
+
+  /* an odd 16 bytes left over */
+  if( off < len )
+    s4_shuf_ssse3( p + off, len - off, masks, nmasks );
+}
+
+/* 4 3-byte addresses to 4 int32s, and back */
+static const unsigned char s4_mask_l3le[16] =
+  { 0,1,2,0x80, 3,4,5,0x80, 6,7,8,0x80, 9,10,11,0x80 };
+static const unsigned char s4_mask_l3be[16] =
+  { 2,1,0,0x80, 5,4,3,0x80, 8,7,6,0x80, 11,10,9,0x80 };
+static const unsigned char s4_mask_ltol3le[16] =
+  { 0,1,2, 4,5,6, 8,9,10, 12,13,14, 0x80,0x80,0x80,0x80 };
+static const unsigned char s4_mask_ltol3be[16] =
+  { 2,1,0, 6,5,4, 10,9,8, 14,13,12, 0x80,0x80,0x80,0x80 };
+
+/* decode while a 16 byte load stays inside n addresses plus slack
+   readable bytes after them; returns how many were done */
+__attribute__((target("ssse3")))
+static int s4_dab_decode_ssse3( int *lp, const unsigned char *src, int n,
+                                int be, int slack )
+{
+  __m128i m = _mm_loadu_si128( (const __m128i*)(be ? s4_mask_l3be
+                                                     : s4_mask_l3le) );
+  int     i;
+
+  for( i = 0; 3 * i + 16 <= 3 * n + slack && i + 4 <= n; i += 4 )
+    _mm_storeu_si128( (__m128i*)(lp + i),
+                      _mm_shuffle_epi8(
+                        _mm_loadu_si128( (const __m128i*)(src + 3 * i) ), m ));
+  return i;
+}
+
+/* 12 bytes out per 4, nothing past them touched */
+__attribute__((target("ssse3")))
+static int s4_dab_encode_ssse3( unsigned char *dst, const int *lp, int n,
+                                int be )
+{
+  __m128i m = _mm_loadu_si128( (const __m128i*)(be ? s4_mask_ltol3be
+                                                     : s4_mask_ltol3le) );
+  __m128i v;
+  int32_t hi;
+  int     i;
+
+  for( i = 0; i + 4 <= n; i += 4 )
+    {
+      v  = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(lp + i) ), m );
+      hi = _mm_cvtsi128_si32( _mm_srli_si128( v, 8 ) );
+      _mm_storel_epi64( (__m128i*)(dst + 3 * i), v );
+      memcpy( dst + 3 * i + 8, &hi, 4 );
+    }
+  return i;
+}
+
+#endif /* S4_SWAP_X86 */
+
+
+static s4_shuf_fn      s4_shuf;         /* NULL for scalar */
+static const char     *s4_shuf_name;
+static pthread_once_t  s4_swap_once = PTHREAD_ONCE_INIT;
+
+static void s4_swap_pick( void )
+{
+  const char *env = getenv( "S4_SWAP" );
+
+  s4_shuf      = NULL;
+  s4_shuf_name = "scalar";
+
+#ifdef S4_SWAP_X86
+  __builtin_cpu_init();
+  if( env && !strcmp( env, "scalar" ) )
+    return;
+  if( __builtin_cpu_supports( "avx2" ) && !(env && !strcmp( env, "ssse3" )) )
+    {
+      s4_shuf      = s4_shuf_avx2;
+      s4_shuf_name = "avx2";
+    }
+  else if( __builtin_cpu_supports( "ssse3" ) )
+    {
+      s4_shuf      = s4_shuf_ssse3;
+      s4_shuf_name = "ssse3";
+    }
+#else
+  (void)env;
+#endif
+}
+
+const char *s4_swap_kernel( void )
+{
+  pthread_once( &s4_swap_once, s4_swap_pick );
+  return s4_shuf_name;
+}
+
+/* shuffle the whole 16 byte chunks; returns how much was done,
+   leaving the rest to the caller */
+static long s4_swap_bulk( void *p, long len, const unsigned char *mask )
+{
+#ifdef S4_LITTLE_ENDIAN
+  pthread_once( &s4_swap_once, s4_swap_pick );
+  if( !s4_shuf )
+    return 0;
+  len &= ~15L;
+  if( len )
+    s4_shuf( p, len, mask, 1 );
+#endif
+  return len;
+}
+
+
+void s4_swap16( void *p, int n )
+{
+  int16_t *s = p;
+  long     i;
+
+  for( i = s4_swap_bulk( p, 2L * n, s4_mask16 ) / 2; i < n; i++ )
+    s[i] = s4swaph( s[i] );
+}
+
+
+void s4_swap32( void *p, int n )
+{
+  int32_t *s = p;
+  long     i;
+
+  for( i = s4_swap_bulk( p, 4L * n, s4_mask32 ) / 4; i < n; i++ )
+    s[i] = s4swapi( s[i] );
+}
+
+
+void s4_swap_dirs( struct s4_direct *dp, int n )
+{
+  long i;
+
+  for( i = s4_swap_bulk( dp, 16L * n, s4_maskdir ) / 16; i < n; i++ )
+    dp[i].d_ino = s4swaph( dp[i].d_ino );
+}
+
+
+void s4_swap_inodes( struct s4_dinode *ip, int n )
+{
+  int i;
+
+#ifdef S4_LITTLE_ENDIAN
+  pthread_once( &s4_swap_once, s4_swap_pick );
+  if( s4_shuf )
+    {
+      if( n > 0 )
+        s4_shuf( (unsigned char*)ip, 64L * n, s4_maskino, 4 );
+      return;
+    }
+#endif
+
+  for( i = 0; i < n; i++, ip++ )
+    {
+      ip->di_mode  = s4swaph( ip->di_mode );
+      ip->di_nlink = s4swaph( ip->di_nlink );
+      ip->di_uid   = s4swaph( ip->di_uid );
+      ip->di_gid   = s4swaph( ip->di_gid );
+      ip->di_size  = s4swapi( ip->di_size );
+      ip->di_atime = s4swapi( ip->di_atime );
+      ip->di_mtime = s4swapi( ip->di_mtime );
+      ip->di_ctime = s4swapi( ip->di_ctime );
+    }
+}
+
+
+/* ---------------------------------------------------------------- */
+/* 3 byte disk addresses */
+
+static int s4_dab_decode_n( int *lp, const unsigned char *src, int n,
+                            int be, int slack )
+{
+  int   i = 0;
+
+#ifdef S4_SWAP_X86
+  pthread_once( &s4_swap_once, s4_swap_pick );
+  if( s4_shuf )
+    i = s4_dab_decode_ssse3( lp, src, n, be, slack );
+#endif
+
+  for( src += 3 * i; i < n; i++, src += 3 )
+    lp[i] = be ? (src[0] << 16) + (src[1] << 8) + src[2]
+               : (src[2] << 16) + (src[1] << 8) + src[0];
+  return n;
+}
+
+void s4_dab_decode( int *lp, const char *cp, int n, int be )
+{
+  s4_dab_decode_n( lp, (const unsigned char*)cp, n, be, 0 );
+}
+
+void s4_dab_encode( char *cp, const int *lp, int n, int be )
+{
+  unsigned char *dst = (unsigned char*)cp;
+  int            i = 0;
+
+#ifdef S4_SWAP_X86
+  pthread_once( &s4_swap_once, s4_swap_pick );
+  if( s4_shuf )
+    i = s4_dab_encode_ssse3( dst, lp, n, be );
+#endif
+
+  for( dst += 3 * i; i < n; i++, dst += 3 )
+    {
+      dst[ be ? 0 : 2 ] = (lp[i] >> 16) & 0xff;
+      dst[1]            = (lp[i] >> 8) & 0xff;
+      dst[ be ? 2 : 0 ] = lp[i] & 0xff;
+    }
+}
+
+/* addresses are big endian on disk when exactly one of host and
+   filesystem is */
+#define S4_DAB_BE( doswap )   ((S4_ENDIAN == S4_BE) != !!(doswap))
+
+void s4_dinode_addrs( const struct s4_dinode *ip, int n, int doswap,
+                      s4_daddr *addrs )
+{
+  int be = S4_DAB_BE( doswap );
+  int i;
+
+  /* di_addr's pad byte and the times follow the addresses, so the
+     16 byte load for 8-11, which ends one byte past the 13th, keeps
+     them in the vector loop; the 13th is the scalar tail */
+  for( i = 0; i < n; i++, addrs += S4_NADDR )
+    s4_dab_decode_n( addrs, (const unsigned char*)ip[i].di_addr,
+                     S4_NADDR, be,
+                     sizeof(ip[i].di_addr) - 3 * S4_NADDR + 12 );
+}
+
+void s4_dinode_set_addrs( struct s4_dinode *ip, int n, int doswap,
+                          const s4_daddr *addrs )
+{
+  int be = S4_DAB_BE( doswap );
+  int i;
+
+  for( i = 0; i < n; i++, addrs += S4_NADDR )
+    s4_dab_encode( ip[i].di_addr, addrs, S4_NADDR, be );
+}
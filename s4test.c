@@ -1,5 +1,15 @@
 /*
  * s4test.c -- trying things w/s4d
+ *
+ * s4test [devfile]             math checks, and scan devfile for a FS
+ * s4test -w fsimage [expect]   write a test tree into fsimage, and
+ *                              the s4fsck -n warnings due into expect
+ * s4test -u fsimage pristine   remove it, compare free counts w/pristine
+ * s4test -x                    swap kernels against the scalar loops
+ *
+ * -w, -u and -x exit 1 on a failed check; "make check" runs -x with
+ * each kernel, and -w and -u on fresh native and byte-swapped images,
+ * with s4fsck -n after each.
  */
 
 #include <s4d.h>
@@ -22,6 +32,10 @@ static void s4_conv_test( s4_vol *d,
 
 static void s4_rll_test(void);
 
+static int s4_write_test( const char *img, const char *expect );
+static int s4_unwrite_test( const char *img, const char *pristine );
+static int s4_swap_test( void );
+
 static int tracks_to_test[] = { 0, 7, 8, 15, 16,
                                 632, 633, 634, 635, 636, 637, 639, 640, 769, 
                                 -1 };
@@ -62,6 +76,15 @@ int main( int argc, char **argv )
   s4_vol  vinfo;
   s4_vol *d = &vinfo;
 
+  if( argc > 2 && !strcmp( argv[1], "-w" ) )
+    return s4_write_test( argv[2], argv[3] ) ? 1 : 0;
+
+  if( argc > 3 && !strcmp( argv[1], "-u" ) )
+    return s4_unwrite_test( argv[2], argv[3] ) ? 1 : 0;
+
+  if( argc > 1 && !strcmp( argv[1], "-x" ) )
+    return s4_swap_test() ? 1 : 0;
+
   printf("\nChecking math:\n");
 
   s4_init_vol( "s4test fake", -1, 1024, 8, 512, 17*8, NULL, d );
@@ -82,8 +105,8 @@ int main( int argc, char **argv )
     {
       printf("\nLooking for filesystem in %s...\n", devfile );
 
-      /*  004 = O_READ */
-      if( s4_open_vol( devfile, 004, d ) )
+      /*  004 = O_READ; the scanners read every sector, so map it */
+      if( s4_open_vol( devfile, 004 | S4_O_MMAP, d ) )
         {
           printf("didn't open %s\n", devfile);
           exit( 1 );
@@ -117,9 +140,9 @@ void s4_test_macros(void)
   printf(    "Track    Offset   PBA   LBA  Cyl  CS  HD\n");
   for( i = 0; (track = tracks_to_test[i]) >= 0 ; i++ )
     {
-      printf(" %5u %8u %5u %5u %4u %3u %3u\n",
+      printf(" %5u %8lld %5u %5u %4u %3u %3u\n",
              track,
-             TRK_TO_OFFSET( d, track ),
+             (long long)TRK_TO_OFFSET( d, track ),
              TRK_TO_PBA(    d, track ),
              TRK_TO_LBA(    d, track ),
              TRK_TO_CYL(    d, track ),
@@ -133,9 +156,9 @@ void s4_test_macros(void)
   printf("  PBA     OFFSET   LBA   TRK  CYL HD HS  CS\n");
   for( i = 0; (pba = pbas_to_test[ i ]) >= 0; i++ )
     {
-      printf("%5u %10u %5u %5u %4u %2u %2u %3u\n",
+      printf("%5u %10lld %5u %5u %4u %2u %2u %3u\n",
              pba,
-             PBA_TO_OFFSET(   d, pba ),
+             (long long)PBA_TO_OFFSET(   d, pba ),
              PBA_TO_VOL_LBA(  d, pba ),
              PBA_TO_TRK(      d, pba ),
              PBA_TO_CYL(      d, pba ),
@@ -289,20 +312,19 @@ static void s4_vol_find_fblks( s4_vol *vinfo )
   int   i, j;
   char  buf[ 512 ];
   int	offset;
-  int	rv;
   int	nfree;
   int	dat;
   int	nope;
 
-  struct s4_fblk *fblk = (struct s4_fblk*)buf;
+  struct s4_fblk *fblk;
 
   printf("\nFinding fblks, scanning %d blocks\n", vinfo->pblks);
 
   /* start at very beginning */
   for( offset = i = 0; i < vinfo->pblks; i++, offset += vinfo->secsz )
     {
-      rv = s4_seek_read( vinfo->fd, (long)offset, buf, sizeof(buf));
-      if( rv )
+      fblk = (struct s4_fblk*)s4_vol_ptr( vinfo, offset, sizeof(buf), buf );
+      if( !fblk )
         break;
 
       nope = 0;
@@ -359,7 +381,6 @@ static void s4_vol_find_fs( s4_vol *vinfo )
   int  *ip;
   char  buf[ 512 ];
   int	offset;
-  int	rv;
   int   found;
 
   printf("Finding FS the hard way, scanning %d blocks, should be near PBA %d\n",
@@ -368,12 +389,11 @@ static void s4_vol_find_fs( s4_vol *vinfo )
   /* start at very beginning */
   for( found = offset = i = 0; !found && i < vinfo->pblks; i++, offset += vinfo->secsz )
     {
-      rv = s4_seek_read( vinfo->fd, (long)offset, buf, sizeof(buf));
-      if( rv )
+      ip = (int*)s4_vol_ptr( vinfo, offset, sizeof(buf), buf );
+      if( !ip )
 	break;
 
       /* 128 is ints in a 512 byte block */
-      ip = (int*)buf;
       for( j = 0; !found && j < 128 && !found ; j++ )
 	{
 	  if( S4_FsMAGIC == s4swapi(ip[j]) )
@@ -420,22 +440,23 @@ static void s4_vol_find_rootdir( s4_vol *vinfo )
 {
   int                 pba, fsblk;
   char                buf[ 512 ];
+  char               *sp;
   const char        **np;
   char               *bp;
   int                 hits;
   int                 len;
 
   printf("\nFind ROOTDIR:\n"
-         "Psrtition 2 starts at track %d, LBAA %d, PBA %d abs offset %d\n",
+         "Psrtition 2 starts at track %d, LBAA %d, PBA %d abs offset %lld\n",
          vinfo->parts[2].strk,
          vinfo->parts[2].partlba,
          TRK_TO_PBA( vinfo, vinfo->parts[2].strk ),
-         TRK_TO_OFFSET( vinfo, vinfo->parts[2].strk ) );
+         (long long)TRK_TO_OFFSET( vinfo, vinfo->parts[2].strk ) );
 
   fsblk = 0;
   for( pba = vinfo->parts[2].partoff/512; pba < vinfo->lblks; pba++, fsblk++ )
     {
-      if( s4_ok != s4_seek_read( vinfo->fd, pba * 512, buf, sizeof(buf) ))
+      if( !(sp = s4_vol_sector( vinfo, pba, buf )) )
         break;
 
       hits = 0;
@@ -444,7 +465,7 @@ static void s4_vol_find_rootdir( s4_vol *vinfo )
       for( np = rootdirs; *np ; np++ )
         {
           len = strlen( *np );
-          for( bp = buf; bp < &buf[ 512 - 18 ]; bp++ )
+          for( bp = sp; bp < &sp[ 512 - 18 ]; bp++ )
             {
               if( !memcmp( bp, *np, len ) )
                 {
@@ -458,8 +479,13 @@ static void s4_vol_find_rootdir( s4_vol *vinfo )
         }
       if( hits > 3 )
         {
-          printf("Absolute offset %d\n", PBA_TO_OFFSET( vinfo, pba ) );
-          s4dump( buf, sizeof(buf), 0, 0, 0 );
+          printf("Absolute offset %lld\n",
+                 (long long)PBA_TO_OFFSET( vinfo, pba ) );
+          s4dump( sp, sizeof(buf), 0, 0, 0 );
+
+          /* swap a copy, the mapping is read-only */
+          if( sp != buf )
+            memcpy( buf, sp, sizeof(buf) );
 
           s4_fsu_swap( (s4_fsu*)buf, s4b_dir );
           s4_fsu_show( (s4_fsu*)buf, s4b_dir );
@@ -500,3 +526,440 @@ static void s4_rll_test(void)
   s4dump( pbuf, plen, 0, 16, 0 );
   
 }
+
+
+
+/* ---------------------------------------------------------------- */
+/* Write round trip: -w fills a test tree, -u takes it out again.
+   Between the two s4fsck -n should find nothing but a POSSIBLE FILE
+   SIZE ERROR for each sparse file, as its sizechk warns of any file
+   with holes; -w lists those for make check to compare.  After -u
+   fsck should say nothing at all, and the free counts should be a
+   pristine image's again. */
+
+#define TW_DIR          "/s4test"
+
+typedef struct
+{
+  const char *path;
+  long        off;              /* first byte written */
+  long        len;
+
+} s4_twfile;
+
+
+/* the test files for a block size: direct only, through the double
+   indirect block, and sparse ones reached only by the double and
+   triple indirect blocks */
+static int s4_tw_files( s4_filsys *fs, s4_twfile *tf )
+{
+  long  bksz   = fs->bksz;
+  long  nindir = bksz / sizeof(s4_daddr);
+  long  ndir   = S4_NADDR - 3;
+
+  tf[0].path = TW_DIR "/small";
+  tf[0].off  = 0;
+  tf[0].len  = 100;
+
+  tf[1].path = TW_DIR "/big";
+  tf[1].off  = 0;
+  tf[1].len  = (ndir + nindir + 3) * bksz + 123;
+
+  tf[2].path = TW_DIR "/dbl";
+  tf[2].off  = (ndir + nindir + nindir / 2) * bksz + 7;
+  tf[2].len  = 2 * bksz;
+
+  tf[3].path = TW_DIR "/tpl";
+  tf[3].off  = (ndir + nindir + nindir * nindir) * bksz + 11;
+  tf[3].len  = bksz;
+
+  return 4;
+}
+
+/* what byte off of file path holds */
+static int s4_tw_byte( const char *path, long off )
+{
+  return (off * 31 + (off >> 10) + path[ strlen( path ) - 1 ]) & 0xff;
+}
+
+/* read back tf up to size, holes as zeroes; errors */
+static int s4_tw_check( s4_filsys *fs, const s4_twfile *tf, long size )
+{
+  struct s4_dinode di;
+  char            *buf;
+  long             i, n, want;
+  int              ino;
+  int              bad = 0;
+
+  if( s4_ok != s4_filsys_namei( fs, tf->path, &ino ) ||
+      s4_ok != s4_filsys_iget( fs, ino, &di, NULL ) )
+    {
+      printf("%s: not found\n", tf->path );
+      return 1;
+    }
+  if( di.di_size != size )
+    {
+      printf("%s: size %ld, expected %ld\n", tf->path, (long)di.di_size, size );
+      bad++;
+    }
+
+  if( !(buf = malloc( size + 1 )) )
+    return bad + 1;
+
+  /* one past the end, to see that it stops there */
+  if( (n = s4_filsys_read_file( fs, ino, 0, size + 1, buf )) != size )
+    {
+      printf("%s: read %ld of %ld\n", tf->path, n, size );
+      bad++;
+    }
+  for( i = 0; i < n && bad < 10; i++ )
+    {
+      want = i >= tf->off && i < tf->off + tf->len ?
+        s4_tw_byte( tf->path, i ) : 0;
+      if( (buf[ i ] & 0xff) != want )
+        {
+          printf("%s: byte %ld is %d, expected %ld\n",
+                 tf->path, i, buf[ i ] & 0xff, want );
+          bad++;
+        }
+    }
+  free( buf );
+  return bad;
+}
+
+static int s4_tw_open( const char *img, s4_filsys *fs )
+{
+  /* 002 = read/write */
+  if( s4_ok != s4_open_filsys_mode( img, 002, fs ) )
+    {
+      printf("didn't open %s\n", img );
+      return 1;
+    }
+  printf("%s: %s, %d byte blocks, %d free blocks, %d free inodes\n",
+         img, fs->doswap ? "swapped" : "native", fs->bksz,
+         (int)fs->super.super.s_tfree, (int)fs->super.super.s_tinode );
+  return 0;
+}
+
+static int s4_tw_intcmp( const void *a, const void *b )
+{
+  return *(const int*)a - *(const int*)b;
+}
+
+/* make the test tree in img and read it back, then again reopened;
+   the warnings s4fsck -n should give go into expect if not NULL */
+static int s4_write_test( const char *img, const char *expect )
+{
+  s4_filsys   filsys;
+  s4_filsys  *fs = &filsys;
+  s4_twfile   tf[ 4 ];
+  FILE       *fp;
+  char       *buf;
+  long        n, chunk, done;
+  int         i, nf, ino;
+  int         sparse[ 4 ];
+  int         bad = 0;
+
+  if( s4_tw_open( img, fs ) )
+    return 1;
+
+  nf = s4_tw_files( fs, tf );
+  if( s4_ok != s4_filsys_mkdir( fs, TW_DIR, 0755, &ino ) )
+    {
+      printf("mkdir %s failed\n", TW_DIR );
+      s4_filsys_close( fs );
+      return 1;
+    }
+
+  for( i = 0; i < nf; i++ )
+    {
+      if( s4_ok != s4_filsys_create( fs, tf[i].path, 0644, &ino ) ||
+          !(buf = malloc( tf[i].len )) )
+        {
+          printf("create %s failed\n", tf[i].path );
+          bad++;
+          continue;
+        }
+      for( n = 0; n < tf[i].len; n++ )
+        buf[ n ] = s4_tw_byte( tf[i].path, tf[i].off + n );
+
+      /* odd sized pieces, so writes straddle blocks */
+      for( done = 0; done < tf[i].len; done += chunk )
+        {
+          chunk = tf[i].len - done < 3001 ? tf[i].len - done : 3001;
+          if( s4_filsys_write_file( fs, ino, tf[i].off + done, chunk,
+                                    buf + done ) != chunk )
+            {
+              printf("write %s at %ld failed\n", tf[i].path, done );
+              bad++;
+              break;
+            }
+        }
+      free( buf );
+      bad += s4_tw_check( fs, &tf[i], tf[i].off + tf[i].len );
+    }
+  if( s4_ok != s4_filsys_close( fs ) )
+    bad++;
+
+  /* and as it is on disk */
+  if( s4_tw_open( img, fs ) )
+    return 1;
+  for( i = 0; i < nf; i++ )
+    bad += s4_tw_check( fs, &tf[i], tf[i].off + tf[i].len );
+
+  if( expect )
+    {
+      if( !(fp = fopen( expect, "w" )) )
+        {
+          printf("can't write %s\n", expect );
+          bad++;
+        }
+      else
+        {
+          /* the sparse ones, in inode order as phase 1 goes */
+          for( i = n = 0; i < nf; i++ )
+            if( tf[i].off && s4_ok == s4_filsys_namei( fs, tf[i].path, &ino ) )
+              sparse[ n++ ] = ino;
+          qsort( sparse, n, sizeof(sparse[0]), s4_tw_intcmp );
+          for( i = 0; i < n; i++ )
+            fprintf( fp, "  POSSIBLE FILE SIZE ERROR I=%d\n", sparse[i] );
+          fclose( fp );
+        }
+    }
+  s4_filsys_close( fs );
+
+  printf("write test: %s\n", bad ? "FAILED" : "ok" );
+  return bad;
+}
+
+/* Truncate and remove the -w tree in img; then its free counts
+   should be those of pristine, a fresh image made the same way. */
+static int s4_unwrite_test( const char *img, const char *pristine )
+{
+  s4_filsys   filsys;
+  s4_filsys  *fs = &filsys;
+  s4_twfile   tf[ 4 ];
+  s4_freemap  fm;
+  long        keep, tfree;
+  int         i, nf, ino, tinode;
+  int         bad = 0;
+
+  if( s4_tw_open( pristine, fs ) )
+    return 1;
+  tfree  = fs->super.super.s_tfree;
+  tinode = fs->super.super.s_tinode;
+  s4_filsys_close( fs );
+
+  if( s4_tw_open( img, fs ) )
+    return 1;
+  nf = s4_tw_files( fs, tf );
+
+  /* big back into its single indirect block, then to a few bytes */
+  keep = (S4_NADDR - 3 + 5) * fs->bksz + 17;
+  if( s4_ok != s4_filsys_namei( fs, tf[1].path, &ino ) ||
+      s4_ok != s4_filsys_truncate( fs, ino, keep ) )
+    bad++;
+  bad += s4_tw_check( fs, &tf[1], keep );
+  if( s4_ok != s4_filsys_truncate( fs, ino, 10 ) )
+    bad++;
+  bad += s4_tw_check( fs, &tf[1], 10 );
+
+  for( i = 0; i < nf; i++ )
+    if( s4_ok != s4_filsys_unlink( fs, tf[i].path ) )
+      {
+        printf("unlink %s failed\n", tf[i].path );
+        bad++;
+      }
+  if( s4_ok != s4_filsys_rmdir( fs, TW_DIR ) )
+    {
+      printf("rmdir %s failed\n", TW_DIR );
+      bad++;
+    }
+  if( s4_ok != s4_filsys_close( fs ) )
+    bad++;
+
+  if( s4_tw_open( img, fs ) )
+    return 1;
+  if( fs->super.super.s_tfree != tfree ||
+      fs->super.super.s_tinode != tinode )
+    {
+      printf("%s: %d free blocks, %d free inodes; pristine had %ld, %d\n",
+             img, (int)fs->super.super.s_tfree,
+             (int)fs->super.super.s_tinode, tfree, tinode );
+      bad++;
+    }
+  if( s4_ok != s4_filsys_freemap( fs, &fm ) )
+    bad++;
+  else
+    {
+      if( fm.nfree != tfree || fm.ndup || fm.nbad || fm.cycle || fm.broken )
+        {
+          printf("%s: free list has %ld blocks, expected %ld\n",
+                 img, fm.nfree, tfree );
+          s4_freemap_show( &fm );
+          bad++;
+        }
+      s4_freemap_free( &fm );
+    }
+  s4_filsys_close( fs );
+
+  printf("unwrite test: %s\n", bad ? "FAILED" : "ok" );
+  return bad;
+}
+
+
+
+/* ---------------------------------------------------------------- */
+/* Swap checks: the bulk kernels against field-at-a-time loops, on
+   random blocks.  S4_SWAP=scalar|ssse3|avx2 picks the kernel. */
+
+static void s4_swap_ref( s4_fsu *fsu, int btype )
+{
+  int i;
+
+  switch( btype )
+    {
+    case s4b_super:
+      {
+        struct s4_dfilsys *fs = &fsu->super;
+
+        fs->s_magic = s4swapi( fs->s_magic );
+        fs->s_isize = s4swaph( fs->s_isize );
+        fs->s_fsize = s4swapi( fs->s_fsize );
+        fs->s_nfree = s4swaph( fs->s_nfree );
+        for( i = 0; i < S4_NICFREE; i++ )
+          fs->s_free[i] = s4swapi( fs->s_free[i] );
+        fs->s_ninode = s4swaph( fs->s_ninode );
+        for( i = 0; i < S4_NICINOD; i++ )
+          fs->s_inode[i] = s4swaph( fs->s_inode[i] );
+        for( i = 0; i < 4; i++ )
+          fs->s_vinfo[i] = s4swaph( fs->s_vinfo[i] );
+        fs->s_time   = s4swapi( fs->s_time );
+        fs->s_tfree  = s4swapi( fs->s_tfree );
+        fs->s_tinode = s4swaph( fs->s_tinode );
+        fs->s_type   = s4swapi( fs->s_type );
+      }
+      break;
+
+    case s4b_ino:
+      {
+        struct s4_dinode *inop;
+
+        for( i = 0; i < S4_INOPB ; i++ )
+          {
+            inop = &fsu->dino[i];
+            inop->di_mode  = s4swaph( inop->di_mode );
+            inop->di_nlink = s4swaph( inop->di_nlink );
+            inop->di_uid   = s4swaph( inop->di_uid );
+            inop->di_gid   = s4swaph( inop->di_gid );
+            inop->di_size  = s4swapi( inop->di_size );
+            inop->di_atime = s4swapi( inop->di_atime );
+            inop->di_mtime = s4swapi( inop->di_mtime );
+            inop->di_ctime = s4swapi( inop->di_ctime );
+          }
+      }
+      break;
+
+    case s4b_idx:
+      for( i = 0; i < S4_NINDIR; i++ )
+        fsu->indir[ i ] = s4swapi( fsu->indir[ i ] );
+      break;
+
+    case s4b_dir:
+      for( i = 0; i < S4_NDIRECT ; i++ )
+        fsu->dir[i].d_ino = s4swaph( fsu->dir[i].d_ino );
+      break;
+
+    case s4b_linkcnt:
+      for( i = 0; i < S4_SPERB; i++ )
+        fsu->links[ i ] = s4swaph( fsu->links[ i ] );
+      break;
+
+    case s4b_free:
+      fsu->free.df_nfree = s4swapi( fsu->free.df_nfree );
+      for( i = 0; i < S4_NICFREE; i++ )
+        fsu->free.df_free[ i ] = s4swapi( fsu->free.df_free[ i ] );
+      break;
+    }
+}
+
+static void s4_swap_fill( char *buf, int n )
+{
+  while( n-- )
+    *buf++ = rand();
+}
+
+/* errors */
+static int s4_swap_test( void )
+{
+  static const int btypes[] = { s4b_super, s4b_ino, s4b_idx, s4b_dir,
+                                s4b_linkcnt, s4b_free, -1 };
+  s4_fsu   a, b;
+  char     dab[ 3 * 64 + 16 ], dab2[ sizeof(dab) ];
+  int      la[ 64 ], lb[ 64 ];
+  int      i, t, n, be, bad = 0;
+  unsigned char *s;
+
+  srand( 4077 );
+  printf("\nSwap kernel: %s\n", s4_swap_kernel() );
+
+  for( t = 0; btypes[t] >= 0; t++ )
+    {
+      for( i = 0; i < 100; i++ )
+        {
+          s4_swap_fill( a.buf, sizeof(a.buf) );
+          b = a;
+          s4_fsu_swap( &a, btypes[t] );
+          s4_swap_ref( &b, btypes[t] );
+          if( memcmp( a.buf, b.buf, sizeof(a.buf) ) )
+            break;
+        }
+      printf("  %-8s %s\n", s4btypestr( btypes[t] ),
+             i < 100 ? "MISMATCH" : "ok" );
+      bad += i < 100;
+    }
+
+  /* every length and alignment, for the tails */
+  for( n = 0; n < 64; n++ )
+    for( i = 0; i < 4; i++ )
+      {
+        s4_swap_fill( a.buf, sizeof(a.buf) );
+        b = a;
+        s4_swap32( a.buf + 4 * i, n );
+        s4_swap16( a.buf + 512 + 2 * i, n );
+        for( t = 0; t < n; t++ )
+          {
+            ((int32_t*)(b.buf + 4 * i))[t] =
+              s4swapi( ((int32_t*)(b.buf + 4 * i))[t] );
+            ((int16_t*)(b.buf + 512 + 2 * i))[t] =
+              s4swaph( ((int16_t*)(b.buf + 512 + 2 * i))[t] );
+          }
+        if( memcmp( a.buf, b.buf, sizeof(a.buf) ) )
+          {
+            printf("  swap16/32 MISMATCH, n %d at %d\n", n, i );
+            bad++;
+          }
+      }
+
+  /* 3 byte disk addresses both ways, each length and byte order */
+  for( be = 0; be < 2; be++ )
+    for( n = 0; n <= 64; n++ )
+      {
+        s4_swap_fill( dab, sizeof(dab) );
+        s4_dab_decode( la, dab, n, be );
+        for( i = 0, s = (unsigned char*)dab; i < n; i++, s += 3 )
+          lb[i] = be ? (s[0] << 16) + (s[1] << 8) + s[2]
+                     : (s[2] << 16) + (s[1] << 8) + s[0];
+        memcpy( dab2, dab, sizeof(dab) );
+        s4_dab_encode( dab2, lb, n, be );
+        if( memcmp( la, lb, n * sizeof(int) ) ||
+            memcmp( dab, dab2, sizeof(dab) ) )
+          {
+            printf("  dab MISMATCH, n %d %s\n", n, be ? "be" : "le" );
+            bad++;
+          }
+      }
+
+  printf("swap test: %s\n", bad ? "FAILED" : "ok" );
+  return bad;
+}
@@ -53,6 +53,7 @@ typedef struct
   char    *pname;          /* program name */
   int      xflag;          /* eXplore vol */
   int      dflag;          /* debug level */
+  int      statsflag;      /* show I/O counters at the end */
 
   s4_vol   ivinfo;         /* inputdisk info */
   s4_vol   ovinfo;         /* output disk info */
@@ -126,6 +127,9 @@ int main( int argc, char **argv )
   if( (rv = s4vol_parse_args( argc, argv, &cx )) )
     goto done;
 
+  if( cx.dflag )
+    s4_log_set( cx.dflag > 1 ? S4_LOG_DEBUG : S4_LOG_INFO, S4_LOG_ALL );
+
   if( (rv = s4vol_consider( &cx )) )
     goto done;
 
@@ -141,6 +145,9 @@ int main( int argc, char **argv )
 static void s4volcx_init( s4volcx *cx )
 {
   cx->pname   = NULL;
+  cx->xflag   = 0;
+  cx->dflag   = 0;
+  cx->statsflag = 0;
 
   memset( &cx->ivinfo, 0, sizeof( cx->ivinfo ));
   memset( &cx->ovinfo, 0, sizeof( cx->ovinfo ));
@@ -301,6 +308,10 @@ static int s4vol_parse_args( int argc, char **argv, s4volcx *cx )
         {
           cx->dflag++; continue;
         }
+      else if( !strcmp( argv[0], "--stats" ) )
+        {
+          cx->statsflag = 1; continue;
+        }
       else 
         {
           printf("unexpected arg '%s' or missing value\n", argv[0] );
@@ -314,7 +325,7 @@ static int s4vol_parse_args( int argc, char **argv, s4volcx *cx )
     {
       printf("\nUsage: %s -i ivol -o ovol -io modvol\n"
              "         -f fs -l loader -h heads -c cyls -s seccyl\n"
-             "         -p pagespace -F -3 -bb -nobb -x -d\n\n"
+             "         -p pagespace -F -3 -bb -nobb -x -d --stats\n\n"
              "-i input-volume         opt: copy source\n"
              "-o output-volume        opt: show info\n\n"
              "-io modify-volume       opt: show info\n\n"
@@ -329,7 +340,8 @@ static int s4vol_parse_args( int argc, char **argv, s4volcx *cx )
              "-F                      use 5\" floppy defaults\n\n"
              "-3                      use 3-1/4\" floppy defaults\n\n"
              "-x                      eXpanded volume output\n"
-             "-d ...                  increase debug output\n\n",
+             "-d ...                  increase debug output\n"
+             "--stats                 show I/O counters at the end\n\n",
              cx->pname );
     }
 
@@ -568,12 +580,21 @@ static int s4vol_execute( s4volcx *cx )
   s4_init_vol( "s4vol",  cx->ovinfo.fd, cx->cyls, cx->heads, 512, 
                cx->pscyl, cx->ovhbd, &cx->ovinfo );
 
-  /* Write the bad block table */
+  /* full size up front, so the unwritten parts stay holes */
+  if( s4_ok != s4_set_size( cx->ovinfo.fd,
+                            (off_t)cx->trks * cx->pstrk * 512 ) )
+    {
+      rv++;
+      goto done;
+    }
+
+  /* Write the bad block table, where s4_open_vol will look */
   memset( fsu.buf, 0, sizeof(fsu.buf) );
   fsu.bbt[0].cyl    = S4_NO_BB_CHECKSUM;  /* turn off BBT and LBA mapping */
   fsu.bbt[0].badblk = S4_NO_BB_CHECKSUM; 
-  if( s4_ok != s4_seek_write( cx->ovinfo.fd, cx->ovinfo.bbt_ba/512, 
-                              fsu.buf, sizeof(fsu.buf) ) )
+  if( s4_ok != s4_pwrite( cx->ovinfo.fd,
+                          LBA_TO_VOL_OFFSET( &cx->ovinfo, cx->ovinfo.bbt_ba ),
+                          fsu.buf, sizeof(fsu.buf) ) )
     {
       rv++;
       goto done;
@@ -611,6 +632,17 @@ static int s4vol_execute( s4volcx *cx )
 
  done:
 
+  /* both volumes together */
+  if( cx->statsflag && cx->ovinfo.fname )
+    {
+      s4_stats st;
+
+      s4_vol_stats( &cx->ovinfo, &st );
+      if( cx->infile )
+        s4_stats_add( &st, &cx->ivinfo.stats );
+      s4_stats_show( &st );
+    }
+
   return rv;
 }
 
@@ -766,7 +798,7 @@ static int s4vol_new_vhbd( s4volcx *cx )
   s4_fsu_show( (s4_fsu*)vh, s4b_vhbd );  
 
   s4_fsu_swap( (s4_fsu*)vh, s4b_vhbd );
-  if( s4_ok != s4_seek_write( cx->ovinfo.fd, 0, (char*)vh, 512 ))
+  if( s4_ok != s4_pwrite( cx->ovinfo.fd, 0, (char*)vh, 512 ))
     rv++;
 
   if( !rv  )
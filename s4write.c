@@ -0,0 +1,862 @@
+/*
+ * s4write.c -- changing a filesystem, see s4d.h
+ *
+ * Blocks are allocated and freed through the superblock free cache
+ * and the s4_fblk chain, and inodes through s_inode, as the kernel
+ * does.  The superblock is changed in memory only and written by
+ * s4_filsys_sync or s4_filsys_close, so a run of allocations costs
+ * no I/O until the cache needs refilling, which takes a whole free
+ * list block at once.  Everything else is written through the block
+ * cache as it changes.
+ */
+
+#include <s4d.h>
+
+#include <time.h>
+
+
+/* blocks a write or truncate holds, from the free cache */
+typedef struct
+{
+  s4_filsys  *fs;
+  int         nindir;
+  int         noalloc;          /* map only, holes stay holes */
+  s4_daddr    pool[ S4_NICFREE ];
+  int         npool;
+
+} s4w;
+
+
+static s4err s4w_read( s4_filsys *fs, s4_daddr fblk, s4_fsu *fsu )
+{
+  return s4_filsys_read_blk( fs, fblk, fs->bksz / 512, fsu->buf, fs->bksz );
+}
+
+static s4err s4w_write( s4_filsys *fs, s4_daddr fblk, s4_fsu *fsu )
+{
+  return s4_filsys_cache_write( fs, fblk, fsu->buf );
+}
+
+static int s4w_inopb( s4_filsys *fs )
+{
+  return fs->bksz / sizeof(struct s4_dinode);
+}
+
+
+s4err s4_filsys_sync( s4_filsys *fs )
+{
+  s4_fsu   fsu;
+  s4err    rv = s4_ok;
+
+  if( fs->sdirty )
+    {
+      fs->super.super.s_time = time( NULL );
+      fsu = fs->super;
+      if( fs->doswap )
+        s4_stats_swap( &fs->vinfo->stats, &fsu, s4b_super );
+
+      /* where s4_vol_open_filsys read it */
+      rv = s4_pwrite( fs->vinfo->fd,
+                      fs->part->partoff + PBA_TO_OFFSET( fs->vinfo, 1 ),
+                      fsu.buf, 512 );
+      if( s4_ok == rv )
+        fs->sdirty = 0;
+    }
+
+  if( s4_ok != s4_filsys_cache_flush( fs ) )
+    rv = s4_write;
+  return rv;
+}
+
+
+/* ---------------------------------------------------------------- */
+/* blocks */
+
+
+int s4_filsys_balloc( s4_filsys *fs, int n, s4_daddr *bnos )
+{
+  struct s4_dfilsys *sp = &fs->super.super;
+  s4_fsu             fsu;
+  s4_daddr           bno;
+  int                got;
+
+  for( got = 0; got < n && sp->s_nfree > 0 ; )
+    {
+      bno = sp->s_free[ --sp->s_nfree ];
+      if( !bno )
+        {
+          /* end of the chain */
+          sp->s_nfree = 0;
+          break;
+        }
+      if( bno < sp->s_isize || bno >= sp->s_fsize )
+        {
+          printf("bad free block %d\n", bno );
+          sp->s_nfree = 0;
+          break;
+        }
+
+      /* the last one is the next batch */
+      if( !sp->s_nfree )
+        {
+          if( s4_ok != s4w_read( fs, bno, &fsu ) )
+            {
+              sp->s_free[ sp->s_nfree++ ] = bno;
+              break;
+            }
+          if( fs->doswap )
+            s4_fsu_swap( &fsu, s4b_free );
+          if( fsu.free.df_nfree < 0 || fsu.free.df_nfree > S4_NICFREE )
+            {
+              printf("bad free list block %d, %d entries\n",
+                     bno, fsu.free.df_nfree );
+              fsu.free.df_nfree = 0;
+            }
+          sp->s_nfree = fsu.free.df_nfree;
+          memcpy( sp->s_free, fsu.free.df_free,
+                  sp->s_nfree * sizeof(sp->s_free[0]) );
+        }
+
+      bnos[ got++ ] = bno;
+      sp->s_tfree--;
+      fs->sdirty = 1;
+    }
+
+  return got;
+}
+
+
+s4err s4_filsys_bfree( s4_filsys *fs, s4_daddr bno )
+{
+  struct s4_dfilsys *sp = &fs->super.super;
+  s4_fsu             fsu;
+  s4err              rv;
+
+  if( bno < sp->s_isize || bno >= sp->s_fsize )
+    return s4_range;
+
+  /* an empty cache starts a chain of its own */
+  if( !sp->s_nfree )
+    {
+      sp->s_free[0] = 0;
+      sp->s_nfree   = 1;
+    }
+
+  /* full, so this block takes the cache and becomes the link to it */
+  if( sp->s_nfree >= S4_NICFREE )
+    {
+      memset( &fsu, 0, sizeof(fsu) );
+      fsu.free.df_nfree = sp->s_nfree;
+      memcpy( fsu.free.df_free, sp->s_free, sizeof(sp->s_free) );
+      if( fs->doswap )
+        s4_fsu_swap( &fsu, s4b_free );
+      if( s4_ok != (rv = s4w_write( fs, bno, &fsu )) )
+        return rv;
+      sp->s_nfree = 0;
+    }
+
+  sp->s_free[ sp->s_nfree++ ] = bno;
+  sp->s_tfree++;
+  fs->sdirty = 1;
+  return s4_ok;
+}
+
+
+/* one block for a file, a pool's worth from the free cache at a time */
+static s4err s4w_alloc( s4w *w, s4_daddr *bnop )
+{
+  s4_daddr  got[ S4_NICFREE ];
+  int       i;
+
+  if( !w->npool )
+    {
+      w->npool = s4_filsys_balloc( w->fs, S4_NICFREE, got );
+
+      /* handed out from the end, so in the order they came */
+      for( i = 0; i < w->npool; i++ )
+        w->pool[ w->npool - 1 - i ] = got[i];
+    }
+  if( !w->npool )
+    return s4_range;
+
+  *bnop = w->pool[ --w->npool ];
+  return s4_ok;
+}
+
+/* give back what the pool didn't use, so the free list is as it was */
+static s4err s4w_done( s4w *w )
+{
+  s4err rv = s4_ok;
+  int   i;
+
+  for( i = 0; i < w->npool; i++ )
+    if( s4_ok != s4_filsys_bfree( w->fs, w->pool[i] ) )
+      rv = s4_write;
+  w->npool = 0;
+  return rv;
+}
+
+
+/* ---------------------------------------------------------------- */
+/* inodes */
+
+
+s4err s4_filsys_iput( s4_filsys *fs, int ino, struct s4_dinode *dp,
+                      const s4_daddr *addrs )
+{
+  struct s4_dinode *ip;
+  s4_fsu            fsu;
+  s4_daddr          fblk;
+  s4err             rv;
+  int               inopb = s4w_inopb( fs );
+
+  if( ino < 1 || ino > (fs->super.super.s_isize - 2) * inopb )
+    return s4_range;
+
+  fblk = 2 + (ino - 1) / inopb;
+  if( s4_ok != (rv = s4w_read( fs, fblk, &fsu )) )
+    return rv;
+
+  ip  = &fsu.dino[ (ino - 1) % inopb ];
+  *ip = *dp;
+  if( fs->doswap )
+    s4_swap_inodes( ip, 1 );
+  if( addrs )
+    s4_dinode_set_addrs( ip, 1, fs->doswap, addrs );
+
+  return s4w_write( fs, fblk, &fsu );
+}
+
+
+/* refill s_inode with one pass over the i-list */
+static s4err s4w_iscan( s4_filsys *fs )
+{
+  struct s4_dfilsys *sp = &fs->super.super;
+  struct s4_dinode  *ip;
+  s4err              rv = s4_ok;
+  char              *buf;
+  int                inopb = s4w_inopb( fs );
+  int                fblk, n, i, ino;
+
+  if( !(buf = malloc( 64L * fs->bksz )) )
+    return s4_error;
+
+  ino = 1;
+  for( fblk = 2; fblk < sp->s_isize && sp->s_ninode < S4_NICINOD;
+       fblk += n )
+    {
+      n = sp->s_isize - fblk;
+      if( n > 64 )
+        n = 64;
+      if( s4_ok != (rv = s4_filsys_read_fblks( fs, fblk, n, buf )) )
+        break;
+
+      ip = (struct s4_dinode *)buf;
+      for( i = 0; i < n * inopb && sp->s_ninode < S4_NICINOD; i++, ino++ )
+        if( !ip[i].di_mode && ino > S4_ROOTINO )
+          sp->s_inode[ sp->s_ninode++ ] = ino;
+    }
+
+  free( buf );
+  fs->sdirty = 1;
+  return rv;
+}
+
+
+s4err s4_filsys_ialloc( s4_filsys *fs, int mode, int *inop )
+{
+  struct s4_dfilsys *sp = &fs->super.super;
+  struct s4_dinode   di;
+  s4_daddr           addrs[ S4_NADDR ];
+  s4err              rv;
+  int                ino;
+
+  for( ;; )
+    {
+      if( sp->s_ninode <= 0 )
+        {
+          sp->s_ninode = 0;
+          if( s4_ok != (rv = s4w_iscan( fs )) )
+            return rv;
+          if( !sp->s_ninode )
+            {
+              printf("%s: out of inodes\n", fs->vinfo->fname );
+              return s4_range;
+            }
+        }
+
+      /* the list can be stale */
+      ino = sp->s_inode[ --sp->s_ninode ];
+      fs->sdirty = 1;
+      if( s4_ok != (rv = s4_filsys_iget( fs, ino, &di, NULL )) )
+        return rv;
+      if( !di.di_mode )
+        break;
+    }
+
+  memset( &di, 0, sizeof(di) );
+  memset( addrs, 0, sizeof(addrs) );
+  di.di_mode  = mode;
+  di.di_nlink = 1;
+  di.di_atime = di.di_mtime = di.di_ctime = time( NULL );
+  if( s4_ok != (rv = s4_filsys_iput( fs, ino, &di, addrs )) )
+    return rv;
+
+  if( sp->s_tinode > 0 )
+    sp->s_tinode--;
+  *inop = ino;
+  return s4_ok;
+}
+
+
+s4err s4_filsys_ifree( s4_filsys *fs, int ino )
+{
+  struct s4_dfilsys *sp = &fs->super.super;
+  struct s4_dinode   di;
+  s4err              rv;
+
+  memset( &di, 0, sizeof(di) );
+  if( s4_ok != (rv = s4_filsys_iput( fs, ino, &di, NULL )) )
+    return rv;
+
+  if( sp->s_ninode < S4_NICINOD )
+    sp->s_inode[ sp->s_ninode++ ] = ino;
+  sp->s_tinode++;
+  fs->sdirty = 1;
+  return s4_ok;
+}
+
+
+/* ---------------------------------------------------------------- */
+/* file contents */
+
+
+/* a zeroed block for an indirect block */
+static s4err s4w_alloc_zero( s4w *w, s4_daddr *bnop )
+{
+  s4_fsu   fsu;
+  s4err    rv;
+
+  if( s4_ok != (rv = s4w_alloc( w, bnop )) )
+    return rv;
+  memset( &fsu, 0, sizeof(fsu) );
+  return s4w_write( w->fs, *bnop, &fsu );
+}
+
+
+/* FS block for lbn, allocating it and the indirect blocks to it as
+   needed; *newp says the block is new, and not yet written.  With
+   noalloc set a hole is block 0. */
+static s4err s4w_bmap( s4w *w, s4_daddr *addrs, long lbn, s4_daddr *fblkp,
+                       int *newp )
+{
+  s4_filsys *fs = w->fs;
+  s4_fsu     fsu;
+  s4_daddr   fblk, ent;
+  s4err      rv;
+  long       n = w->nindir;
+  int        lvl, idx;
+
+  *newp   = 0;
+  *fblkp  = 0;
+  if( lbn < S4_NADDR - 3 )
+    {
+      if( !addrs[ lbn ] && !w->noalloc )
+        {
+          if( s4_ok != (rv = s4w_alloc( w, &addrs[ lbn ] )) )
+            return rv;
+          *newp = 1;
+        }
+      *fblkp = addrs[ lbn ];
+      return s4_ok;
+    }
+
+  lbn -= S4_NADDR - 3;
+  for( lvl = 1; lvl <= 3 && lbn >= n; lvl++ )
+    {
+      lbn -= n;
+      n   *= w->nindir;
+    }
+  if( lvl > 3 )
+    return s4_range;
+
+  if( !addrs[ S4_NADDR - 4 + lvl ] )
+    {
+      if( w->noalloc )
+        return s4_ok;
+      rv = s4w_alloc_zero( w, &addrs[ S4_NADDR - 4 + lvl ] );
+      if( s4_ok != rv )
+        return rv;
+    }
+  fblk = addrs[ S4_NADDR - 4 + lvl ];
+
+  for( ; lvl > 0 ; lvl-- )
+    {
+      n  /= w->nindir;
+      idx = (lbn / n) % w->nindir;
+      if( s4_ok != (rv = s4w_read( fs, fblk, &fsu )) )
+        return rv;
+
+      ent = fsu.indir[ idx ];
+      if( fs->doswap )
+        ent = s4swapi( ent );
+      if( !ent && w->noalloc )
+        return s4_ok;
+      if( !ent )
+        {
+          rv = lvl > 1 ? s4w_alloc_zero( w, &ent ) : s4w_alloc( w, &ent );
+          if( s4_ok != rv )
+            return rv;
+          *newp = 1 == lvl;
+          fsu.indir[ idx ] = fs->doswap ? s4swapi( ent ) : ent;
+          if( s4_ok != (rv = s4w_write( fs, fblk, &fsu )) )
+            return rv;
+        }
+      fblk = ent;
+    }
+
+  *fblkp = fblk;
+  return s4_ok;
+}
+
+
+long s4_filsys_write_file( s4_filsys *fs, int ino, off_t offset, long len,
+                           const char *buf )
+{
+  struct s4_dinode  di;
+  s4_daddr          addrs[ S4_NADDR ];
+  s4_daddr          fblk;
+  s4_fsu            fsu;
+  s4w               w;
+  s4err             rv;
+  long              done, boff, n;
+  int               isnew;
+
+  memset( &w, 0, sizeof(w) );
+  w.fs     = fs;
+  w.nindir = fs->bksz / sizeof(s4_daddr);
+
+  if( s4_ok != (rv = s4_filsys_iget( fs, ino, &di, addrs )) )
+    {
+      printf("reading inode %d: %s\n", ino, s4errstr(rv) );
+      return -1;
+    }
+  if( offset < 0 )
+    return -1;
+
+  for( done = 0; done < len; done += n )
+    {
+      boff = (offset + done) % fs->bksz;
+      n    = fs->bksz - boff;
+      if( n > len - done )
+        n = len - done;
+
+      rv = s4w_bmap( &w, addrs, (offset + done) / fs->bksz, &fblk, &isnew );
+      if( s4_ok != rv )
+        break;
+
+      if( n < fs->bksz )
+        {
+          if( isnew )
+            memset( &fsu, 0, sizeof(fsu) );
+          else if( s4_ok != (rv = s4w_read( fs, fblk, &fsu )) )
+            break;
+        }
+      memcpy( fsu.buf + boff, buf + done, n );
+      if( s4_ok != (rv = s4w_write( fs, fblk, &fsu )) )
+        break;
+    }
+
+  /* what got written counts, even short */
+  if( offset + done > di.di_size )
+    di.di_size = offset + done;
+  di.di_mtime = di.di_ctime = time( NULL );
+  if( s4_ok != s4_filsys_iput( fs, ino, &di, addrs ) || s4_ok != s4w_done( &w ) )
+    rv = s4_write;
+
+  if( s4_ok != rv )
+    {
+      printf("writing inode %d at %ld: %s\n", ino, (long)offset + done,
+             s4errstr(rv) );
+      return done ? done : -1;
+    }
+  return done;
+}
+
+
+/* free what's under indirect block *fblkp at level lvl, covering
+   logical blocks from base, past keep; free it too if all of it goes */
+static s4err s4w_trunc( s4w *w, s4_daddr *fblkp, int lvl, long base,
+                        long keep )
+{
+  s4_filsys *fs = w->fs;
+  s4_fsu     fsu;
+  s4_daddr   ent;
+  s4err      rv;
+  long       span = 1;
+  int        i, changed = 0;
+
+  if( !*fblkp )
+    return s4_ok;
+
+  for( i = 1; i < lvl; i++ )
+    span *= w->nindir;
+
+  if( s4_ok != (rv = s4w_read( fs, *fblkp, &fsu )) )
+    return rv;
+
+  for( i = 0; i < w->nindir; i++, base += span )
+    {
+      if( base + span <= keep )
+        continue;
+      ent = fs->doswap ? s4swapi( fsu.indir[i] ) : fsu.indir[i];
+      if( !ent )
+        continue;
+
+      if( lvl > 1 )
+        rv = s4w_trunc( w, &ent, lvl - 1, base, keep );
+      else if( s4_ok == (rv = s4_filsys_bfree( fs, ent )) )
+        ent = 0;
+      if( s4_ok != rv )
+        return rv;
+
+      fsu.indir[i] = fs->doswap ? s4swapi( ent ) : ent;
+      changed = 1;
+    }
+
+  /* all gone if nothing before keep was under it */
+  if( base - span * w->nindir >= keep )
+    {
+      rv = s4_filsys_bfree( fs, *fblkp );
+      if( s4_ok == rv )
+        *fblkp = 0;
+      return rv;
+    }
+  return changed ? s4w_write( fs, *fblkp, &fsu ) : s4_ok;
+}
+
+
+s4err s4_filsys_truncate( s4_filsys *fs, int ino, long size )
+{
+  struct s4_dinode  di;
+  s4_daddr          addrs[ S4_NADDR ];
+  s4_daddr          fblk;
+  s4_fsu            fsu;
+  s4w               w;
+  s4err             rv;
+  long              keep, base, n;
+  int               i, lvl;
+
+  memset( &w, 0, sizeof(w) );
+  w.fs     = fs;
+  w.nindir = fs->bksz / sizeof(s4_daddr);
+
+  if( size < 0 )
+    return s4_range;
+  if( s4_ok != (rv = s4_filsys_iget( fs, ino, &di, addrs )) )
+    return rv;
+
+  if( size < di.di_size )
+    {
+      keep = (size + fs->bksz - 1) / fs->bksz;
+
+      for( i = keep; i < S4_NADDR - 3 && s4_ok == rv; i++ )
+        if( addrs[i] && s4_ok == (rv = s4_filsys_bfree( fs, addrs[i] )) )
+          addrs[i] = 0;
+
+      base = S4_NADDR - 3;
+      n    = w.nindir;
+      for( lvl = 1; lvl <= 3 && s4_ok == rv; lvl++, base += n, n *= w.nindir )
+        rv = s4w_trunc( &w, &addrs[ S4_NADDR - 4 + lvl ], lvl, base, keep );
+
+      /* a later write past the end reads back zeroes */
+      w.noalloc = 1;
+      if( s4_ok == rv && size % fs->bksz &&
+          s4_ok == (rv = s4w_bmap( &w, addrs, keep - 1, &fblk, &i )) &&
+          fblk && s4_ok == (rv = s4w_read( fs, fblk, &fsu )) )
+        {
+          memset( fsu.buf + size % fs->bksz, 0, fs->bksz - size % fs->bksz );
+          rv = s4w_write( fs, fblk, &fsu );
+        }
+    }
+
+  if( s4_ok == rv )
+    di.di_size = size;
+  di.di_mtime = di.di_ctime = time( NULL );
+  if( s4_ok != s4_filsys_iput( fs, ino, &di, addrs ) )
+    rv = s4_write;
+  return rv;
+}
+
+
+/* ---------------------------------------------------------------- */
+/* names */
+
+
+/* directory holding path, and the last part of it */
+static s4err s4w_parent( s4_filsys *fs, const char *path, int *dirp,
+                         char *name )
+{
+  const char *p;
+  char       *dpath;
+  s4err       rv;
+  size_t      n;
+
+  /* ignore trailing slashes */
+  for( n = strlen( path ); n > 0 && '/' == path[ n - 1 ]; n-- )
+    continue;
+  for( p = path + n; p > path && '/' != p[-1]; p-- )
+    continue;
+
+  n -= p - path;
+  if( !n || n > S4_DIRSIZ )
+    return s4_range;
+  memcpy( name, p, n );
+  name[n] = 0;
+  if( !strcmp( name, "." ) || !strcmp( name, ".." ) )
+    return s4_range;
+
+  if( !(dpath = strndup( path, p - path )) )
+    return s4_error;
+  rv = s4_filsys_namei( fs, dpath, dirp );
+  free( dpath );
+  return rv;
+}
+
+
+/* offset of name in dir, or of a free slot for it when ino is 0 */
+static s4err s4w_dirslot( s4_filsys *fs, int dir, const char *name,
+                          int ino, long *offp, int *inop )
+{
+  struct s4_dinode  di;
+  struct s4_direct  de[ S4_NDIRECT ];
+  s4err             rv;
+  long              off, n;
+  int               i;
+
+  if( s4_ok != (rv = s4_filsys_iget( fs, dir, &di, NULL )) )
+    return rv;
+  if( (di.di_mode & S_IFMT) != S_IFDIR )
+    return s4_range;
+
+  for( off = 0; off < di.di_size; off += n )
+    {
+      n = s4_filsys_read_file( fs, dir, off, fs->bksz, (char*)de );
+      if( n <= 0 )
+        return s4_read;
+      if( fs->doswap )
+        s4_swap_dirs( de, n / sizeof(de[0]) );
+
+      for( i = 0; i < n / sizeof(de[0]); i++ )
+        if( ino ? !de[i].d_ino
+                : de[i].d_ino && !strncmp( de[i].d_name, name, S4_DIRSIZ ) )
+          {
+            *offp = off + i * sizeof(de[0]);
+            if( inop )
+              *inop = de[i].d_ino;
+            return s4_ok;
+          }
+    }
+
+  /* no room, so on the end */
+  *offp = di.di_size;
+  return ino ? s4_ok : s4_range;
+}
+
+
+/* set the entry at off of dir */
+static s4err s4w_dirset( s4_filsys *fs, int dir, long off, const char *name,
+                         int ino )
+{
+  struct s4_direct de;
+
+  memset( &de, 0, sizeof(de) );
+  de.d_ino = ino;
+  strncpy( de.d_name, name, S4_DIRSIZ );
+  if( fs->doswap )
+    s4_swap_dirs( &de, 1 );
+
+  s4_filsys_ncache_purge( fs, dir );
+  if( sizeof(de) != s4_filsys_write_file( fs, dir, off, sizeof(de),
+                                          (char*)&de ) )
+    return s4_write;
+  return s4_ok;
+}
+
+
+static s4err s4w_enter( s4_filsys *fs, int dir, const char *name, int ino )
+{
+  s4err rv;
+  long  off;
+
+  if( s4_ok != (rv = s4w_dirslot( fs, dir, name, ino, &off, NULL )) )
+    return rv;
+  return s4w_dirset( fs, dir, off, name, ino );
+}
+
+
+/* add one to the link count of ino, or take one off */
+static s4err s4w_nlink( s4_filsys *fs, int ino, int delta )
+{
+  struct s4_dinode di;
+  s4err            rv;
+
+  if( s4_ok != (rv = s4_filsys_iget( fs, ino, &di, NULL )) )
+    return rv;
+  di.di_nlink += delta;
+  di.di_ctime  = time( NULL );
+  return s4_filsys_iput( fs, ino, &di, NULL );
+}
+
+
+s4err s4_filsys_create( s4_filsys *fs, const char *path, int mode, int *inop )
+{
+  struct s4_dinode di;
+  char             name[ S4_DIRSIZ + 1 ];
+  s4err            rv;
+  int              dir, ino;
+
+  if( !(mode & S_IFMT) )
+    mode |= S_IFREG;
+
+  if( s4_ok != (rv = s4w_parent( fs, path, &dir, name )) )
+    return rv;
+
+  /* there already, so overwrite it */
+  if( s4_ok == s4_filsys_lookup( fs, dir, name, &ino ) )
+    {
+      if( s4_ok != (rv = s4_filsys_iget( fs, ino, &di, NULL )) )
+        return rv;
+      if( (di.di_mode & S_IFMT) != (mode & S_IFMT) )
+        return s4_range;
+      if( S_IFREG == (mode & S_IFMT) &&
+          s4_ok != (rv = s4_filsys_truncate( fs, ino, 0 )) )
+        return rv;
+      if( inop )
+        *inop = ino;
+      return s4_ok;
+    }
+
+  if( s4_ok != (rv = s4_filsys_ialloc( fs, mode, &ino )) )
+    return rv;
+  if( s4_ok != (rv = s4w_enter( fs, dir, name, ino )) )
+    {
+      s4_filsys_ifree( fs, ino );
+      return rv;
+    }
+
+  if( inop )
+    *inop = ino;
+  return s4_ok;
+}
+
+
+/* take back a directory mkdir couldn't finish, and its entry in dir
+   if name is given; returns rv */
+static s4err s4w_unmkdir( s4_filsys *fs, int dir, const char *name, int ino,
+                          s4err rv )
+{
+  long  off;
+
+  if( name && s4_ok == s4w_dirslot( fs, dir, name, 0, &off, NULL ) )
+    s4w_dirset( fs, dir, off, name, 0 );
+  s4_filsys_truncate( fs, ino, 0 );
+  s4_filsys_ifree( fs, ino );
+  return rv;
+}
+
+
+s4err s4_filsys_mkdir( s4_filsys *fs, const char *path, int mode, int *inop )
+{
+  char             name[ S4_DIRSIZ + 1 ];
+  s4err            rv;
+  int              dir, ino;
+
+  if( s4_ok != (rv = s4w_parent( fs, path, &dir, name )) )
+    return rv;
+  if( s4_ok == s4_filsys_lookup( fs, dir, name, &ino ) )
+    return s4_range;
+
+  if( s4_ok != (rv = s4_filsys_ialloc( fs, S_IFDIR | (mode & 07777), &ino )) )
+    return rv;
+
+  /* ".." and the parent's entry are the parent's two more links */
+  if( s4_ok != (rv = s4w_dirset( fs, ino, 0, ".", ino )) ||
+      s4_ok != (rv = s4w_dirset( fs, ino, sizeof(struct s4_direct),
+                                 "..", dir )) ||
+      s4_ok != (rv = s4w_nlink( fs, ino, 1 )) ||
+      s4_ok != (rv = s4w_enter( fs, dir, name, ino )) )
+    return s4w_unmkdir( fs, dir, NULL, ino, rv );
+  if( s4_ok != (rv = s4w_nlink( fs, dir, 1 )) )
+    return s4w_unmkdir( fs, dir, name, ino, rv );
+
+  if( inop )
+    *inop = ino;
+  return s4_ok;
+}
+
+
+/* drop name from its directory; the inode goes with its last link */
+static s4err s4w_remove( s4_filsys *fs, const char *path, int isdir )
+{
+  struct s4_direct  de;
+  struct s4_dinode  di;
+  s4_dir            d;
+  char              name[ S4_DIRSIZ + 1 ];
+  s4err             rv;
+  long              off;
+  int               dir, ino;
+
+  if( s4_ok != (rv = s4w_parent( fs, path, &dir, name )) ||
+      s4_ok != (rv = s4w_dirslot( fs, dir, name, 0, &off, &ino )) ||
+      s4_ok != (rv = s4_filsys_iget( fs, ino, &di, NULL )) )
+    return rv;
+
+  if( isdir != ((di.di_mode & S_IFMT) == S_IFDIR) )
+    return s4_range;
+
+  /* only "." and ".." */
+  if( isdir )
+    {
+      if( s4_ok != (rv = s4_filsys_opendir( fs, ino, &d )) )
+        return rv;
+      while( s4_ok == (rv = s4_filsys_readdir( &d, &de )) )
+        if( strncmp( de.d_name, ".", S4_DIRSIZ ) &&
+            strncmp( de.d_name, "..", S4_DIRSIZ ) )
+          return s4_range;
+      if( s4_range != rv )
+        return rv;
+    }
+
+  if( s4_ok != (rv = s4w_dirset( fs, dir, off, name, 0 )) )
+    return rv;
+
+  if( isdir )
+    {
+      s4_filsys_ncache_purge( fs, ino );
+      di.di_nlink = 0;
+      if( s4_ok != (rv = s4w_nlink( fs, dir, -1 )) )
+        return rv;
+    }
+  else if( --di.di_nlink > 0 )
+    {
+      di.di_ctime = time( NULL );
+      return s4_filsys_iput( fs, ino, &di, NULL );
+    }
+
+  if( s4_ok != (rv = s4_filsys_truncate( fs, ino, 0 )) )
+    return rv;
+  return s4_filsys_ifree( fs, ino );
+}
+
+
+s4err s4_filsys_unlink( s4_filsys *fs, const char *path )
+{
+  return s4w_remove( fs, path, 0 );
+}
+
+
+s4err s4_filsys_rmdir( s4_filsys *fs, const char *path )
+{
+  return s4w_remove( fs, path, 1 );
+}